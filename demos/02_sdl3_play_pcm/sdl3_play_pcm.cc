@@ -1,148 +1,885 @@
 #include <atomic>
+#include <cmath>
 #include <string>
+#include <future>
+#include <thread>
+#include <vector>
 #include <fstream>
+#include <algorithm>
 #include <condition_variable>
 
 extern "C" {
 #include <SDL3/SDL.h>
 }
 
-struct AudioBuffer {
-    std::unique_ptr<uint8_t[]> data;
-    size_t size = 0;
-    size_t pos = 0;
-};
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define PCM_MIX_SSE2 1
+#include <emmintrin.h>
+#endif
 
 static constexpr int kAudioChannels = 2;
 static constexpr int kAudioFreq = 48000;
 static constexpr float kAudioVolume = 1.0f; // volume ranges from 0.0 - 1.0
-static constexpr int kPcmBufferSize = 2 * 1920; // n * (48000*2*2*/100), bytes per n*10ms
+static constexpr int kPcmBufferMs = 20; // n*10ms of device format audio per pcm buffer
 static constexpr SDL_AudioFormat kAudioFormatS16Le = SDL_AUDIO_S16;
+static constexpr int kLowLatencyPeriodFrames = 256; // 5.3ms at 48kHz
+static constexpr int kConvertBlockFrames = 1024; // input frames converted per block on the reader thread
+static constexpr int kPrefetchBlocks = 8; // blocks of the next queued file read ahead of the current file's end
+static constexpr size_t kMaxPushRecords = 4096;
+static constexpr size_t kMaxLatencySamples = 1 << 20;
+static constexpr int kMaxMixerSources = 8;
+static constexpr int kSourceRingBuffers = 4; // ring capacity in pcm buffers
+static constexpr int kFadeFrames = 96; // 2ms ramp when a source is added or removed
+static constexpr int kMaxChannels = 8; // SDL supports up to 7.1
+
+// default stereo downmix matrices, row-major out x in, in SDL channel order.
+// ITU-R BS.775 coefficients, normalized so a full scale input on every channel does not clip
+static constexpr float kDownmix51ToStereo[2 * 6] = {
+    // FL     FR     FC     LFE    BL     BR
+    0.414f, 0.000f, 0.293f, 0.000f, 0.293f, 0.000f,
+    0.000f, 0.414f, 0.293f, 0.000f, 0.000f, 0.293f,
+};
+static constexpr float kDownmix71ToStereo[2 * 8] = {
+    // FL     FR     FC     LFE    BL     BR     SL     SR
+    0.320f, 0.000f, 0.227f, 0.000f, 0.227f, 0.000f, 0.227f, 0.000f,
+    0.000f, 0.320f, 0.227f, 0.000f, 0.000f, 0.227f, 0.000f, 0.227f,
+};
+
+// single producer single consumer byte ring: the source reader thread writes, the audio callback reads
+class SpscRing {
+public:
+    explicit SpscRing(size_t min_capacity) {
+        size_t capacity = 1;
+        while (capacity < min_capacity) {
+            capacity <<= 1;
+        }
+        data_ = std::make_unique<uint8_t[]>(capacity);
+        mask_ = capacity - 1;
+    }
+
+    size_t ReadAvailable() const {
+        return write_pos_.load(std::memory_order_acquire) - read_pos_.load(std::memory_order_relaxed);
+    }
+
+    size_t WriteAvailable() const {
+        return mask_ + 1 - (write_pos_.load(std::memory_order_relaxed) - read_pos_.load(std::memory_order_acquire));
+    }
+
+    // all or nothing, so whole sample frames are always published together
+    bool Write(const uint8_t *data, size_t size) {
+        if (WriteAvailable() < size) {
+            return false;
+        }
+        const size_t pos = write_pos_.load(std::memory_order_relaxed);
+        CopyIn(pos & mask_, data, size);
+        write_pos_.store(pos + size, std::memory_order_release);
+        return true;
+    }
+
+    size_t Read(uint8_t *data, size_t size) {
+        size = std::min(size, ReadAvailable());
+        const size_t pos = read_pos_.load(std::memory_order_relaxed);
+        CopyOut(pos & mask_, data, size);
+        read_pos_.store(pos + size, std::memory_order_release);
+        return size;
+    }
+
+private:
+    void CopyIn(size_t offset, const uint8_t *data, size_t size) {
+        const size_t first = std::min(size, mask_ + 1 - offset);
+        std::memcpy(data_.get() + offset, data, first);
+        std::memcpy(data_.get(), data + first, size - first);
+    }
+
+    void CopyOut(size_t offset, uint8_t *data, size_t size) const {
+        const size_t first = std::min(size, mask_ + 1 - offset);
+        std::memcpy(data, data_.get() + offset, first);
+        std::memcpy(data + first, data_.get(), size - first);
+    }
+
+    std::unique_ptr<uint8_t[]> data_;
+    size_t mask_ = 0;
+    alignas(64) std::atomic<size_t> write_pos_{0};
+    alignas(64) std::atomic<size_t> read_pos_{0};
+};
+
+struct MixerSourceOptions {
+    std::vector<std::string> files; // played back to back without a gap
+    SDL_AudioSpec spec = {
+        .format = kAudioFormatS16Le,
+        .channels = kAudioChannels,
+        .freq = kAudioFreq
+    }; // format of the pcm file
+    float gain = 1.0f; // gain ranges from 0.0 - 1.0
+    float pan = 0.0f; // -1.0 left, 0.0 center, 1.0 right
+    int start_ms = 0; // added to the mixer this long after playback starts
+    int stop_ms = -1; // removed from the mixer this long after playback starts, -1 means play to the end
+    std::vector<float> downmix; // row-major mixer channels x input channels, empty means the default matrix
+};
 
-static AudioBuffer buffers[2]; // using double buffering to avoid stuttering in audio playback
-static int active_buffer_index{0};
-static std::atomic_bool buffer_ready[2]{false, false};
-static std::unique_ptr<uint8_t[]> file_buffer;
-static auto mixed_buffer = std::make_unique<uint8_t[]>(kPcmBufferSize);
+struct MixerSource {
+    explicit MixerSource(size_t ring_capacity) : ring(ring_capacity) {
+    }
+
+    MixerSourceOptions options;
+    SpscRing ring;
+    std::ifstream file; // the file being read, files[0] until the reader moves on
+    std::thread reader;
+    SDL_AudioStream *converter = nullptr; // pcm file format to converter_spec, only used by the reader thread
+    SDL_AudioSpec converter_spec{}; // mixer format, or f32 in the input layout when downmix is used
+    std::vector<float> downmix; // row-major mixer channels x input channels, empty means no downmix
+    alignas(16) int16_t gains_s16[8]{}; // Q15 gain per sample lane, repeats every 8 samples
+    alignas(16) float gains_f32[4]{}; // gain per sample lane, repeats every 4 samples
+    std::atomic_bool end_of_file{false};
+    std::atomic_bool remove_requested{false};
+    std::atomic_bool retired{false}; // set by the audio callback once it will never touch this source again
+    std::atomic_int underruns{0};
+    float fade_gain = 0.0f; // only touched by the audio callback
+};
+
+// data pushed to the audio stream at push_ns, ending at stream byte offset end_bytes
+struct PushRecord {
+    uint64_t push_ns = 0;
+    uint64_t end_bytes = 0;
+};
+
+// only touched by the audio callback during playback, read by the main thread after the stream is destroyed
+struct LatencyStats {
+    std::vector<PushRecord> records; // ring buffer of pushes still queued in the audio stream
+    size_t record_head = 0;
+    size_t record_tail = 0;
+    std::vector<uint64_t> latencies_ns; // reserved before playback, never reallocated in the callback
+    uint64_t total_pushed_bytes = 0;
+    uint64_t device_buffer_ns = 0; // time to play out one device buffer
+    int bytes_per_second = 0;
+};
+
+struct PlayerOptions {
+    bool low_latency = false;
+    int period_frames = 0; // device buffer size in sample frames, 0 means SDL default
+    std::vector<MixerSourceOptions> sources; // sources[0] is the program feed
+};
+
+static std::atomic<MixerSource *> mixer_slots[kMaxMixerSources];
+static std::unique_ptr<uint8_t[]> mixed_buffer;
+static std::unique_ptr<uint8_t[]> source_buffer;
+static SDL_AudioSpec mixer_spec; // device native format, everything in the rings is already in this format
+static int pcm_buffer_frames = 0;
+static int pcm_buffer_size = 0;
+static int mixed_buffer_size = 0;
+static LatencyStats latency_stats;
 static std::condition_variable cv;
-static std::mutex cv_mutex, buffer_change_mutex;
+static std::mutex cv_mutex;
+
+// dst = saturate(dst + src * gain), gain is Q15 and repeats every 8 samples
+static void MixS16(int16_t *dst, const int16_t *src, size_t samples, const int16_t gains[8]) {
+    size_t i = 0;
+#ifdef PCM_MIX_SSE2
+    const __m128i gain = _mm_load_si128(reinterpret_cast<const __m128i *>(gains));
+    const __m128i round = _mm_set1_epi32(1 << 14);
+    for (; i + 8 <= samples; i += 8) {
+        const __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+        const __m128i lo = _mm_mullo_epi16(x, gain);
+        const __m128i hi = _mm_mulhi_epi16(x, gain);
+        const __m128i p0 = _mm_srai_epi32(_mm_add_epi32(_mm_unpacklo_epi16(lo, hi), round), 15);
+        const __m128i p1 = _mm_srai_epi32(_mm_add_epi32(_mm_unpackhi_epi16(lo, hi), round), 15);
+        const __m128i acc = _mm_loadu_si128(reinterpret_cast<const __m128i *>(dst + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), _mm_adds_epi16(acc, _mm_packs_epi32(p0, p1)));
+    }
+#endif
+    for (; i < samples; ++i) {
+        const int scaled = (src[i] * gains[i & 7] + (1 << 14)) >> 15;
+        dst[i] = static_cast<int16_t>(std::clamp(dst[i] + scaled, -32768, 32767));
+    }
+}
 
+// dst = dst + src * gain, gain repeats every 4 samples. the sum is clamped by ClampF32 after all sources
+static void MixF32(float *dst, const float *src, size_t samples, const float gains[4]) {
+    size_t i = 0;
+#ifdef PCM_MIX_SSE2
+    const __m128 gain = _mm_load_ps(gains);
+    for (; i + 4 <= samples; i += 4) {
+        const __m128 x = _mm_loadu_ps(src + i);
+        const __m128 acc = _mm_loadu_ps(dst + i);
+        _mm_storeu_ps(dst + i, _mm_add_ps(acc, _mm_mul_ps(x, gain)));
+    }
+#endif
+    for (; i < samples; ++i) {
+        dst[i] += src[i] * gains[i & 3];
+    }
+}
 
-// This function will be automatically called by the SDL3 library approximately every 10ms
-static void SDLCALL AudioStreamCB(void *userdata, SDL_AudioStream *stream, int additional_amount, int total_amount) {
-    std::memset(mixed_buffer.get(), 0, additional_amount);
+static void ClampF32(float *samples, size_t count) {
+    size_t i = 0;
+#ifdef PCM_MIX_SSE2
+    const __m128 lower = _mm_set1_ps(-1.0f);
+    const __m128 upper = _mm_set1_ps(1.0f);
+    for (; i + 4 <= count; i += 4) {
+        _mm_storeu_ps(samples + i, _mm_min_ps(_mm_max_ps(_mm_loadu_ps(samples + i), lower), upper));
+    }
+#endif
+    for (; i < count; ++i) {
+        samples[i] = std::clamp(samples[i], -1.0f, 1.0f);
+    }
+}
 
-    // notify main thread that pcm buffer is empty
-    if (!buffer_ready[active_buffer_index]) {
-        cv.notify_one();
-        SDL_PutAudioStreamData(stream, mixed_buffer.get(), additional_amount);
+// out[frame][o] = sum(in[frame][i] * matrix[o][i]), matrix is row-major out_channels x in_channels
+static void DownmixF32(const float *in, float *out, int frames, const float *matrix, int in_channels,
+                       int out_channels) {
+    int f = 0;
+#ifdef PCM_MIX_SSE2
+    if (out_channels == 2) {
+        // two output frames per vector, lanes are (L0, R0, L1, R1)
+        alignas(16) float columns[kMaxChannels][4];
+        for (int i = 0; i < in_channels; ++i) {
+            columns[i][0] = columns[i][2] = matrix[i];
+            columns[i][1] = columns[i][3] = matrix[in_channels + i];
+        }
+        for (; f + 2 <= frames; f += 2) {
+            const float *in0 = in + f * in_channels;
+            const float *in1 = in0 + in_channels;
+            __m128 acc = _mm_setzero_ps();
+            for (int i = 0; i < in_channels; ++i) {
+                const __m128 x = _mm_movelh_ps(_mm_set1_ps(in0[i]), _mm_set1_ps(in1[i]));
+                acc = _mm_add_ps(acc, _mm_mul_ps(x, _mm_load_ps(columns[i])));
+            }
+            _mm_storeu_ps(out + f * 2, acc);
+        }
+    }
+#endif
+    for (; f < frames; ++f) {
+        for (int o = 0; o < out_channels; ++o) {
+            float acc = 0.0f;
+            for (int i = 0; i < in_channels; ++i) {
+                acc += in[f * in_channels + i] * matrix[o * in_channels + i];
+            }
+            out[f * out_channels + o] = acc;
+        }
+    }
+}
+
+static void ConvertF32ToS16(const float *in, int16_t *out, size_t samples) {
+    size_t i = 0;
+#ifdef PCM_MIX_SSE2
+    const __m128 lower = _mm_set1_ps(-1.0f);
+    const __m128 upper = _mm_set1_ps(1.0f);
+    const __m128 scale = _mm_set1_ps(32767.0f);
+    for (; i + 8 <= samples; i += 8) {
+        const __m128 x0 = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(in + i), lower), upper);
+        const __m128 x1 = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(in + i + 4), lower), upper);
+        const __m128i y0 = _mm_cvtps_epi32(_mm_mul_ps(x0, scale));
+        const __m128i y1 = _mm_cvtps_epi32(_mm_mul_ps(x1, scale));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i), _mm_packs_epi32(y0, y1));
+    }
+#endif
+    for (; i < samples; ++i) {
+        out[i] = static_cast<int16_t>(std::lrint(std::clamp(in[i], -1.0f, 1.0f) * 32767.0f));
+    }
+}
+
+// pick the downmix matrix for a source, or none when the mixer has enough channels.
+// without a user matrix and without a default for the layout, SDL does the channel conversion
+static bool SelectDownmix(MixerSource *source) {
+    const int in_channels = source->options.spec.channels;
+    const int out_channels = mixer_spec.channels;
+    if (in_channels <= out_channels) {
+        return true; // pass through
+    }
+
+    const auto &user_matrix = source->options.downmix;
+    if (!user_matrix.empty()) {
+        if (user_matrix.size() != static_cast<size_t>(in_channels * out_channels)) {
+            SDL_Log("Downmix matrix must be %d rows x %d columns", out_channels, in_channels);
+            return false;
+        }
+        source->downmix = user_matrix;
+    } else if (in_channels == 6 && out_channels == 2) {
+        source->downmix.assign(std::begin(kDownmix51ToStereo), std::end(kDownmix51ToStereo));
+    } else if (in_channels == 8 && out_channels == 2) {
+        source->downmix.assign(std::begin(kDownmix71ToStereo), std::end(kDownmix71ToStereo));
+    }
+    return true;
+}
+
+// pan only applies to stereo, other layouts get the same gain on every channel
+static void SetSourceGains(MixerSource *source, int channels) {
+    const float gain = std::clamp(source->options.gain, 0.0f, 1.0f);
+    const float pan = std::clamp(source->options.pan, -1.0f, 1.0f);
+    const float left = channels == 2 ? gain * std::min(1.0f, 1.0f - pan) : gain;
+    const float right = channels == 2 ? gain * std::min(1.0f, 1.0f + pan) : gain;
+    for (int i = 0; i < 8; ++i) {
+        source->gains_s16[i] = static_cast<int16_t>((i & 1 ? right : left) * 32767.0f);
+    }
+    for (int i = 0; i < 4; ++i) {
+        source->gains_f32[i] = i & 1 ? right : left;
+    }
+}
+
+// ramp a source in after it is added and out after it is asked to be removed, so neither clicks
+template<typename T>
+static void ApplyFade(MixerSource *source, T *samples, int frames, int channels) {
+    const float target = source->remove_requested ? 0.0f : 1.0f;
+    if (source->fade_gain == target && target == 1.0f) {
         return;
     }
+    constexpr float step = 1.0f / kFadeFrames;
+    for (int i = 0; i < frames; ++i) {
+        if (source->fade_gain < target) {
+            source->fade_gain = std::min(source->fade_gain + step, target);
+        } else if (source->fade_gain > target) {
+            source->fade_gain = std::max(source->fade_gain - step, target);
+        }
+        for (int j = 0; j < channels; ++j) {
+            samples[i * channels + j] = static_cast<T>(samples[i * channels + j] * source->fade_gain);
+        }
+    }
+}
+
+// Retire pushes that already left the audio stream, their playout time is now + one device buffer.
+// Then remember the push we are about to make.
+static void RecordPush(SDL_AudioStream *stream, int push_size) {
+    auto &stats = latency_stats;
+    const uint64_t now_ns = SDL_GetTicksNS();
+    const int queued = SDL_GetAudioStreamQueued(stream);
+    const uint64_t consumed_bytes = stats.total_pushed_bytes - std::max(queued, 0);
+
+    while (stats.record_tail != stats.record_head) {
+        const PushRecord &record = stats.records[stats.record_tail];
+        if (record.end_bytes > consumed_bytes) {
+            break;
+        }
+        if (stats.latencies_ns.size() < stats.latencies_ns.capacity()) {
+            stats.latencies_ns.push_back(now_ns - record.push_ns + stats.device_buffer_ns);
+        }
+        stats.record_tail = (stats.record_tail + 1) % kMaxPushRecords;
+    }
+
+    stats.total_pushed_bytes += push_size;
+    const size_t next_head = (stats.record_head + 1) % kMaxPushRecords;
+    if (next_head == stats.record_tail) {
+        return; // ring is full, skip measuring this push
+    }
+    stats.records[stats.record_head] = {now_ns, stats.total_pushed_bytes};
+    stats.record_head = next_head;
+}
+
+// mix one source into the output buffer in the mixer format, s16 or f32
+static void MixSource(MixerSource *source, int read_size, int frame_size, const SDL_AudioSpec *spec) {
+    const int frames = read_size / frame_size;
+    if (spec->format == SDL_AUDIO_F32) {
+        auto *samples = reinterpret_cast<float *>(source_buffer.get());
+        ApplyFade(source, samples, frames, spec->channels);
+        MixF32(reinterpret_cast<float *>(mixed_buffer.get()), samples, read_size / sizeof(float), source->gains_f32);
+    } else {
+        auto *samples = reinterpret_cast<int16_t *>(source_buffer.get());
+        ApplyFade(source, samples, frames, spec->channels);
+        MixS16(reinterpret_cast<int16_t *>(mixed_buffer.get()), samples, read_size / sizeof(int16_t),
+               source->gains_s16);
+    }
+}
 
-    auto &buffer = buffers[active_buffer_index];
-    const auto remain_buffer_size = static_cast<int>(buffer.size - buffer.pos);
-    const int copy_size = std::min(additional_amount, remain_buffer_size);
+// This function will be automatically called by the SDL3 library approximately every 10ms,
+// or every period in low latency mode. It only copies and sums, format conversion happens on the reader threads
+static void SDLCALL AudioStreamCB(void *userdata, SDL_AudioStream *stream, int additional_amount, int total_amount) {
+    const auto *spec = static_cast<const SDL_AudioSpec *>(userdata);
+    const int frame_size = SDL_AUDIO_FRAMESIZE(*spec);
+
+    while (additional_amount > 0) {
+        const int request_size = std::min(additional_amount, mixed_buffer_size);
+        std::memset(mixed_buffer.get(), 0, request_size);
+
+        // pull from every source ring and sum into one buffer
+        for (auto &slot: mixer_slots) {
+            MixerSource *source = slot.load(std::memory_order_acquire);
+            if (source == nullptr) {
+                continue;
+            }
+
+            const auto read_size = static_cast<int>(source->ring.Read(source_buffer.get(), request_size));
+            const bool started = source->fade_gain > 0.0f;
+            if (read_size < request_size && started && !source->end_of_file && !source->remove_requested) {
+                source->underruns.fetch_add(1, std::memory_order_relaxed);
+            }
+            MixSource(source, read_size, frame_size, spec);
+
+            // a finished source leaves the mixer, the main thread frees it after seeing retired
+            const bool faded_out = source->remove_requested && (source->fade_gain == 0.0f || read_size == 0);
+            const bool drained = source->end_of_file && source->ring.ReadAvailable() == 0;
+            if (faded_out || drained) {
+                slot.store(nullptr, std::memory_order_relaxed);
+                source->retired.store(true, std::memory_order_release);
+            }
+        }
 
-    // change audio volume
-    SDL_MixAudio(mixed_buffer.get(), buffer.data.get() + buffer.pos, kAudioFormatS16Le, copy_size, kAudioVolume);
-    //SDL_Log("Send %d bytes to audio stream, buffer_idx=%d", copy_size, active_buffer_index);
+        if (spec->format == SDL_AUDIO_F32) {
+            ClampF32(reinterpret_cast<float *>(mixed_buffer.get()), request_size / sizeof(float));
+        }
 
-    // notify main thread that one pcm buffer is empty
-    auto buffer_change_lock = std::unique_lock(buffer_change_mutex);
-    buffer.pos += copy_size;
-    if (buffer.pos >= buffer.size) {
-        buffer_ready[active_buffer_index] = false;
-        active_buffer_index = !active_buffer_index;
-        cv.notify_one();
+        // put mixed audio data to audio stream
+        RecordPush(stream, request_size);
+        SDL_PutAudioStreamData(stream, mixed_buffer.get(), request_size);
+        additional_amount -= request_size;
     }
-    buffer_change_lock.unlock();
 
-    // put mixed audio data to audio stream
-    SDL_PutAudioStreamData(stream, mixed_buffer.get(), additional_amount);
+    // notify reader threads that there is free space in the source rings
+    cv.notify_all();
+}
+
+// downmix f32 frames from convert_buffer to the mixer layout, then to the mixer format.
+// convert_buffer is free once downmixed, so the s16 result goes back into it
+static const uint8_t *DownmixToMixerFormat(const MixerSource *source, uint8_t *convert_buffer,
+                                           float *downmix_buffer, int frames, int *size) {
+    DownmixF32(reinterpret_cast<const float *>(convert_buffer), downmix_buffer, frames, source->downmix.data(),
+               source->converter_spec.channels, mixer_spec.channels);
+    const size_t samples = static_cast<size_t>(frames) * mixer_spec.channels;
+    *size = frames * SDL_AUDIO_FRAMESIZE(mixer_spec);
+    if (mixer_spec.format == SDL_AUDIO_S16) {
+        ConvertF32ToS16(downmix_buffer, reinterpret_cast<int16_t *>(convert_buffer), samples);
+        return convert_buffer;
+    }
+    return reinterpret_cast<const uint8_t *>(downmix_buffer);
 }
 
-static bool PlayPcmAudio(const std::string &pcm_file) {
+// move converted audio from the converter to the source ring, one pcm buffer at a time.
+// if flush is false only whole pcm buffers are moved, the rest waits for the next block
+static bool DrainConverter(MixerSource *source, uint8_t *convert_buffer, float *downmix_buffer, bool flush) {
+    const int converter_frame_size = SDL_AUDIO_FRAMESIZE(source->converter_spec);
+    const int convert_block_size = pcm_buffer_frames * converter_frame_size;
+    while (!source->remove_requested) {
+        const int available = SDL_GetAudioStreamAvailable(source->converter);
+        if (available <= 0 || (!flush && available < convert_block_size)) {
+            return true;
+        }
+        const int converted = SDL_GetAudioStreamData(source->converter, convert_buffer, convert_block_size);
+        if (converted < 0) {
+            SDL_Log("Couldn't convert pcm data: %s", SDL_GetError());
+            return false;
+        }
+
+        const uint8_t *data = convert_buffer;
+        int size = converted;
+        if (!source->downmix.empty()) {
+            const int frames = converted / converter_frame_size;
+            data = DownmixToMixerFormat(source, convert_buffer, downmix_buffer, frames, &size);
+        }
+
+        // wait until the source ring has room for this buffer
+        auto cv_lock = std::unique_lock(cv_mutex);
+        cv.wait(cv_lock, [&]() -> bool {
+            return source->remove_requested || source->ring.WriteAvailable() >= static_cast<size_t>(size);
+        });
+        cv_lock.unlock();
+        source->ring.Write(data, size);
+    }
+    return true;
+}
+
+// the first blocks of the next queued file, read while the current file is still playing
+struct PrefetchedFile {
+    std::ifstream file;
+    int size = 0; // bytes in the prefetch buffer
+};
+
+static PrefetchedFile PrefetchFile(const std::string &name, uint8_t *buffer, int buffer_size, int frame_size) {
+    PrefetchedFile prefetched;
+    prefetched.file.open(name, std::ios::binary);
+    if (prefetched.file.is_open()) {
+        prefetched.file.read(reinterpret_cast<char *>(buffer), buffer_size);
+        prefetched.size = static_cast<int>(prefetched.file.gcount() / frame_size * frame_size);
+    }
+    return prefetched;
+}
+
+// read pcm data from the queued files in fixed-size blocks and convert it to the mixer format.
+// all buffers are allocated once, before the loop. all files share one converter, and it is only
+// flushed after the last file, so consecutive files are played without a gap
+static void ReadMixerSource(MixerSource *source) {
+    const auto &files = source->options.files;
+    const int input_frame_size = SDL_AUDIO_FRAMESIZE(source->options.spec);
+    const int read_block_size = kConvertBlockFrames * input_frame_size;
+    const int prefetch_size = kPrefetchBlocks * read_block_size;
+    auto read_buffer = std::make_unique<uint8_t[]>(read_block_size);
+    auto prefetch_buffer = std::make_unique<uint8_t[]>(prefetch_size);
+    auto convert_buffer = std::make_unique<uint8_t[]>(pcm_buffer_frames * SDL_AUDIO_FRAMESIZE(source->converter_spec));
+    const int downmix_samples = source->downmix.empty() ? 0 : pcm_buffer_frames * mixer_spec.channels;
+    auto downmix_buffer = std::make_unique<float[]>(downmix_samples);
+
+    // open the next file and read its first blocks while the current one is still playing
+    size_t file_index = 0;
+    std::future<PrefetchedFile> next_file;
+    const auto prefetch_next_file = [&]() -> void {
+        if (file_index + 1 < files.size()) {
+            next_file = std::async(std::launch::async, PrefetchFile, files[file_index + 1], prefetch_buffer.get(),
+                                   prefetch_size, input_frame_size);
+        }
+    };
+    prefetch_next_file();
+
+    uint64_t total_bytes_read = 0;
+    while (!source->remove_requested) {
+        const uint8_t *data = read_buffer.get();
+        source->file.read(reinterpret_cast<char *>(read_buffer.get()), read_block_size);
+        auto bytes_read = static_cast<int>(source->file.gcount() / input_frame_size * input_frame_size);
+        if (bytes_read == 0) {
+            SDL_Log("End of pcm file: %s, %llu bytes", files[file_index].c_str(), total_bytes_read);
+            if (!next_file.valid()) {
+                break;
+            }
+
+            // switch to the next file, its first blocks are already in the prefetch buffer
+            PrefetchedFile prefetched = next_file.get();
+            ++file_index;
+            if (!prefetched.file.is_open()) {
+                SDL_Log("Couldn't open pcm file: %s", files[file_index].c_str());
+            }
+            source->file = std::move(prefetched.file);
+            data = prefetch_buffer.get();
+            bytes_read = prefetched.size;
+            total_bytes_read = 0;
+        }
+        total_bytes_read += bytes_read;
+
+        if (bytes_read > 0 && !SDL_PutAudioStreamData(source->converter, data, bytes_read)) {
+            SDL_Log("Couldn't convert pcm data: %s", SDL_GetError());
+            break;
+        }
+
+        // the prefetch buffer is consumed, so it can hold the file after this one
+        if (data == prefetch_buffer.get()) {
+            prefetch_next_file();
+        }
+        if (!DrainConverter(source, convert_buffer.get(), downmix_buffer.get(), false)) {
+            break;
+        }
+    }
+
+    // a removed source may still have a prefetch in flight, it must finish before the buffer is freed
+    if (next_file.valid()) {
+        next_file.wait();
+    }
+
+    // push out what the resampler still holds
+    SDL_FlushAudioStream(source->converter);
+    DrainConverter(source, convert_buffer.get(), downmix_buffer.get(), true);
+    source->end_of_file = true;
+}
+
+struct MixerSourceDeleter {
+    void operator()(MixerSource *source) const {
+        if (source->converter) {
+            SDL_DestroyAudioStream(source->converter);
+        }
+        delete source;
+    }
+};
+
+using MixerSourcePtr = std::unique_ptr<MixerSource, MixerSourceDeleter>;
+
+// can be called at any time during playback, the source fades in on the next callback
+static MixerSourcePtr AddMixerSource(const MixerSourceOptions &options) {
+    MixerSourcePtr source(new MixerSource(static_cast<size_t>(kSourceRingBuffers) * pcm_buffer_size));
+    source->options = options;
+    source->file.open(options.files[0], std::ios::binary);
+    if (!source->file.is_open()) {
+        SDL_Log("Couldn't open pcm file: %s", options.files[0].c_str());
+        return nullptr;
+    }
+    if (!SelectDownmix(source.get())) {
+        return nullptr;
+    }
+
+    // with a downmix matrix SDL only converts format and rate, the channels are mixed by DownmixF32
+    source->converter_spec = mixer_spec;
+    if (!source->downmix.empty()) {
+        source->converter_spec.format = SDL_AUDIO_F32;
+        source->converter_spec.channels = options.spec.channels;
+    }
+    source->converter = SDL_CreateAudioStream(&options.spec, &source->converter_spec);
+    if (!source->converter) {
+        SDL_Log("Couldn't create audio converter: %s", SDL_GetError());
+        return nullptr;
+    }
+    SetSourceGains(source.get(), mixer_spec.channels);
+
+    for (auto &slot: mixer_slots) {
+        MixerSource *expected = nullptr;
+        if (slot.compare_exchange_strong(expected, source.get(), std::memory_order_release)) {
+            source->reader = std::thread(ReadMixerSource, source.get());
+            SDL_Log("Mixer source added: %s (%zu queued), %s %dHz %dch, gain=%.2f, pan=%.2f, downmix=%s",
+                    options.files[0].c_str(), options.files.size(), SDL_GetAudioFormatName(options.spec.format),
+                    options.spec.freq, options.spec.channels, options.gain, options.pan,
+                    source->downmix.empty() ? "no" : "yes");
+            return source;
+        }
+    }
+    SDL_Log("Couldn't add mixer source, all %d slots are in use: %s", kMaxMixerSources, options.files[0].c_str());
+    return nullptr;
+}
+
+// the source fades out on the next callback, the caller frees it once it is retired
+static void RemoveMixerSource(MixerSource *source) {
+    source->remove_requested = true;
+    cv.notify_all();
+}
+
+static void ReportLatency(int underruns) {
+    auto &stats = latency_stats;
+    if (stats.latencies_ns.empty()) {
+        SDL_Log("Latency: no samples, underruns=%d", underruns);
+        return;
+    }
+
+    std::vector<uint64_t> sorted = stats.latencies_ns;
+    std::sort(sorted.begin(), sorted.end());
+    const auto percentile = [&sorted](double p) -> double {
+        const auto idx = static_cast<size_t>(p * static_cast<double>(sorted.size() - 1));
+        return static_cast<double>(sorted[idx]) / 1e6;
+    };
+    SDL_Log("Latency: samples=%zu, p50=%.2fms, p99=%.2fms, max=%.2fms, underruns=%d",
+            sorted.size(), percentile(0.5), percentile(0.99), static_cast<double>(sorted.back()) / 1e6, underruns);
+}
+
+static bool PlayPcmAudio(const PlayerOptions &options) {
     SDL_AudioStream *stream = nullptr;
-    constexpr SDL_AudioSpec spec = {
-        .format = kAudioFormatS16Le,
-        .channels = kAudioChannels,
-        .freq = kAudioFreq
-    }; // std=c++20
+
+    // the device buffer size is only a hint, SDL may choose another one
+    if (options.period_frames > 0) {
+        SDL_SetHint(SDL_HINT_AUDIO_DEVICE_SAMPLE_FRAMES, std::to_string(options.period_frames).c_str());
+    }
+
+    // mix in the device native format, so SDL does not convert again after the callback.
+    // the mixer kernels support s16 and f32, other native formats are mixed in f32
+    SDL_AudioSpec &spec = mixer_spec;
+    if (!SDL_GetAudioDeviceFormat(SDL_AUDIO_DEVICE_DEFAULT_PLAYBACK, &spec, nullptr)) {
+        SDL_Log("Couldn't query audio device format: %s", SDL_GetError());
+        return false;
+    }
+    if (spec.format != SDL_AUDIO_S16 && spec.format != SDL_AUDIO_F32) {
+        spec.format = SDL_AUDIO_F32;
+    }
+    const int frame_size = SDL_AUDIO_FRAMESIZE(spec);
 
     // open device in a paused state
-    stream = SDL_OpenAudioDeviceStream(SDL_AUDIO_DEVICE_DEFAULT_PLAYBACK, &spec, AudioStreamCB, nullptr);
+    stream = SDL_OpenAudioDeviceStream(SDL_AUDIO_DEVICE_DEFAULT_PLAYBACK, &spec, AudioStreamCB, &spec);
     if (!stream) {
         SDL_Log("Couldn't open audio device: %s", SDL_GetError());
         return false;
     }
 
-    std::ifstream file(pcm_file, std::ios::binary);
-    if (!file.is_open()) {
-        SDL_Log("Couldn't open pcm file: %s", pcm_file.c_str());
+    // query the buffer size the device actually uses
+    SDL_AudioSpec device_spec;
+    int device_frames = 0;
+    if (!SDL_GetAudioDeviceFormat(SDL_GetAudioStreamDevice(stream), &device_spec, &device_frames)) {
+        SDL_Log("Couldn't query audio device format: %s", SDL_GetError());
         SDL_DestroyAudioStream(stream);
         return false;
     }
+    SDL_Log("Audio device: %s, freq=%d, channels=%d, buffer=%d frames (%.2fms)",
+            SDL_GetAudioFormatName(spec.format), device_spec.freq, device_spec.channels, device_frames,
+            device_frames * 1000.0 / device_spec.freq);
 
-    file_buffer = std::make_unique<uint8_t[]>(kPcmBufferSize);
-    buffers[0].data = std::make_unique<uint8_t[]>(kPcmBufferSize);
-    buffers[1].data = std::make_unique<uint8_t[]>(kPcmBufferSize);
+    // in low latency mode each pcm buffer holds one period, so every source ring is a few periods deep
+    pcm_buffer_frames = options.low_latency ? std::max(device_frames, 1) : spec.freq * kPcmBufferMs / 1000;
+    pcm_buffer_size = pcm_buffer_frames * frame_size;
+    mixed_buffer_size = std::max(pcm_buffer_size, device_frames * frame_size);
+    mixed_buffer = std::make_unique<uint8_t[]>(mixed_buffer_size);
+    source_buffer = std::make_unique<uint8_t[]>(mixed_buffer_size);
+
+    latency_stats = {};
+    latency_stats.records.resize(kMaxPushRecords);
+    latency_stats.latencies_ns.reserve(kMaxLatencySamples);
+    latency_stats.bytes_per_second = spec.freq * frame_size;
+    latency_stats.device_buffer_ns = static_cast<uint64_t>(device_frames) * SDL_NS_PER_SECOND / device_spec.freq;
+    SDL_Log("Playback: low_latency=%d, pcm buffer=%d bytes (%.2fms)", options.low_latency, pcm_buffer_size,
+            pcm_buffer_size * 1000.0 / latency_stats.bytes_per_second);
+
+    // the program feed starts before the device, so playback does not begin with an underrun
+    std::vector<MixerSourcePtr> sources;
+    auto program = AddMixerSource(options.sources[0]);
+    if (!program) {
+        SDL_DestroyAudioStream(stream);
+        return false;
+    }
+    sources.push_back(std::move(program));
 
     // begin to playback audio
     SDL_ResumeAudioStreamDevice(stream);
+    const uint64_t start_ms = SDL_GetTicks();
 
-    // read pcm data from file
-    uint64_t total_bytes_read = 0;
+    // add and remove the other sources on schedule, until every source has played out
+    int underruns = 0;
+    std::vector<bool> pending(options.sources.size(), true);
+    pending[0] = false;
     while (true) {
-        file.read(reinterpret_cast<char *>(file_buffer.get()), kPcmBufferSize);
-        const uint64_t bytes_read = file.gcount();
-        if (bytes_read == 0) {
-            SDL_Log("End of pcm file");
-            break;
+        const uint64_t elapsed_ms = SDL_GetTicks() - start_ms;
+        for (size_t i = 1; i < options.sources.size(); ++i) {
+            if (pending[i] && elapsed_ms >= static_cast<uint64_t>(options.sources[i].start_ms)) {
+                pending[i] = false;
+                if (auto source = AddMixerSource(options.sources[i])) {
+                    sources.push_back(std::move(source));
+                }
+            }
+        }
+        for (auto &source: sources) {
+            const int stop_ms = source->options.stop_ms;
+            if (stop_ms >= 0 && elapsed_ms >= static_cast<uint64_t>(stop_ms) && !source->remove_requested) {
+                SDL_Log("Mixer source removed: %s", source->options.files[0].c_str());
+                RemoveMixerSource(source.get());
+            }
         }
 
-        total_bytes_read += bytes_read;
-        //SDL_Log("Read %lld bytes from pcm file, total=%lld", bytes_read, total_bytes_read);
+        // free retired sources
+        for (auto it = sources.begin(); it != sources.end();) {
+            if (!(*it)->retired.load(std::memory_order_acquire)) {
+                ++it;
+                continue;
+            }
+            if ((*it)->reader.joinable()) {
+                (*it)->reader.join();
+            }
+            underruns += (*it)->underruns;
+            it = sources.erase(it);
+        }
 
-        // wait until one pcm buffer is empty
-        auto cv_lock = std::unique_lock(cv_mutex);
-        cv.wait(cv_lock, [&]() -> bool { return !buffer_ready[0] || !buffer_ready[1]; });
-        cv_lock.unlock();
+        if (sources.empty() && std::find(pending.begin(), pending.end(), true) == pending.end()) {
+            break;
+        }
+        SDL_Delay(5);
+    }
 
-        // fill pcm buffer
-        auto buffer_change_lock = std::unique_lock(buffer_change_mutex);
-        const int idx = active_buffer_index;
-        if (!buffer_ready[idx]) {
-            //SDL_Log("Fill %d bytes to pcm buffer, buffer_idx=%d", bytes_read, idx);
-            std::memcpy(buffers[idx].data.get(), file_buffer.get(), bytes_read);
-            buffers[idx].size = bytes_read;
-            buffers[idx].pos = 0;
-            buffer_ready[idx] = true;
-        } else if (!buffer_ready[!idx]) {
-            //SDL_Log("Fill %d bytes to pcm buffer, buffer_idx=%d", bytes_read, !idx);
-            std::memcpy(buffers[!idx].data.get(), file_buffer.get(), bytes_read);
-            buffers[!idx].size = bytes_read;
-            buffers[!idx].pos = 0;
-            buffer_ready[!idx] = true;
-        }
-        buffer_change_lock.unlock();
+    // wait until the audio stream is played out
+    while (SDL_GetAudioStreamQueued(stream) > 0) {
+        SDL_Delay(1);
     }
+    SDL_Delay(static_cast<uint32_t>(latency_stats.device_buffer_ns / SDL_NS_PER_MS) + 1);
 
     SDL_DestroyAudioStream(stream);
-    file.close();
+
+    ReportLatency(underruns);
     return true;
 }
 
-int main() {
+static bool ParseAudioFormat(const std::string &name, SDL_AudioFormat *format) {
+    static constexpr std::pair<const char *, SDL_AudioFormat> formats[] = {
+        {"u8", SDL_AUDIO_U8}, {"s8", SDL_AUDIO_S8},
+        {"s16", SDL_AUDIO_S16LE}, {"s16le", SDL_AUDIO_S16LE}, {"s16be", SDL_AUDIO_S16BE},
+        {"s32", SDL_AUDIO_S32LE}, {"s32le", SDL_AUDIO_S32LE}, {"s32be", SDL_AUDIO_S32BE},
+        {"f32", SDL_AUDIO_F32LE}, {"f32le", SDL_AUDIO_F32LE}, {"f32be", SDL_AUDIO_F32BE},
+    };
+    for (const auto &[format_name, value]: formats) {
+        if (name == format_name) {
+            *format = value;
+            return true;
+        }
+    }
+    return false;
+}
+
+// rows are separated by ';', coefficients by ','. e.g. stereo from 5.1: "1,0,0.7,0,0.7,0;0,1,0.7,0,0,0.7"
+static std::vector<float> ParseDownmixMatrix(const std::string &arg) {
+    std::vector<float> matrix;
+    const char *p = arg.c_str();
+    while (*p) {
+        char *end = nullptr;
+        matrix.push_back(std::strtof(p, &end));
+        if (end == p) {
+            return {};
+        }
+        p = *end ? end + 1 : end;
+    }
+    return matrix;
+}
+
+// file[,gain[,pan[,start_ms[,stop_ms]]]]
+static MixerSourceOptions ParseMixerSource(const std::string &arg) {
+    MixerSourceOptions options;
+    std::vector<std::string> fields;
+    size_t begin = 0;
+    while (true) {
+        const size_t end = arg.find(',', begin);
+        fields.push_back(arg.substr(begin, end - begin));
+        if (end == std::string::npos) {
+            break;
+        }
+        begin = end + 1;
+    }
+    options.files = {fields[0]};
+    if (fields.size() > 1) options.gain = std::strtof(fields[1].c_str(), nullptr);
+    if (fields.size() > 2) options.pan = std::strtof(fields[2].c_str(), nullptr);
+    if (fields.size() > 3) options.start_ms = std::atoi(fields[3].c_str());
+    if (fields.size() > 4) options.stop_ms = std::atoi(fields[4].c_str());
+    return options;
+}
+
+int main(int argc, char *argv[]) {
+    // ffmpeg -i test.mp4 -ar 48000 -ac 2 -f s16le 48000hz_s16le_stereo.pcm
+    const auto default_pcm_file = "../../../../48000hz_s16le_stereo.pcm";
+    MixerSourceOptions program;
+    program.gain = kAudioVolume;
+
+    // usage: sdl3_play_pcm [--low-latency] [--period <frames>]
+    //                      [--format <u8|s8|s16|s16be|s32|s32be|f32|f32be>] [--rate <hz>] [--channels <n>]
+    //                      [--downmix <matrix>] [--mix file[,gain[,pan[,start_ms[,stop_ms]]]]]... [pcm_file]...
+    // the input format and the downmix matrix apply to every pcm file, the pcm files are played back to back
+    PlayerOptions options;
+    std::vector<MixerSourceOptions> extra_sources;
+    SDL_AudioSpec input_spec = program.spec;
+    std::vector<float> downmix;
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        if (arg == "--downmix" && i + 1 < argc) {
+            downmix = ParseDownmixMatrix(argv[++i]);
+            if (downmix.empty()) {
+                SDL_Log("Invalid downmix matrix: %s", argv[i]);
+                return 1;
+            }
+        } else if (arg == "--format" && i + 1 < argc) {
+            if (!ParseAudioFormat(argv[++i], &input_spec.format)) {
+                SDL_Log("Unsupported pcm format: %s", argv[i]);
+                return 1;
+            }
+        } else if (arg == "--rate" && i + 1 < argc) {
+            input_spec.freq = std::atoi(argv[++i]);
+        } else if (arg == "--channels" && i + 1 < argc) {
+            input_spec.channels = std::atoi(argv[++i]);
+        } else if (arg == "--low-latency") {
+            options.low_latency = true;
+        } else if (arg == "--period" && i + 1 < argc) {
+            options.period_frames = std::max(std::atoi(argv[++i]), 0);
+        } else if (arg == "--mix" && i + 1 < argc) {
+            extra_sources.push_back(ParseMixerSource(argv[++i]));
+        } else {
+            program.files.push_back(arg);
+        }
+    }
+    if (options.low_latency && options.period_frames == 0) {
+        options.period_frames = kLowLatencyPeriodFrames;
+    }
+    if (program.files.empty()) {
+        program.files.push_back(default_pcm_file);
+    }
+    if (extra_sources.size() >= kMaxMixerSources) {
+        SDL_Log("Too many mixer sources, at most %d are supported", kMaxMixerSources);
+        return 1;
+    }
+    if (input_spec.freq <= 0 || input_spec.channels <= 0 || input_spec.channels > kMaxChannels) {
+        SDL_Log("Invalid pcm format: rate=%d, channels=%d", input_spec.freq, input_spec.channels);
+        return 1;
+    }
+    options.sources.push_back(program);
+    options.sources.insert(options.sources.end(), extra_sources.begin(), extra_sources.end());
+    for (auto &source: options.sources) {
+        source.spec = input_spec;
+        source.downmix = downmix;
+    }
+
     if (!SDL_Init(SDL_INIT_AUDIO)) {
         SDL_Log("Couldn't initialize SDL: %s", SDL_GetError());
         return 1;
     }
 
-    // ffmpeg -i test.mp4 -ar 48000 -ac 2 -f s16le 48000hz_s16le_stereo.pcm
-    const auto pcm_file = "../../../../48000hz_s16le_stereo.pcm";
-
     // play
-    const bool success = PlayPcmAudio(pcm_file);
+    const bool success = PlayPcmAudio(options);
 
     SDL_Quit();
     return success ? 0 : 1;
@@ -1,9 +1,103 @@
 extern "C" {
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
 }
 
 #include <cmath>
+#include <chrono>
+#include <string>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <fstream>
+#include <algorithm>
+#include <filesystem>
+#include <condition_variable>
+#include <unordered_map>
+
+#ifdef _WIN32
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#endif
+
+#include "chunk_file_writer.h"
+#include "huge_pages.h"
+#include "mapped_file.h"
+
+// Packet index file layout, native endian, fixed-size records so the file can be mmapped and used in place:
+// [PacketIndexHeader][PacketIndexRecord * record_count][PacketIndexStream * stream_count][uint64_t buckets]
+// [PacketIndexKey * key packets], the key table holds the key packets of each stream sorted by pts
+static constexpr char kPacketIndexMagic[8] = {'P', 'K', 'T', 'I', 'D', 'X', '0', '1'};
+static constexpr uint32_t kPacketIndexVersion = 2;
+static constexpr int64_t kPacketIndexBucketMs = 1000; // bitrate-over-time resolution
+static constexpr size_t kPacketIndexBatchRecords = 65536; // records per fwrite, 2.5MB
+static constexpr int kMemoryIOBufferSize = 64 * 1024;
+static constexpr int64_t kFramePoolBenchmarkBytes = 1LL << 30; // bytes copied per benchmark row
+static constexpr size_t kRemuxChunkSize = 8 * 1024 * 1024;
+static constexpr size_t kRemuxMaxQueuedChunks = 4;
+static constexpr int kRemuxIOBufferSize = 256 * 1024;
+
+struct PacketIndexHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t stream_count;
+    uint64_t record_count;
+    uint64_t records_offset;
+    uint64_t streams_offset;
+    uint64_t buckets_offset;
+    int64_t bucket_ms;
+    uint64_t keys_offset;
+};
+
+struct PacketIndexRecord {
+    int64_t pts; // in stream time_base
+    int64_t dts;
+    int64_t pos; // byte offset in the input file, -1 if unknown
+    int64_t duration;
+    int32_t size;
+    uint16_t stream_index;
+    uint16_t flags; // AV_PKT_FLAG_*
+};
+
+struct PacketIndexStream {
+    int32_t index;
+    int32_t codec_type; // AVMediaType
+    int32_t codec_id; // AVCodecID
+    int32_t time_base_num;
+    int32_t time_base_den;
+    int32_t gop_min; // packets from one key packet to the next, 0 if there is no key packet
+    int32_t gop_max;
+    int32_t gop_count;
+    double gop_avg;
+    uint64_t packet_count;
+    uint64_t key_count;
+    uint64_t total_bytes;
+    uint64_t bucket_first; // first element of this stream in the bucket array, bytes per bucket_ms
+    uint64_t bucket_count;
+    uint64_t key_first; // first element of this stream in the key table, key_count elements
+};
+
+struct PacketIndexKey {
+    int64_t pts; // AV_NOPTS_VALUE sorts first
+    uint64_t record;
+};
+
+static_assert(sizeof(PacketIndexHeader) == 64);
+static_assert(sizeof(PacketIndexRecord) == 40);
+static_assert(sizeof(PacketIndexStream) == 88);
+static_assert(sizeof(PacketIndexKey) == 16);
 
 int dump_format(const char *input_file) {
     int ret = 0;
@@ -117,6 +211,864 @@ int demultiplex(const char *filename) {
     return 0;
 }
 
+// per stream state while scanning, turned into PacketIndexStream at the end
+struct PacketIndexStreamState {
+    PacketIndexStream summary{};
+    int64_t first_ts = AV_NOPTS_VALUE;
+    int64_t packets_since_key = -1; // -1 until the first key packet
+    int64_t gop_sum = 0;
+    std::vector<uint64_t> buckets;
+    std::vector<PacketIndexKey> keys;
+};
+
+static void CloseGop(PacketIndexStreamState &state) {
+    if (state.packets_since_key <= 0) {
+        return;
+    }
+    const auto gop = static_cast<int32_t>(state.packets_since_key);
+    PacketIndexStream &summary = state.summary;
+    summary.gop_min = summary.gop_count == 0 ? gop : std::min(summary.gop_min, gop);
+    summary.gop_max = std::max(summary.gop_max, gop);
+    summary.gop_count++;
+    state.gop_sum += gop;
+}
+
+// update GOP length and bitrate-over-time of one stream, in the same pass that writes the record
+static void AccumulatePacket(PacketIndexStreamState &state, const AVPacket *pkt, AVRational time_base) {
+    PacketIndexStream &summary = state.summary;
+    summary.packet_count++;
+    summary.total_bytes += pkt->size;
+
+    if (pkt->flags & AV_PKT_FLAG_KEY) {
+        summary.key_count++;
+        CloseGop(state);
+        state.packets_since_key = 0;
+    }
+    if (state.packets_since_key >= 0) {
+        state.packets_since_key++;
+    }
+
+    const int64_t ts = pkt->dts != AV_NOPTS_VALUE ? pkt->dts : pkt->pts;
+    if (ts == AV_NOPTS_VALUE) {
+        return;
+    }
+    if (state.first_ts == AV_NOPTS_VALUE) {
+        state.first_ts = ts;
+    }
+    const int64_t ms = av_rescale_q(ts - state.first_ts, time_base, AVRational{1, 1000});
+    if (ms < 0) {
+        return;
+    }
+    const auto bucket = static_cast<size_t>(ms / kPacketIndexBucketMs);
+    if (bucket >= state.buckets.size()) {
+        state.buckets.resize(bucket + 1, 0);
+    }
+    state.buckets[bucket] += pkt->size;
+}
+
+// Scan all packets of input_file and write a binary index to index_file, no per packet console output.
+// Records are batched and written with one fwrite per kPacketIndexBatchRecords packets
+int build_packet_index(const char *input_file, const char *index_file) {
+    int ret = 0;
+    AVFormatContext *fmt_ctx = nullptr;
+    if ((ret = avformat_open_input(&fmt_ctx, input_file, nullptr, nullptr)) < 0) {
+        return ret;
+    }
+    if ((ret = avformat_find_stream_info(fmt_ctx, nullptr)) < 0) {
+        avformat_close_input(&fmt_ctx);
+        return ret;
+    }
+
+    FILE *fp = std::fopen(index_file, "wb");
+    if (fp == nullptr) {
+        fprintf(stderr, "Could not open index file '%s'\n", index_file);
+        avformat_close_input(&fmt_ctx);
+        return -1;
+    }
+
+    AVPacket *pkt = nullptr;
+    if ((pkt = av_packet_alloc()) == nullptr) {
+        fprintf(stderr, "Could not allocate AVPacket\n");
+        std::fclose(fp);
+        avformat_close_input(&fmt_ctx);
+        return -1;
+    }
+
+    std::vector<PacketIndexStreamState> streams(fmt_ctx->nb_streams);
+    for (unsigned int i = 0; i < fmt_ctx->nb_streams; i++) {
+        const AVStream *stream = fmt_ctx->streams[i];
+        PacketIndexStream &summary = streams[i].summary;
+        summary.index = static_cast<int32_t>(i);
+        summary.codec_type = stream->codecpar->codec_type;
+        summary.codec_id = stream->codecpar->codec_id;
+        summary.time_base_num = stream->time_base.num;
+        summary.time_base_den = stream->time_base.den;
+    }
+
+    // the header is rewritten with the final counts when the scan is done
+    PacketIndexHeader header{};
+    std::memcpy(header.magic, kPacketIndexMagic, sizeof(header.magic));
+    header.version = kPacketIndexVersion;
+    header.stream_count = fmt_ctx->nb_streams;
+    header.records_offset = sizeof(PacketIndexHeader);
+    header.bucket_ms = kPacketIndexBucketMs;
+    bool io_ok = std::fwrite(&header, sizeof(header), 1, fp) == 1;
+
+    std::vector<PacketIndexRecord> batch;
+    batch.reserve(kPacketIndexBatchRecords);
+    const auto flush_batch = [&]() -> void {
+        if (!batch.empty() && std::fwrite(batch.data(), sizeof(PacketIndexRecord), batch.size(), fp) != batch.size()) {
+            io_ok = false;
+        }
+        batch.clear();
+    };
+
+    const auto start = std::chrono::steady_clock::now();
+    int64_t input_bytes = 0;
+    while (io_ok) {
+        if ((ret = av_read_frame(fmt_ctx, pkt)) < 0) {
+            break;
+        }
+        if (static_cast<unsigned int>(pkt->stream_index) >= streams.size()) {
+            av_packet_unref(pkt); // a stream added after the header, not in the index
+            continue;
+        }
+        PacketIndexStreamState &state = streams[pkt->stream_index];
+        AccumulatePacket(state, pkt, fmt_ctx->streams[pkt->stream_index]->time_base);
+        if (pkt->flags & AV_PKT_FLAG_KEY) {
+            state.keys.push_back({pkt->pts, header.record_count});
+        }
+        batch.push_back({pkt->pts, pkt->dts, pkt->pos, pkt->duration, pkt->size,
+                         static_cast<uint16_t>(pkt->stream_index), static_cast<uint16_t>(pkt->flags)});
+        header.record_count++;
+        input_bytes += pkt->size;
+        if (batch.size() == kPacketIndexBatchRecords) {
+            flush_batch();
+        }
+        av_packet_unref(pkt);
+    }
+    flush_batch();
+    if (ret != AVERROR_EOF) {
+        fprintf(stderr, "Could not read frame: %d\n", ret);
+    }
+
+    // stream summaries and their bitrate buckets follow the records
+    header.streams_offset = header.records_offset + header.record_count * sizeof(PacketIndexRecord);
+    header.buckets_offset = header.streams_offset + header.stream_count * sizeof(PacketIndexStream);
+    uint64_t bucket_first = 0;
+    uint64_t key_first = 0;
+    for (auto &state: streams) {
+        CloseGop(state);
+        PacketIndexStream &summary = state.summary;
+        summary.gop_avg = summary.gop_count ? static_cast<double>(state.gop_sum) / summary.gop_count : 0.0;
+        summary.bucket_first = bucket_first;
+        summary.bucket_count = state.buckets.size();
+        summary.key_first = key_first;
+        bucket_first += summary.bucket_count;
+        key_first += summary.key_count;
+        io_ok = io_ok && std::fwrite(&summary, sizeof(summary), 1, fp) == 1;
+    }
+    for (const auto &state: streams) {
+        const size_t count = state.buckets.size();
+        io_ok = io_ok && std::fwrite(state.buckets.data(), sizeof(uint64_t), count, fp) == count;
+    }
+    header.keys_offset = header.buckets_offset + bucket_first * sizeof(uint64_t);
+    for (auto &state: streams) {
+        std::stable_sort(state.keys.begin(), state.keys.end(),
+                         [](const PacketIndexKey &a, const PacketIndexKey &b) -> bool { return a.pts < b.pts; });
+        const size_t count = state.keys.size();
+        io_ok = io_ok && std::fwrite(state.keys.data(), sizeof(PacketIndexKey), count, fp) == count;
+    }
+    io_ok = io_ok && std::fseek(fp, 0, SEEK_SET) == 0 && std::fwrite(&header, sizeof(header), 1, fp) == 1;
+    io_ok = std::fclose(fp) == 0 && io_ok;
+
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf("Indexed %llu packets, %.1f MB in %.3f s (%.1f MB/s, %.0f packets/s)\n",
+           header.record_count, input_bytes / 1e6, seconds, input_bytes / 1e6 / seconds,
+           header.record_count / seconds);
+    for (const auto &state: streams) {
+        const PacketIndexStream &summary = state.summary;
+        const double duration_s = static_cast<double>(summary.bucket_count) * kPacketIndexBucketMs / 1000.0;
+        printf("Stream #%d %s: packets=%llu, key=%llu, gop min/avg/max=%d/%.1f/%d, avg bitrate=%.0f kb/s\n",
+               summary.index, av_get_media_type_string(static_cast<AVMediaType>(summary.codec_type)),
+               summary.packet_count, summary.key_count, summary.gop_min, summary.gop_avg, summary.gop_max,
+               duration_s > 0 ? summary.total_bytes * 8 / duration_s / 1000 : 0.0);
+    }
+
+    av_packet_free(&pkt);
+    avformat_close_input(&fmt_ctx);
+    if (!io_ok) {
+        fprintf(stderr, "Could not write index file '%s'\n", index_file);
+        return -1;
+    }
+    return 0;
+}
+
+// true if count elements of element_size bytes at offset lie within a mapping of size bytes, without overflow
+static bool IndexSectionFits(uint64_t offset, uint64_t count, size_t element_size, size_t size) {
+    return offset <= size && count <= (size - offset) / element_size;
+}
+
+// Find the last key packet of stream_index at or before seconds, using the mmapped index only: a binary search
+// in the stream's key table, every section is bounds checked against the mapping first
+int lookup_packet_index(const char *index_file, int stream_index, double seconds) {
+    MappedFile index;
+    if (!index.Open(index_file, false) || index.Size() < sizeof(PacketIndexHeader)) {
+        fprintf(stderr, "Could not map index file '%s'\n", index_file);
+        return -1;
+    }
+    const auto *header = reinterpret_cast<const PacketIndexHeader *>(index.Data());
+    if (std::memcmp(header->magic, kPacketIndexMagic, sizeof(kPacketIndexMagic)) != 0 ||
+        header->version != kPacketIndexVersion ||
+        !IndexSectionFits(header->records_offset, header->record_count, sizeof(PacketIndexRecord), index.Size()) ||
+        !IndexSectionFits(header->streams_offset, header->stream_count, sizeof(PacketIndexStream), index.Size()) ||
+        header->buckets_offset > index.Size() || header->keys_offset > index.Size() ||
+        stream_index < 0 || static_cast<uint32_t>(stream_index) >= header->stream_count) {
+        fprintf(stderr, "Invalid index file or stream index\n");
+        return -1;
+    }
+    const auto *records = reinterpret_cast<const PacketIndexRecord *>(index.Data() + header->records_offset);
+    const auto *streams = reinterpret_cast<const PacketIndexStream *>(index.Data() + header->streams_offset);
+    const PacketIndexStream &stream = streams[stream_index];
+    const uint64_t key_table_size = (index.Size() - header->keys_offset) / sizeof(PacketIndexKey);
+    if (stream.key_first > key_table_size || stream.key_count > key_table_size - stream.key_first ||
+        stream.time_base_num <= 0 || stream.time_base_den <= 0) {
+        fprintf(stderr, "Invalid index file: stream #%d\n", stream_index);
+        return -1;
+    }
+    const AVRational time_base{stream.time_base_num, stream.time_base_den};
+    const int64_t target = static_cast<int64_t>(seconds / av_q2d(time_base));
+
+    const auto *keys = reinterpret_cast<const PacketIndexKey *>(index.Data() + header->keys_offset) + stream.key_first;
+    const PacketIndexKey *key = std::upper_bound(keys, keys + stream.key_count, target,
+                                                 [](int64_t pts, const PacketIndexKey &k) -> bool {
+                                                     return pts < k.pts;
+                                                 });
+    const PacketIndexRecord *found = nullptr;
+    if (key != keys && key[-1].pts != AV_NOPTS_VALUE) {
+        if (key[-1].record >= header->record_count) {
+            fprintf(stderr, "Invalid index file: key record %llu\n", key[-1].record);
+            return -1;
+        }
+        found = &records[key[-1].record];
+    }
+    if (found == nullptr) {
+        printf("No key packet of stream #%d before %.3f s\n", stream_index, seconds);
+        return 0;
+    }
+    printf("Stream #%d key packet before %.3f s: pts=%lld, dts=%lld, pos=%lld, size=%d, time=%.3f s\n",
+           stream_index, seconds, found->pts, found->dts, found->pos, found->size, found->pts * av_q2d(time_base));
+    return 0;
+}
+
+struct ProbeResult {
+    std::string path;
+    uint64_t size = 0;
+    int64_t mtime = 0; // cache key together with path and size
+    int error = 0; // avformat error code, 0 if the file was probed successfully
+    std::string format;
+    int64_t duration_ms = 0;
+    int64_t bit_rate = 0;
+    std::string streams; // "video:h264:640x360,audio:aac:48000Hz:2ch"
+};
+
+// Per worker job deques, a worker pops from the back of its own deque and steals from the front of the others.
+// All jobs are pushed before the workers start, so a worker is done when every deque is empty
+class WorkStealingQueues {
+public:
+    explicit WorkStealingQueues(size_t workers) : queues_(workers) {}
+
+    void Push(size_t worker, size_t job) {
+        std::lock_guard lock(queues_[worker].mutex);
+        queues_[worker].jobs.push_back(job);
+    }
+
+    bool Pop(size_t worker, size_t &job) {
+        for (size_t i = 0; i < queues_.size(); ++i) {
+            Queue &queue = queues_[(worker + i) % queues_.size()];
+            std::lock_guard lock(queue.mutex);
+            if (queue.jobs.empty()) {
+                continue;
+            }
+            if (i == 0) {
+                job = queue.jobs.back();
+                queue.jobs.pop_back();
+            } else {
+                job = queue.jobs.front();
+                queue.jobs.pop_front();
+            }
+            return true;
+        }
+        return false;
+    }
+
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<size_t> jobs;
+    };
+
+    std::vector<Queue> queues_;
+};
+
+static void ProbeFile(ProbeResult &result) {
+    AVFormatContext *fmt_ctx = nullptr;
+    if ((result.error = avformat_open_input(&fmt_ctx, result.path.c_str(), nullptr, nullptr)) < 0) {
+        return;
+    }
+    if ((result.error = avformat_find_stream_info(fmt_ctx, nullptr)) < 0) {
+        avformat_close_input(&fmt_ctx);
+        return;
+    }
+    result.error = 0;
+    result.format = fmt_ctx->iformat->name;
+    result.duration_ms = fmt_ctx->duration != AV_NOPTS_VALUE ? fmt_ctx->duration / 1000 : 0;
+    result.bit_rate = fmt_ctx->bit_rate;
+    result.streams.clear();
+    for (unsigned int i = 0; i < fmt_ctx->nb_streams; i++) {
+        const AVCodecParameters *param = fmt_ctx->streams[i]->codecpar;
+        const char *type = av_get_media_type_string(param->codec_type);
+        if (i > 0) {
+            result.streams += ',';
+        }
+        result.streams += type ? type : "unknown";
+        result.streams += ':';
+        result.streams += avcodec_get_name(param->codec_id);
+        if (param->codec_type == AVMEDIA_TYPE_VIDEO) {
+            result.streams += ':' + std::to_string(param->width) + 'x' + std::to_string(param->height);
+        } else if (param->codec_type == AVMEDIA_TYPE_AUDIO) {
+            result.streams += ':' + std::to_string(param->sample_rate) + "Hz:" +
+                              std::to_string(param->ch_layout.nb_channels) + "ch";
+        }
+    }
+    avformat_close_input(&fmt_ctx);
+}
+
+// probe cache, one tab separated line per file: path size mtime error format duration_ms bit_rate streams
+static std::unordered_map<std::string, ProbeResult> LoadProbeCache(const char *cache_file) {
+    std::unordered_map<std::string, ProbeResult> cache;
+    std::ifstream ifs(cache_file);
+    std::string line;
+    while (std::getline(ifs, line)) {
+        std::vector<std::string> fields;
+        size_t begin = 0;
+        for (size_t end; (end = line.find('\t', begin)) != std::string::npos; begin = end + 1) {
+            fields.push_back(line.substr(begin, end - begin));
+        }
+        fields.push_back(line.substr(begin));
+        if (fields.size() != 8) {
+            continue;
+        }
+        ProbeResult result;
+        result.path = fields[0];
+        result.size = std::strtoull(fields[1].c_str(), nullptr, 10);
+        result.mtime = std::strtoll(fields[2].c_str(), nullptr, 10);
+        result.error = std::atoi(fields[3].c_str());
+        result.format = fields[4];
+        result.duration_ms = std::strtoll(fields[5].c_str(), nullptr, 10);
+        result.bit_rate = std::strtoll(fields[6].c_str(), nullptr, 10);
+        result.streams = fields[7];
+        cache[result.path] = std::move(result);
+    }
+    return cache;
+}
+
+// the whole cache is written back, entries of paths outside this run's input are kept
+static bool SaveProbeCache(const char *cache_file, const std::unordered_map<std::string, ProbeResult> &cache) {
+    // write to a temporary file and rename, so an interrupted scan never leaves a truncated cache
+    const std::string tmp_file = std::string(cache_file) + ".tmp";
+    {
+        std::ofstream ofs(tmp_file, std::ios::binary | std::ios::trunc);
+        for (const auto &[path, result]: cache) {
+            if (result.path.find_first_of("\t\n") != std::string::npos) {
+                continue; // not representable in the cache, probed again next time
+            }
+            ofs << result.path << '\t' << result.size << '\t' << result.mtime << '\t' << result.error << '\t'
+                << result.format << '\t' << result.duration_ms << '\t' << result.bit_rate << '\t'
+                << result.streams << '\n';
+        }
+        if (!ofs) {
+            return false;
+        }
+    }
+    std::error_code ec;
+    std::filesystem::rename(tmp_file, cache_file, ec);
+    return !ec;
+}
+
+// input is a directory (scanned recursively), a single file, or @list.txt with one path per line
+static std::vector<std::string> CollectProbePaths(const char *input) {
+    std::vector<std::string> paths;
+    if (input[0] == '@') {
+        std::ifstream ifs(input + 1);
+        std::string line;
+        while (std::getline(ifs, line)) {
+            if (!line.empty() && line.back() == '\r') {
+                line.pop_back();
+            }
+            if (!line.empty()) {
+                paths.push_back(line);
+            }
+        }
+        return paths;
+    }
+    std::error_code ec;
+    if (!std::filesystem::is_directory(input, ec)) {
+        paths.emplace_back(input);
+        return paths;
+    }
+    const auto options = std::filesystem::directory_options::skip_permission_denied;
+    for (auto it = std::filesystem::recursive_directory_iterator(input, options, ec);
+         it != std::filesystem::recursive_directory_iterator(); it.increment(ec)) {
+        if (ec) {
+            break;
+        }
+        if (it->is_regular_file(ec)) {
+            paths.push_back(it->path().string());
+        }
+    }
+    return paths;
+}
+
+// Probe every file of input on a work-stealing thread pool, only files whose size or mtime changed since the
+// last run are opened, the others are taken from cache_file
+int batch_probe(const char *input, const char *cache_file) {
+    av_log_set_level(AV_LOG_QUIET); // most files of a media library dump are not media files
+
+    const auto start = std::chrono::steady_clock::now();
+    const std::vector<std::string> paths = CollectProbePaths(input);
+    std::unordered_map<std::string, ProbeResult> cache = LoadProbeCache(cache_file);
+
+    std::vector<ProbeResult> results(paths.size());
+    std::vector<size_t> jobs;
+    for (size_t i = 0; i < paths.size(); ++i) {
+        ProbeResult &result = results[i];
+        result.path = paths[i];
+        std::error_code ec;
+        result.size = std::filesystem::file_size(result.path, ec);
+        const auto mtime = std::filesystem::last_write_time(result.path, ec);
+        result.mtime = ec ? 0 : static_cast<int64_t>(mtime.time_since_epoch().count());
+        const auto it = cache.find(result.path);
+        if (it != cache.end() && it->second.size == result.size && it->second.mtime == result.mtime) {
+            result = it->second;
+        } else {
+            jobs.push_back(i);
+        }
+    }
+
+    // contiguous chunks keep files of one directory on one worker, stealing evens out slow files
+    const size_t workers = std::max(1u, std::thread::hardware_concurrency());
+    WorkStealingQueues queues(workers);
+    for (size_t i = 0; i < jobs.size(); ++i) {
+        queues.Push(i * workers / jobs.size(), jobs[i]);
+    }
+    std::atomic<size_t> failed{0};
+    std::vector<std::thread> threads;
+    for (size_t worker = 0; worker < workers; ++worker) {
+        threads.emplace_back([&, worker]() -> void {
+            size_t job;
+            while (queues.Pop(worker, job)) {
+                ProbeFile(results[job]);
+                if (results[job].error < 0) {
+                    failed.fetch_add(1, std::memory_order_relaxed);
+                }
+            }
+        });
+    }
+    for (auto &thread: threads) {
+        thread.join();
+    }
+
+    // merge this run into the loaded cache, so probing another input does not drop it
+    for (const auto &result: results) {
+        cache[result.path] = result;
+    }
+    const bool saved = SaveProbeCache(cache_file, cache);
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf("Probed %zu files in %.3f s (%.0f files/s): %zu from cache, %zu opened (%zu failed), %zu threads\n",
+           results.size(), seconds, results.size() / seconds, results.size() - jobs.size(), jobs.size(),
+           failed.load(), workers);
+    if (!saved) {
+        fprintf(stderr, "Could not write probe cache '%s'\n", cache_file);
+        return -1;
+    }
+    return 0;
+}
+
+// caller-owned bytes a demuxer reads through a custom AVIOContext, the data must outlive the AVFormatContext
+struct MemoryInput {
+    const uint8_t *data = nullptr;
+    size_t size = 0;
+    size_t pos = 0;
+};
+
+static int MemoryRead(void *opaque, uint8_t *buf, int buf_size) {
+    auto *input = static_cast<MemoryInput *>(opaque);
+    if (input->pos >= input->size) {
+        return AVERROR_EOF;
+    }
+    const size_t read_size = std::min(static_cast<size_t>(buf_size), input->size - input->pos);
+    std::memcpy(buf, input->data + input->pos, read_size);
+    input->pos += read_size;
+    return static_cast<int>(read_size);
+}
+
+static int64_t MemorySeek(void *opaque, int64_t offset, int whence) {
+    auto *input = static_cast<MemoryInput *>(opaque);
+    int64_t pos;
+    switch (whence & ~AVSEEK_FORCE) {
+        case AVSEEK_SIZE:
+            return static_cast<int64_t>(input->size);
+        case SEEK_SET:
+            pos = offset;
+            break;
+        case SEEK_CUR:
+            pos = static_cast<int64_t>(input->pos) + offset;
+            break;
+        case SEEK_END:
+            pos = static_cast<int64_t>(input->size) + offset;
+            break;
+        default:
+            return AVERROR(EINVAL);
+    }
+    if (pos < 0 || pos > static_cast<int64_t>(input->size)) {
+        return AVERROR(EINVAL);
+    }
+    input->pos = static_cast<size_t>(pos);
+    return pos;
+}
+
+static void CloseMemoryInput(AVFormatContext **fmt_ctx) {
+    if (*fmt_ctx == nullptr) {
+        return;
+    }
+    // with AVFMT_FLAG_CUSTOM_IO avformat_close_input leaves the AVIOContext to the caller
+    AVIOContext *avio_ctx = (*fmt_ctx)->pb;
+    avformat_close_input(fmt_ctx);
+    if (avio_ctx) {
+        av_freep(&avio_ctx->buffer);
+        avio_context_free(&avio_ctx);
+    }
+}
+
+static int OpenMemoryInput(AVFormatContext **fmt_ctx, MemoryInput *input) {
+    auto *avio_buffer = static_cast<uint8_t *>(av_malloc(kMemoryIOBufferSize));
+    if (avio_buffer == nullptr) {
+        return AVERROR(ENOMEM);
+    }
+    AVIOContext *avio_ctx = avio_alloc_context(avio_buffer, kMemoryIOBufferSize, 0, input, MemoryRead,
+                                               nullptr, MemorySeek);
+    if (avio_ctx == nullptr) {
+        av_free(avio_buffer);
+        return AVERROR(ENOMEM);
+    }
+    if ((*fmt_ctx = avformat_alloc_context()) == nullptr) {
+        av_freep(&avio_ctx->buffer);
+        avio_context_free(&avio_ctx);
+        return AVERROR(ENOMEM);
+    }
+    (*fmt_ctx)->pb = avio_ctx;
+    (*fmt_ctx)->flags |= AVFMT_FLAG_CUSTOM_IO;
+
+    int ret = 0;
+    if ((ret = avformat_open_input(fmt_ctx, nullptr, nullptr, nullptr)) < 0) {
+        // avformat_open_input frees the context on failure, but not the custom AVIOContext
+        av_freep(&avio_ctx->buffer);
+        avio_context_free(&avio_ctx);
+        return ret;
+    }
+    if ((ret = avformat_find_stream_info(*fmt_ctx, nullptr)) < 0) {
+        CloseMemoryInput(fmt_ctx);
+        return ret;
+    }
+    return 0;
+}
+
+// Demux the whole input once and record every packet. Packets can later be built straight from the source
+// buffer by pos and size, without the demuxer, only if every payload is one contiguous run of input bytes at
+// pkt->pos. That holds for mov/mp4 but not for formats that reassemble packets (mpegts, flv audio, ...), so
+// every payload is compared in full and false is returned on the first mismatch
+static bool BuildSourcePacketIndex(AVFormatContext *fmt_ctx, const MemoryInput &input,
+                                   std::vector<PacketIndexRecord> &records) {
+    AVPacket *pkt = nullptr;
+    if ((pkt = av_packet_alloc()) == nullptr) {
+        fprintf(stderr, "Could not allocate AVPacket\n");
+        return false;
+    }
+    bool contiguous = true;
+    int ret = 0;
+    while (contiguous && (ret = av_read_frame(fmt_ctx, pkt)) >= 0) {
+        contiguous = pkt->pos >= 0 && pkt->size > 0 && static_cast<uint64_t>(pkt->pos) + pkt->size <= input.size &&
+                     std::memcmp(input.data + pkt->pos, pkt->data, pkt->size) == 0;
+        records.push_back({pkt->pts, pkt->dts, pkt->pos, pkt->duration, pkt->size,
+                           static_cast<uint16_t>(pkt->stream_index), static_cast<uint16_t>(pkt->flags)});
+        av_packet_unref(pkt);
+    }
+    av_packet_free(&pkt);
+    return contiguous && ret == AVERROR_EOF;
+}
+
+static void NoopBufferFree(void *, uint8_t *) {}
+
+struct DemuxBenchmark {
+    int64_t packets = 0;
+    int64_t bytes = 0;
+    int64_t zero_copy_packets = 0;
+    double seconds = 0.0;
+};
+
+static int RunDemuxBenchmark(AVFormatContext *fmt_ctx, DemuxBenchmark &result) {
+    AVPacket *pkt = nullptr;
+    if ((pkt = av_packet_alloc()) == nullptr) {
+        fprintf(stderr, "Could not allocate AVPacket\n");
+        return -1;
+    }
+    int ret = 0;
+    const auto start = std::chrono::steady_clock::now();
+    while ((ret = av_read_frame(fmt_ctx, pkt)) >= 0) {
+        result.packets++;
+        result.bytes += pkt->size;
+        av_packet_unref(pkt);
+    }
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    av_packet_free(&pkt);
+    return ret == AVERROR_EOF ? 0 : ret;
+}
+
+// Build the packets of records straight from the source buffer, neither the demuxer nor the AVIO read callback
+// runs and the payload is never copied. Decoders read up to AV_INPUT_BUFFER_PADDING_SIZE bytes past a packet,
+// so the last packets of the buffer, which have no such room, are copied into padded packets
+static int RunIndexedBenchmark(const std::vector<PacketIndexRecord> &records, AVBufferRef *source,
+                               DemuxBenchmark &result) {
+    AVPacket *pkt = nullptr;
+    if ((pkt = av_packet_alloc()) == nullptr) {
+        fprintf(stderr, "Could not allocate AVPacket\n");
+        return -1;
+    }
+    int ret = 0;
+    const auto start = std::chrono::steady_clock::now();
+    for (const PacketIndexRecord &record: records) {
+        const uint8_t *payload = source->data + record.pos;
+        if (static_cast<uint64_t>(record.pos) + record.size + AV_INPUT_BUFFER_PADDING_SIZE <= source->size) {
+            if ((pkt->buf = av_buffer_ref(source)) == nullptr) {
+                ret = AVERROR(ENOMEM);
+                break;
+            }
+            pkt->data = const_cast<uint8_t *>(payload);
+            pkt->size = record.size;
+            result.zero_copy_packets++;
+        } else if ((ret = av_new_packet(pkt, record.size)) < 0) {
+            break;
+        } else {
+            std::memcpy(pkt->data, payload, record.size);
+        }
+        pkt->pts = record.pts;
+        pkt->dts = record.dts;
+        pkt->pos = record.pos;
+        pkt->duration = record.duration;
+        pkt->stream_index = record.stream_index;
+        pkt->flags = record.flags;
+        result.packets++;
+        result.bytes += pkt->size;
+        av_packet_unref(pkt);
+    }
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    av_packet_free(&pkt);
+    return ret;
+}
+
+static void PrintDemuxBenchmark(const char *name, const DemuxBenchmark &result, double open_seconds) {
+    printf("%-16s open %7.3f ms, read %8.3f ms, %lld packets (%lld zero-copy), %.1f MB/s\n", name,
+           open_seconds * 1000, result.seconds * 1000, result.packets, result.zero_copy_packets,
+           result.bytes / 1e6 / result.seconds);
+}
+
+// Demultiplex input_file from a path, then from its mmapped bytes through a custom AVIOContext, and compare the
+// cost of both. Then replay the packets from an in-memory index of the mmapped bytes without the demuxer, the
+// replay is not a demux (the index needs a full demuxing pass first), so it is printed on its own without MB/s
+int demultiplex_memory(const char *input_file) {
+    MappedFile mapped;
+    if (!mapped.Open(input_file)) {
+        fprintf(stderr, "Could not map input file '%s'\n", input_file);
+        return -1;
+    }
+    // the mapping is owned by MappedFile, the AVBufferRef only lends it to packets
+    AVBufferRef *source = av_buffer_create(const_cast<uint8_t *>(mapped.Data()), mapped.Size(), NoopBufferFree,
+                                           nullptr, AV_BUFFER_FLAG_READONLY);
+    if (source == nullptr) {
+        fprintf(stderr, "Could not create source AVBufferRef\n");
+        return -1;
+    }
+
+    int ret = 0;
+    for (int mode = 0; mode < 3 && ret >= 0; ++mode) {
+        const char *names[] = {"file", "memory", "indexed replay"};
+        AVFormatContext *fmt_ctx = nullptr;
+        MemoryInput input{mapped.Data(), mapped.Size(), 0};
+        const auto start = std::chrono::steady_clock::now();
+        if (mode == 0) {
+            if ((ret = avformat_open_input(&fmt_ctx, input_file, nullptr, nullptr)) >= 0 &&
+                (ret = avformat_find_stream_info(fmt_ctx, nullptr)) < 0) {
+                avformat_close_input(&fmt_ctx);
+            }
+        } else {
+            ret = OpenMemoryInput(&fmt_ctx, &input);
+        }
+        if (ret < 0) {
+            fprintf(stderr, "Could not open %s input: %d\n", names[mode], ret);
+            break;
+        }
+        const double open_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        DemuxBenchmark result;
+        if (mode == 2) {
+            printf("\n");
+            std::vector<PacketIndexRecord> records;
+            const bool contiguous = BuildSourcePacketIndex(fmt_ctx, input, records);
+            const double index_seconds =
+                    std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            CloseMemoryInput(&fmt_ctx);
+            if (!contiguous) {
+                printf("%-16s not supported, the packets of this format are not contiguous in the input\n",
+                       names[mode]);
+                break;
+            }
+            ret = RunIndexedBenchmark(records, source, result);
+            printf("%-16s index build %.3f ms (a full demuxing pass), replay %.3f ms, total %.3f ms, "
+                   "%lld packets (%lld zero-copy)\n", names[mode], index_seconds * 1000, result.seconds * 1000,
+                   (index_seconds + result.seconds) * 1000, result.packets, result.zero_copy_packets);
+            break;
+        }
+        ret = RunDemuxBenchmark(fmt_ctx, result);
+        PrintDemuxBenchmark(names[mode], result, open_seconds);
+        if (mode == 0) {
+            avformat_close_input(&fmt_ctx);
+        } else {
+            CloseMemoryInput(&fmt_ctx);
+        }
+    }
+    av_buffer_unref(&source);
+    return ret;
+}
+
+// Stream-copy every audio, video and subtitle stream of input_file into output_file, the container is chosen by
+// format_name or the output extension (mp4, ts, mkv, flv, ...). Nothing is decoded
+int remux(const char *input_file, const char *output_file, const char *format_name) {
+    int ret = 0;
+    AVFormatContext *ifmt_ctx = nullptr;
+    if ((ret = avformat_open_input(&ifmt_ctx, input_file, nullptr, nullptr)) < 0) {
+        return ret;
+    }
+    if ((ret = avformat_find_stream_info(ifmt_ctx, nullptr)) < 0) {
+        avformat_close_input(&ifmt_ctx);
+        return ret;
+    }
+
+    AVFormatContext *ofmt_ctx = nullptr;
+    if ((ret = avformat_alloc_output_context2(&ofmt_ctx, nullptr, format_name, output_file)) < 0) {
+        fprintf(stderr, "Could not create output context for '%s'\n", output_file);
+        avformat_close_input(&ifmt_ctx);
+        return ret;
+    }
+
+    // input stream index -> output stream index, -1 for streams that are dropped (data, attachments)
+    std::vector<int> stream_map(ifmt_ctx->nb_streams, -1);
+    for (unsigned int i = 0; i < ifmt_ctx->nb_streams && ret >= 0; i++) {
+        const AVCodecParameters *in_param = ifmt_ctx->streams[i]->codecpar;
+        if (in_param->codec_type != AVMEDIA_TYPE_VIDEO && in_param->codec_type != AVMEDIA_TYPE_AUDIO &&
+            in_param->codec_type != AVMEDIA_TYPE_SUBTITLE) {
+            continue;
+        }
+        AVStream *out_stream = avformat_new_stream(ofmt_ctx, nullptr);
+        if (out_stream == nullptr) {
+            ret = AVERROR(ENOMEM);
+            break;
+        }
+        if ((ret = avcodec_parameters_copy(out_stream->codecpar, in_param)) < 0) {
+            break;
+        }
+        out_stream->codecpar->codec_tag = 0; // let the muxer pick the tag of its container
+        stream_map[i] = out_stream->index;
+    }
+
+    ChunkFileWriter writer;
+    AVIOContext *avio_ctx = nullptr;
+    uint8_t *avio_buffer = nullptr;
+    if (ret >= 0 && !(ofmt_ctx->oformat->flags & AVFMT_NOFILE)) {
+        if (!writer.Open(output_file, kRemuxChunkSize, kRemuxMaxQueuedChunks)) {
+            fprintf(stderr, "Could not open output file '%s'\n", output_file);
+            ret = AVERROR(EIO);
+        } else if ((avio_buffer = static_cast<uint8_t *>(av_malloc(kRemuxIOBufferSize))) == nullptr ||
+                   (avio_ctx = avio_alloc_context(avio_buffer, kRemuxIOBufferSize, 1, &writer, nullptr,
+                                                  ChunkFileWriter::WritePacket,
+                                                  ChunkFileWriter::SeekPacket)) == nullptr) {
+            av_free(avio_buffer);
+            ret = AVERROR(ENOMEM);
+        } else {
+            ofmt_ctx->pb = avio_ctx;
+        }
+    }
+
+    AVPacket *pkt = nullptr;
+    if (ret >= 0 && (pkt = av_packet_alloc()) == nullptr) {
+        ret = AVERROR(ENOMEM);
+    }
+    if (ret >= 0 && (ret = avformat_write_header(ofmt_ctx, nullptr)) < 0) {
+        fprintf(stderr, "Could not write header: %d\n", ret);
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    int64_t input_bytes = 0;
+    int64_t packets = 0;
+    while (ret >= 0) {
+        if ((ret = av_read_frame(ifmt_ctx, pkt)) < 0) {
+            ret = ret == AVERROR_EOF ? 0 : ret;
+            break;
+        }
+        const int out_index = stream_map[pkt->stream_index];
+        if (out_index < 0) {
+            av_packet_unref(pkt);
+            continue;
+        }
+        input_bytes += pkt->size;
+        packets++;
+        av_packet_rescale_ts(pkt, ifmt_ctx->streams[pkt->stream_index]->time_base,
+                             ofmt_ctx->streams[out_index]->time_base);
+        pkt->stream_index = out_index;
+        pkt->pos = -1;
+        // takes ownership of the packet data and leaves pkt blank
+        if ((ret = av_interleaved_write_frame(ofmt_ctx, pkt)) < 0) {
+            fprintf(stderr, "Could not write packet: %d\n", ret);
+        }
+    }
+    if (pkt && ret >= 0 && (ret = av_write_trailer(ofmt_ctx)) < 0) {
+        fprintf(stderr, "Could not write trailer: %d\n", ret);
+    }
+    if (avio_ctx) {
+        avio_flush(avio_ctx);
+    }
+    if (!writer.Close() && ret >= 0) {
+        fprintf(stderr, "Could not write output file '%s'\n", output_file);
+        ret = AVERROR(EIO);
+    }
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if (ret >= 0) {
+        const int64_t output_bytes = writer.BytesWritten();
+        printf("Remuxed %lld packets to %s: read %.1f MB, wrote %.1f MB in %.3f s (%.1f MB/s)\n", packets,
+               ofmt_ctx->oformat->name, input_bytes / 1e6, output_bytes / 1e6, seconds,
+               (input_bytes + output_bytes) / 1e6 / seconds);
+    }
+
+    av_packet_free(&pkt);
+    if (avio_ctx) {
+        av_freep(&avio_ctx->buffer);
+        avio_context_free(&avio_ctx);
+    }
+    avformat_free_context(ofmt_ctx);
+    avformat_close_input(&ifmt_ctx);
+    return ret;
+}
+
 void test_memory() {
     AVFrame *frame1 = av_frame_alloc(); // allocate AVFrame
     frame1->format = AV_PIX_FMT_YUV420P; // planar YUV 4:2:0
@@ -141,8 +1093,266 @@ void test_memory() {
     av_frame_free(&frame2); // free AVFrame
 }
 
-int main() {
+static void FreeAlignedFrameMemory(void *, uint8_t *data) {
+#ifdef _WIN32
+    _aligned_free(data);
+#else
+    std::free(data);
+#endif
+}
+
+static AVBufferRef *AllocAlignedFrameMemory(size_t size, size_t align) {
+#ifdef _WIN32
+    void *data = _aligned_malloc(size, align);
+#else
+    void *data = nullptr;
+    if (posix_memalign(&data, align, size) != 0) {
+        data = nullptr;
+    }
+#endif
+    if (data == nullptr) {
+        return nullptr;
+    }
+    AVBufferRef *buf = av_buffer_create(static_cast<uint8_t *>(data), size, FreeAlignedFrameMemory, nullptr, 0);
+    if (buf == nullptr) {
+        FreeAlignedFrameMemory(nullptr, static_cast<uint8_t *>(data));
+    }
+    return buf;
+}
+
+// Recycles the buffers of fixed-geometry frames through an AVBufferPool. All planes of a frame live in one
+// buffer, every linesize and plane offset is a multiple of align
+class FramePool {
+public:
+    FramePool() = default;
+
+    FramePool(const FramePool &) = delete;
+
+    FramePool &operator=(const FramePool &) = delete;
+
+    ~FramePool() { av_buffer_pool_uninit(&pool_); } // buffers still referenced are freed when they return
+
+    bool Init(AVPixelFormat format, int width, int height, int align, bool huge_pages) {
+        av_buffer_pool_uninit(&pool_);
+        if (align <= 0 || (align & (align - 1)) != 0 || align < static_cast<int>(sizeof(void *))) {
+            return false;
+        }
+        int linesize[4] = {};
+        if (av_image_fill_linesizes(linesize, format, static_cast<int>(AlignUp(width, align))) < 0) {
+            return false;
+        }
+        ptrdiff_t aligned_linesize[4] = {};
+        for (int i = 0; i < 4; ++i) {
+            linesize_[i] = static_cast<int>(AlignUp(linesize[i], align));
+            aligned_linesize[i] = linesize_[i];
+        }
+        size_t plane_size[4] = {};
+        if (av_image_fill_plane_sizes(plane_size, format, height, aligned_linesize) < 0) {
+            return false;
+        }
+        buffer_size_ = 0;
+        for (int i = 0; i < 4; ++i) {
+            offset_[i] = buffer_size_;
+            buffer_size_ = AlignUp(buffer_size_ + plane_size[i], align);
+        }
+        buffer_size_ += align; // SIMD code may read one vector past the last row, like av_frame_get_buffer
+
+        format_ = format;
+        width_ = width;
+        height_ = height;
+        align_ = align;
+        huge_pages_ = huge_pages;
+        pool_ = av_buffer_pool_init2(buffer_size_, this, Alloc, nullptr);
+        return pool_ != nullptr;
+    }
+
+    // frame must not hold any buffer
+    int Get(AVFrame *frame) {
+        AVBufferRef *buf = av_buffer_pool_get(pool_);
+        if (buf == nullptr) {
+            return AVERROR(ENOMEM);
+        }
+        frame->buf[0] = buf;
+        for (int i = 0; i < 4; ++i) {
+            frame->data[i] = linesize_[i] ? buf->data + offset_[i] : nullptr;
+            frame->linesize[i] = linesize_[i];
+        }
+        frame->extended_data = frame->data;
+        frame->format = format_;
+        frame->width = width_;
+        frame->height = height_;
+        return 0;
+    }
+
+    size_t BufferSize() const { return buffer_size_; }
+
+private:
+    static AVBufferRef *Alloc(void *opaque, size_t size) {
+        const auto *pool = static_cast<FramePool *>(opaque);
+        return pool->huge_pages_ ? AllocHugePageBuffer(size) : AllocAlignedFrameMemory(size, pool->align_);
+    }
+
+    AVBufferPool *pool_ = nullptr;
+    AVPixelFormat format_ = AV_PIX_FMT_NONE;
+    int width_ = 0;
+    int height_ = 0;
+    int align_ = 64;
+    bool huge_pages_ = false;
+    int linesize_[4] = {};
+    size_t offset_[4] = {};
+    size_t buffer_size_ = 0;
+};
+
+static uint64_t PageFaultCount() {
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters{};
+    GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters));
+    return counters.PageFaultCount;
+#else
+    struct rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    return static_cast<uint64_t>(usage.ru_minflt + usage.ru_majflt);
+#endif
+}
+
+struct FrameAllocBenchmark {
+    double allocs_per_second = 0.0;
+    double faults_per_frame = 0.0;
+    double copy_gb_per_second = 0.0;
+};
+
+// alloc is int(AVFrame *), the first loop measures allocate + release only, the second one also fills every
+// frame from src, which is where fresh pages fault in
+template<typename Alloc>
+static FrameAllocBenchmark BenchmarkFrameAlloc(Alloc alloc, const AVFrame *src, int iterations, size_t frame_bytes) {
+    FrameAllocBenchmark result;
+    AVFrame *frame = av_frame_alloc();
+    if (frame == nullptr) {
+        return result;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; ++i) {
+        if (alloc(frame) < 0) {
+            av_frame_free(&frame);
+            return result;
+        }
+        av_frame_unref(frame);
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    result.allocs_per_second = iterations / seconds;
+
+    const uint64_t faults = PageFaultCount();
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; ++i) {
+        if (alloc(frame) < 0) {
+            break;
+        }
+        av_frame_copy(frame, src);
+        av_frame_unref(frame);
+    }
+    seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    result.faults_per_frame = static_cast<double>(PageFaultCount() - faults) / iterations;
+    result.copy_gb_per_second = static_cast<double>(frame_bytes) * iterations / seconds / 1e9;
+
+    av_frame_free(&frame);
+    return result;
+}
+
+// Compare av_frame_get_buffer per frame with FramePool, with and without huge pages, across formats and sizes
+int benchmark_frame_pool(int align) {
+    const AVPixelFormat formats[] = {AV_PIX_FMT_YUV420P, AV_PIX_FMT_NV21, AV_PIX_FMT_YUV420P10LE, AV_PIX_FMT_RGBA};
+    const int sizes[][2] = {{640, 360}, {1920, 1080}, {3840, 2160}};
+
+    printf("%-14s %-10s %-16s %12s %14s %12s\n", "format", "size", "allocator", "allocs/s", "faults/frame",
+           "copy GB/s");
+    for (const AVPixelFormat format: formats) {
+        for (const auto &size: sizes) {
+            const int width = size[0];
+            const int height = size[1];
+            AVFrame *src = av_frame_alloc();
+            if (src != nullptr) {
+                src->format = format;
+                src->width = width;
+                src->height = height;
+            }
+            if (src == nullptr || av_frame_get_buffer(src, align) < 0) {
+                fprintf(stderr, "Could not allocate source frame\n");
+                av_frame_free(&src);
+                return -1;
+            }
+            for (int i = 0; i < AV_NUM_DATA_POINTERS && src->buf[i]; ++i) {
+                std::memset(src->buf[i]->data, 0x80, src->buf[i]->size);
+            }
+            const int frame_bytes = av_image_get_buffer_size(format, width, height, 1);
+            const int iterations = static_cast<int>(std::clamp<int64_t>(kFramePoolBenchmarkBytes / frame_bytes,
+                                                                        50, 5000));
+
+            FramePool pool;
+            FramePool huge_pool;
+            if (!pool.Init(format, width, height, align, false) || !huge_pool.Init(format, width, height, align, true)) {
+                fprintf(stderr, "Could not create frame pool\n");
+                av_frame_free(&src);
+                return -1;
+            }
+            const std::pair<const char *, FrameAllocBenchmark> rows[] = {
+                {"get_buffer", BenchmarkFrameAlloc([&](AVFrame *frame) -> int {
+                    frame->format = format;
+                    frame->width = width;
+                    frame->height = height;
+                    return av_frame_get_buffer(frame, align);
+                }, src, iterations, frame_bytes)},
+                {"pool", BenchmarkFrameAlloc([&](AVFrame *frame) -> int {
+                    return pool.Get(frame);
+                }, src, iterations, frame_bytes)},
+                {"pool huge pages", BenchmarkFrameAlloc([&](AVFrame *frame) -> int {
+                    return huge_pool.Get(frame);
+                }, src, iterations, frame_bytes)},
+            };
+            const std::string geometry = std::to_string(width) + "x" + std::to_string(height);
+            for (const auto &[name, result]: rows) {
+                printf("%-14s %-10s %-16s %12.0f %14.1f %12.2f\n", av_get_pix_fmt_name(format), geometry.c_str(),
+                       name, result.allocs_per_second, result.faults_per_frame, result.copy_gb_per_second);
+            }
+            av_frame_free(&src);
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    // usage: ffmpeg_memory [dump|demux] [input_file]
+    //        ffmpeg_memory index <input_file> <index_file>
+    //        ffmpeg_memory lookup <index_file> <stream_index> <seconds>
+    //        ffmpeg_memory probe <directory|file|@list.txt> [cache_file]
+    //        ffmpeg_memory memory [input_file]
+    //        ffmpeg_memory pool [align]
+    //        ffmpeg_memory remux <input_file> <output_file> [format]
     const char *input_file = "../../../../yuv420p_640x360_25fps.mp4";
-    // return dump_format(input_file);
+    const std::string mode = argc > 1 ? argv[1] : "demux";
+    if (mode == "index" && argc > 3) {
+        return build_packet_index(argv[2], argv[3]);
+    }
+    if (mode == "lookup" && argc > 4) {
+        return lookup_packet_index(argv[2], std::atoi(argv[3]), std::atof(argv[4]));
+    }
+    if (mode == "remux" && argc > 3) {
+        return remux(argv[2], argv[3], argc > 4 ? argv[4] : nullptr);
+    }
+    if (mode == "pool") {
+        return benchmark_frame_pool(argc > 2 ? std::atoi(argv[2]) : 64);
+    }
+    if (mode == "probe" && argc > 2) {
+        return batch_probe(argv[2], argc > 3 ? argv[3] : "probe_cache.tsv");
+    }
+    if (argc > 2) {
+        input_file = argv[2];
+    }
+    if (mode == "dump") {
+        return dump_format(input_file);
+    }
+    if (mode == "memory") {
+        return demultiplex_memory(input_file);
+    }
     return demultiplex(input_file);
 }
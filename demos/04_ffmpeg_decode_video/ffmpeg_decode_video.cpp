@@ -1,14 +1,101 @@
 #if 1
 extern "C" {
+#include <libavcodec/bsf.h>
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
+#include <libavutil/opt.h>
+#include <libavutil/imgutils.h>
 #include <libavutil/pixdesc.h>
+#include <libswscale/swscale.h>
 }
 
+#include <bit>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <chrono>
+#include <thread>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <limits>
 #include <fstream>
+#include <algorithm>
+#include <condition_variable>
+
+#ifdef _WIN32
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "chunk_file_writer.h"
+#include "huge_pages.h"
+#include "mapped_file.h"
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define H264_SCAN_SSE2 1
+#include <emmintrin.h>
+#endif
+
+// the SSE4.2 crc32 instruction is picked at runtime, the binary still runs on CPUs without it
+#if defined(__x86_64__) || defined(_M_X64)
+#define FRAME_HASH_SSE42 1
+#include <nmmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define FRAME_HASH_TARGET_SSE42
+#else
+#define FRAME_HASH_TARGET_SSE42 __attribute__((target("sse4.2")))
+#endif
+#endif
 
 static constexpr std::size_t kInputVideoBufferSize = 20480;
 static constexpr int kInputVideoBufferRefillThreshold = 4096;
+static constexpr std::size_t kOutputBatchBytes = 8 * 1024 * 1024; // frames are packed into batches of this size
+static constexpr int kOutputBatchBuffers = 4; // decoder blocks when all of them wait for the disk
+static constexpr std::size_t kMappedTailSize = 4096; // copied to a zero padded buffer, the parser reads past the end
+static constexpr std::size_t kGopReorderWindow = 2; // decoded segments in flight per GOP parallel worker
+static constexpr int64_t kGopBufferedFrameBytes = 256LL * 1024 * 1024; // decoded frames waiting for the writer
+static constexpr std::size_t kPacketQueueCapacity = 64; // demuxed packets buffered ahead of the decoder
+static constexpr int kFrameBufferAlign = 64; // at least STRIDE_ALIGN of any libavcodec build (AVX-512)
+static constexpr std::size_t kExtractChunkSize = 1024 * 1024; // elementary stream bytes per fwrite
+static constexpr std::size_t kExtractMaxQueuedChunks = 4; // per output, the demuxer blocks beyond this
+static constexpr int kExtractIOBufferSize = 64 * 1024; // AVIO buffer of the adts/ogg/... muxers
+
+struct ThumbnailOptions {
+    double interval = 0.0; // seconds between thumbnails, 0: every keyframe
+    int width = 160; // thumbnail width, the height follows the aspect ratio
+    int columns = 10; // sprite sheet columns, 0: one image file per thumbnail
+    int lowres = 1; // requested decoder lowres, limited to the decoder's max_lowres
+    bool keyframes_only = true; // false decodes every frame and still captures keyframes, the benchmark baseline
+};
+
+struct DecodeOptions {
+    int thread_count = 0; // 0: one thread per core
+    int thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+    bool mmap_input = true; // false: read through ifstream into a small refill buffer
+    bool annexb_splitter = false; // split access units with AnnexBSplitter instead of av_parser_parse2
+    const char *hash_file = nullptr; // write a CRC32C per frame and a stream digest to this file
+    bool huge_page_buffers = false; // decode into HugePageFramePool instead of the default get_buffer2
+};
+
+struct DecodeStats {
+    int64_t frames = 0;
+    double seconds = 0.0;
+};
+
 thread_local static char error_buffer[AV_ERROR_MAX_STRING_SIZE] = {}; // store FFmpeg error string
 
 static char *ErrorToString(const int error_code) {
@@ -16,371 +103,2152 @@ static char *ErrorToString(const int error_code) {
     return av_make_error_string(error_buffer, AV_ERROR_MAX_STRING_SIZE, error_code);
 }
 
-static std::string GetFileExtension(std::string_view file_name) {
-    size_t pos = file_name.rfind('.');
-    if (pos == std::string::npos) {
-        return "";
+// Position of the first 00 00 01 start code prefix in [p, end), or end. The SSE2 path tests 16 candidate
+// positions per iteration by comparing the input at offsets 0, 1 and 2 against 00, 00 and 01
+static const uint8_t *FindStartCode(const uint8_t *p, const uint8_t *end) {
+#ifdef H264_SCAN_SSE2
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi8(1);
+    for (; end - p >= 18; p += 16) {
+        const __m128i b0 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+        const __m128i b1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 1));
+        const __m128i b2 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 2));
+        const __m128i hit = _mm_and_si128(_mm_and_si128(_mm_cmpeq_epi8(b0, zero), _mm_cmpeq_epi8(b1, zero)),
+                                          _mm_cmpeq_epi8(b2, one));
+        const auto mask = static_cast<unsigned int>(_mm_movemask_epi8(hit));
+        if (mask != 0) {
+            return p + std::countr_zero(mask);
+        }
     }
-    std::string extension(file_name.substr(pos + 1));
-    for (char &c: extension) {
-        c = static_cast<char>(std::tolower(c));
+#endif
+    for (; end - p >= 3; ++p) {
+        if (p[0] == 0 && p[1] == 0 && p[2] == 1) {
+            return p;
+        }
     }
-    return extension;
+    return end;
 }
 
-static bool InnerDecodeVideo(AVCodecContext *codec_ctx, AVPacket *pkt, std::ofstream &ofs) {
-    if (!codec_ctx || !pkt) {
-        return false;
+// Splits an Annex B H.264 byte stream into access units that point into the input, nothing is copied.
+// A new access unit starts at an AUD, SEI, SPS, PPS or prefix NAL, or at a slice with first_mb_in_slice == 0,
+// once the current access unit already holds a slice (ITU-T H.264 7.4.1.2.3)
+class AnnexBSplitter {
+public:
+    AnnexBSplitter(const uint8_t *data, std::size_t size) : end_(data + size) {
+        start_code_ = FindStartCode(data, end_);
+        nal_ = start_code_ == end_ ? end_ : start_code_ + 3;
     }
 
-    int error_code{};
-    bool logged = false;
-
-    // send packet to decoder
-    if ((error_code = avcodec_send_packet(codec_ctx, pkt)) < 0) {
-        if (error_code != AVERROR(EAGAIN) && error_code != AVERROR_EOF) {
-            fprintf(stderr, "Failed to send packet to decoder: %s\n", ErrorToString(error_code));
+    bool Next(const uint8_t **au, std::size_t *au_size) {
+        if (nal_ >= end_) {
             return false;
         }
+        const uint8_t *au_start = start_code_;
+        bool has_slice = false;
+        while (nal_ < end_) {
+            const int type = nal_[0] & 0x1f;
+            const bool is_slice = type == 1 || type == 5;
+            // first_mb_in_slice is ue(v), 0 is coded as a single 1 bit
+            const bool first_slice = is_slice && nal_ + 1 < end_ && (nal_[1] & 0x80);
+            const bool starts_au = type == 6 || type == 7 || type == 8 || type == 9 || (type >= 14 && type <= 18);
+            if (has_slice && (starts_au || first_slice)) {
+                break;
+            }
+            nal_counts_[type]++;
+            has_slice = has_slice || is_slice;
+            start_code_ = FindStartCode(nal_, end_);
+            nal_ = start_code_ == end_ ? end_ : start_code_ + 3;
+        }
+        *au = au_start;
+        *au_size = static_cast<std::size_t>((nal_ >= end_ ? end_ : start_code_) - au_start);
+        au_count_++;
+        return true;
     }
 
-    // allocate AVFrame
-    AVFrame *frame = av_frame_alloc();
-    if (frame == nullptr) {
-        fprintf(stderr, "Failed to allocate AVFrame: av_frame_alloc()\n");
-        return false;
-    }
+    int64_t NalCount(int type) const { return nal_counts_[type & 0x1f]; }
 
-    // receive pixel data from decoder, until EOF
-    // do not need to manage pixel data memory
-    while ((error_code = avcodec_receive_frame(codec_ctx, frame)) == 0) {
-        AVPixelFormat pix_fmt = codec_ctx->pix_fmt;
+    int64_t AccessUnitCount() const { return au_count_; }
 
-        // log 1 time per frame
-        if (!logged) {
-            if (pix_fmt != AV_PIX_FMT_YUV420P) {
-                fprintf(stderr, "Unsupported pixel format: %s\n", av_get_pix_fmt_name(pix_fmt));
-                continue;
+    void PrintNalCounts() const {
+        static const char *names[32] = {
+            "unspecified", "slice", "slice A", "slice B", "slice C", "IDR", "SEI", "SPS", "PPS", "AUD",
+            "end of sequence", "end of stream", "filler", "SPS ext", "prefix", "subset SPS", "DPS",
+        };
+        printf("%lld access units\n", au_count_);
+        for (int type = 0; type < 32; ++type) {
+            if (nal_counts_[type] > 0) {
+                printf("  NAL type %2d %-16s %lld\n", type, names[type] ? names[type] : "reserved",
+                       nal_counts_[type]);
             }
-            printf("Decode %dB AVPacket, %dx%d, pix_fmt=%s\n",
-                   pkt->size, frame->width, frame->height, av_get_pix_fmt_name(pix_fmt));
-            logged = true;
         }
+    }
 
-        if (!ofs) {
-            continue;
-        }
+private:
+    const uint8_t *end_;
+    const uint8_t *start_code_; // 00 00 01 of the NAL unit at nal_
+    const uint8_t *nal_; // NAL header byte of the next unit not yet assigned to an access unit
+    int64_t nal_counts_[32] = {};
+    int64_t au_count_ = 0;
+};
 
-        // write to output file
-        if (pix_fmt == AV_PIX_FMT_YUV420P) {
-            for (int i = 0; (i < frame->height && ofs); ++i) {
-                ofs.write(reinterpret_cast<char *>(frame->data[0] + i * frame->linesize[0]), frame->width);
-            }
-            for (int i = 0; (i < frame->height / 2 && ofs); ++i) {
-                ofs.write(reinterpret_cast<char *>(frame->data[1] + i * frame->linesize[1]), frame->width / 2);
-            }
-            for (int i = 0; (i < frame->height / 2 && ofs); ++i) {
-                ofs.write(reinterpret_cast<char *>(frame->data[2] + i * frame->linesize[2]), frame->width / 2);
+// CRC32C (Castagnoli, the polynomial of the SSE4.2 crc32 instruction), crc is the running state without the
+// initial and final inversion. The table fallback processes 8 bytes per step (slicing-by-8)
+static uint32_t Crc32cTable(uint32_t crc, const uint8_t *data, std::size_t size) {
+    static const auto table = []() -> std::vector<uint32_t> {
+        std::vector<uint32_t> t(8 * 256);
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k) {
+                c = (c >> 1) ^ (0x82F63B78u & (0u - (c & 1)));
             }
+            t[i] = c;
         }
-        if (!ofs) {
-            fprintf(stderr, "Failed to write yuv file, ofstream is broken\n");
+        for (uint32_t i = 0; i < 256; ++i) {
+            for (int slice = 1; slice < 8; ++slice) {
+                t[slice * 256 + i] = (t[(slice - 1) * 256 + i] >> 8) ^ t[t[(slice - 1) * 256 + i] & 0xff];
+            }
         }
+        return t;
+    }();
+    const uint32_t *t = table.data();
+    for (; size >= 8; data += 8, size -= 8) {
+        uint32_t lo;
+        uint32_t hi;
+        std::memcpy(&lo, data, 4); // little endian, like every target of this demo
+        std::memcpy(&hi, data + 4, 4);
+        lo ^= crc;
+        crc = t[7 * 256 + (lo & 0xff)] ^ t[6 * 256 + ((lo >> 8) & 0xff)] ^
+              t[5 * 256 + ((lo >> 16) & 0xff)] ^ t[4 * 256 + (lo >> 24)] ^
+              t[3 * 256 + (hi & 0xff)] ^ t[2 * 256 + ((hi >> 8) & 0xff)] ^
+              t[1 * 256 + ((hi >> 16) & 0xff)] ^ t[hi >> 24];
     }
-
-    av_frame_free(&frame);
-
-    if (error_code != AVERROR(EAGAIN) && error_code != AVERROR_EOF) {
-        fprintf(stderr, "Failed to receive frame from decoder: %s\n", ErrorToString(error_code));
-        return false;
+    for (; size > 0; ++data, --size) {
+        crc = (crc >> 8) ^ t[(crc ^ *data) & 0xff];
     }
+    return crc;
+}
 
-    if (!ofs) {
-        return false;
+#ifdef FRAME_HASH_SSE42
+FRAME_HASH_TARGET_SSE42 static uint32_t Crc32cSse42(uint32_t crc, const uint8_t *data, std::size_t size) {
+    uint64_t crc64 = crc;
+    for (; size >= 8; data += 8, size -= 8) {
+        uint64_t value;
+        std::memcpy(&value, data, 8);
+        crc64 = _mm_crc32_u64(crc64, value);
     }
-
-    return true;
+    crc = static_cast<uint32_t>(crc64);
+    for (; size > 0; ++data, --size) {
+        crc = _mm_crc32_u8(crc, *data);
+    }
+    return crc;
 }
 
-void DecodeVideo(const char *input_file, const char *output_file) {
-    int error_code{};
+static bool HasSse42() {
+#ifdef _MSC_VER
+    int info[4] = {};
+    __cpuid(info, 1);
+    return (info[2] & (1 << 20)) != 0;
+#else
+    return __builtin_cpu_supports("sse4.2");
+#endif
+}
+#endif
 
-    // check file extension
-    AVCodecID codec_id{};
-    std::string file_extension = GetFileExtension(input_file);
-    if (file_extension == "h264") {
-        codec_id = AV_CODEC_ID_H264;
-        printf("Decode H264 video start\n");
-    } else {
-        fprintf(stderr, "Unsupported video format: %s\n", file_extension.c_str());
-        return;
+static uint32_t Crc32c(uint32_t crc, const uint8_t *data, std::size_t size) {
+#ifdef FRAME_HASH_SSE42
+    static const bool sse42 = HasSse42();
+    if (sse42) {
+        return Crc32cSse42(crc, data, size);
     }
+#endif
+    return Crc32cTable(crc, data, size);
+}
 
-    // find AVCodec
-    const AVCodec *codec = avcodec_find_decoder(codec_id);
-    if (codec == nullptr) {
-        fprintf(stderr, "AVCodec not found: %d\n", codec_id);
-        return;
+// CRC32C over the visible bytes of every plane, row by row, so linesize padding never changes the hash
+static uint32_t HashFrame(const AVFrame *frame) {
+    const auto pix_fmt = static_cast<AVPixelFormat>(frame->format);
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(pix_fmt);
+    int row_bytes[4] = {};
+    if (desc == nullptr || av_image_fill_linesizes(row_bytes, pix_fmt, frame->width) < 0) {
+        return 0;
     }
-
-    // open input_file and output_file
-    std::ifstream ifs(input_file, std::ios::in | std::ios::binary);
-    if (!ifs.is_open()) {
-        fprintf(stderr, "Failed to open input file: %s\n", input_file);
-        return;
+    uint32_t crc = 0xFFFFFFFFu;
+    for (int plane = 0; plane < av_pix_fmt_count_planes(pix_fmt); ++plane) {
+        const int shift = plane == 1 || plane == 2 ? desc->log2_chroma_h : 0;
+        const int rows = -((-frame->height) >> shift); // rounded up
+        for (int y = 0; y < rows; ++y) {
+            crc = Crc32c(crc, frame->data[plane] + static_cast<ptrdiff_t>(y) * frame->linesize[plane],
+                         row_bytes[plane]);
+        }
     }
-    std::ofstream ofs(output_file, std::ios::out | std::ios::binary);
-    if (!ofs.is_open()) {
-        fprintf(stderr, "Failed to open output file: %s\n", output_file);
-        return;
+    return ~crc;
+}
+
+// one line per frame: index, size, pixel format and CRC32C, then a stream digest, which is the CRC32C of all
+// frame hashes in order. Two decoder builds are bit-exact when their digests match
+class FrameHashList {
+public:
+    bool Open(const char *file_name) {
+        ofs_.open(file_name, std::ios::out | std::ios::binary);
+        return ofs_.is_open();
     }
 
-    // initialize AVCodecParserContext
-    AVCodecParserContext *parser_ctx = av_parser_init(codec->id);
-    if (parser_ctx == nullptr) {
-        fprintf(stderr, "Failed to init AVCodecParserContext: %d\n", codec->id);
-        return;
+    void Add(const AVFrame *frame) {
+        const uint32_t hash = HashFrame(frame);
+        const uint8_t bytes[4] = {static_cast<uint8_t>(hash), static_cast<uint8_t>(hash >> 8),
+                                  static_cast<uint8_t>(hash >> 16), static_cast<uint8_t>(hash >> 24)};
+        digest_ = Crc32c(digest_, bytes, sizeof(bytes));
+        char line[128] = {};
+        const int length = std::snprintf(line, sizeof(line), "%lld %dx%d %s %08x\n", frames_, frame->width,
+                                         frame->height,
+                                         av_get_pix_fmt_name(static_cast<AVPixelFormat>(frame->format)), hash);
+        ofs_.write(line, length);
+        frames_++;
     }
 
-    // allocate AVCodecContext
-    AVCodecContext *codec_ctx = avcodec_alloc_context3(codec);
-    if (codec_ctx == nullptr) {
-        fprintf(stderr, "Failed to allocate AVCodecContext: %d\n", codec->id);
-        av_parser_close(parser_ctx);
-        return;
+    bool Close() {
+        char line[128] = {};
+        const int length = std::snprintf(line, sizeof(line), "digest %08x frames %lld\n", ~digest_, frames_);
+        ofs_.write(line, length);
+        printf("Stream digest %08x over %lld frames\n", ~digest_, frames_);
+        ofs_.close();
+        return !ofs_.fail();
     }
 
-    // initialize AVCodecContext
-    if ((error_code = avcodec_open2(codec_ctx, codec, nullptr)) < 0) {
-        fprintf(stderr, "Failed to init AVCodecContext: %s\n", ErrorToString(error_code));
-        avcodec_free_context(&codec_ctx);
-        av_parser_close(parser_ctx);
-        return;
+private:
+    std::ofstream ofs_;
+    int64_t frames_ = 0;
+    uint32_t digest_ = 0xFFFFFFFFu;
+};
+
+// Packs decoded frames contiguously with av_image_copy_to_buffer straight into the chunks of a ChunkFileWriter,
+// whose thread writes every full batch with one unbuffered fwrite, so decoding and disk I/O overlap
+class YuvFileWriter : public ChunkFileWriter {
+public:
+    bool Open(const char *file_name) {
+        return ChunkFileWriter::Open(file_name, kOutputBatchBytes, kOutputBatchBuffers);
     }
 
-    // allocate AVPacket
-    AVPacket *pkt = av_packet_alloc();
-    if (pkt == nullptr) {
-        fprintf(stderr, "Failed to allocate AVPacket: av_packet_alloc()\n");
-        avcodec_free_context(&codec_ctx);
-        av_parser_close(parser_ctx);
-        return;
+    bool WriteFrame(const AVFrame *frame) {
+        const auto pix_fmt = static_cast<AVPixelFormat>(frame->format);
+        const int frame_size = av_image_get_buffer_size(pix_fmt, frame->width, frame->height, 1);
+        uint8_t *dst = frame_size < 0 ? nullptr : Reserve(static_cast<std::size_t>(frame_size));
+        if (dst == nullptr) {
+            return false;
+        }
+        const int copied = av_image_copy_to_buffer(dst, frame_size, frame->data, frame->linesize, pix_fmt,
+                                                   frame->width, frame->height, 1);
+        return copied >= 0 && Commit(static_cast<std::size_t>(copied));
     }
+};
 
-    // allocate input buffer
-    const std::size_t input_buffer_size = kInputVideoBufferSize + AV_INPUT_BUFFER_PADDING_SIZE;
-    auto input_buffer = std::make_unique<uint8_t[]>(input_buffer_size); // std=c++17
-    std::memset(input_buffer.get(), 0, input_buffer_size);
-    uint8_t *data = input_buffer.get();
+// Bounded FIFO of demuxed packets between the demux thread and the decoding thread. Push blocks while the queue is
+// full, so the demuxer stays at most kPacketQueueCapacity packets ahead. Consumed AVPacket shells are recycled
+class PacketQueue {
+public:
+    PacketQueue() = default;
 
-    size_t data_size{};
-    while (true) {
-        // refill input buffer
-        if (data_size < kInputVideoBufferRefillThreshold && !ifs.eof()) {
-            if (data_size > 0) {
-                std::memcpy(input_buffer.get(), data, data_size);
-            }
-            data = input_buffer.get();
-            std::size_t bytes_to_read = kInputVideoBufferRefillThreshold - data_size;
-            if (!ifs.read(reinterpret_cast<char *>(data) + data_size, static_cast<std::streamsize>(bytes_to_read))) {
-                if (!ifs.eof()) {
-                    fprintf(stderr, "Failed to read input file: %s\n", input_file);
-                    break;
-                }
-                fprintf(stderr, "End of ifstream: %s\n", input_file);
-            }
-            data_size += ifs.gcount();
-        }
+    PacketQueue(const PacketQueue &) = delete;
 
-        // parse an video frame. if success, pkt->data == data && pkt->size == parsed
-        int parsed = av_parser_parse2(parser_ctx, codec_ctx,
-                                      &pkt->data, &pkt->size,
-                                      data, static_cast<int>(data_size),
-                                      AV_NOPTS_VALUE, AV_NOPTS_VALUE, 0);
-        if (parsed < 0) {
-            fprintf(stderr, "Failed to parse video: %s\n", ErrorToString(parsed));
-            break;
+    PacketQueue &operator=(const PacketQueue &) = delete;
+
+    ~PacketQueue() {
+        for (AVPacket *queued: queue_) {
+            av_packet_free(&queued);
         }
-        data += parsed;
-        data_size -= parsed;
+        for (AVPacket *shell: free_) {
+            av_packet_free(&shell);
+        }
+    }
 
-        // decode video and write to output_file
-        if (pkt->size > 0) {
-            InnerDecodeVideo(codec_ctx, pkt, ofs);
+    // takes over the reference of pkt, returns false if the consumer aborted
+    bool Push(AVPacket *pkt) {
+        std::unique_lock lock(mutex_);
+        cv_.wait(lock, [this]() -> bool { return queue_.size() < kPacketQueueCapacity || aborted_; });
+        if (aborted_) {
+            av_packet_unref(pkt);
+            return false;
+        }
+        AVPacket *queued = nullptr;
+        if (!free_.empty()) {
+            queued = free_.back();
+            free_.pop_back();
+        } else if ((queued = av_packet_alloc()) == nullptr) {
+            av_packet_unref(pkt);
+            return false;
         }
+        av_packet_move_ref(queued, pkt);
+        queue_.push_back(queued);
+        lock.unlock();
+        cv_.notify_all();
+        return true;
+    }
 
-        // if decode end, drain the decoder
-        if (data_size == 0 && ifs.eof()) {
-            pkt->data = nullptr;
-            pkt->size = 0;
-            InnerDecodeVideo(codec_ctx, pkt, ofs);
-            break;
+    // moves the next packet into pkt, returns false once the producer finished and the queue is empty
+    bool Pop(AVPacket *pkt) {
+        const auto start = std::chrono::steady_clock::now();
+        std::unique_lock lock(mutex_);
+        cv_.wait(lock, [this]() -> bool { return !queue_.empty() || finished_ || aborted_; });
+        wait_seconds_ += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (queue_.empty() || aborted_) {
+            return false;
         }
+        AVPacket *queued = queue_.front();
+        queue_.pop_front();
+        av_packet_move_ref(pkt, queued);
+        free_.push_back(queued);
+        lock.unlock();
+        cv_.notify_all();
+        return true;
     }
 
-    printf("Decode H264 video end\n");
+    // called by the producer after its last packet
+    void Finish() {
+        {
+            std::lock_guard lock(mutex_);
+            finished_ = true;
+        }
+        cv_.notify_all();
+    }
 
-    av_packet_free(&pkt);
-    avcodec_free_context(&codec_ctx);
-    av_parser_close(parser_ctx);
-}
+    // called by the consumer to stop a producer blocked in Push
+    void Abort() {
+        {
+            std::lock_guard lock(mutex_);
+            aborted_ = true;
+        }
+        cv_.notify_all();
+    }
 
-int main(int argc, char *argv[]) {
-    // ffmpeg -i yuv420p_640x360_25fps.mp4 -an -c:v copy yuv420p_640x360_25fps.h264
-    // ffplay -pixel_format yuv420p -video_size 640x360 -framerate 25 yuv420p_640x360_25fps.yuv
-    DecodeVideo("../../../../yuv420p_640x360_25fps.h264", "../../../../yuv420p_640x360_25fps.yuv");
-}
-#endif
+    // time the consumer spent waiting for packets, i.e. demuxing was the bottleneck
+    double WaitSeconds() const { return wait_seconds_; }
 
-#if 0
-extern "C" {
-#include <libavcodec/bsf.h>
-#include <libavcodec/avcodec.h>
-#include <libavformat/avformat.h>
-}
+private:
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<AVPacket *> queue_;
+    std::vector<AVPacket *> free_;
+    bool finished_ = false;
+    bool aborted_ = false;
+    double wait_seconds_ = 0.0; // touched by the consumer only
+};
 
-#include <fstream>
+// Opt-in get_buffer2: frame planes come from an AVBufferPool whose buffers are mapped on 2 MB huge pages, so the
+// reference frames of a 4K/8K stream span a few dozen TLB entries instead of thousands of 4 KB pages.
+// With frame threading get_buffer2 runs on the decoder's threads, the pool is recreated under mutex_ when the
+// frame size or pixel format changes
+class HugePageFramePool {
+public:
+    HugePageFramePool() = default;
 
-thread_local static char error_buffer[AV_ERROR_MAX_STRING_SIZE] = {};
+    HugePageFramePool(const HugePageFramePool &) = delete;
 
-static char *ErrorToString(const int error_code) {
-    std::memset(error_buffer, 0, AV_ERROR_MAX_STRING_SIZE);
-    return av_make_error_string(error_buffer, AV_ERROR_MAX_STRING_SIZE, error_code);
-}
+    HugePageFramePool &operator=(const HugePageFramePool &) = delete;
 
-static bool InnerExtractVideoStreamAnnexB(AVFormatContext *fmt_ctx, AVPacket *pkt, std::ofstream &ofs) {
-    if (!fmt_ctx || !pkt || !ofs) {
-        return false;
-    }
+    ~HugePageFramePool() { av_buffer_pool_uninit(&pool_); } // buffers still referenced are freed when they return
 
-    int error_code{};
-    int h264_stream_index = -1;
-
-    // find h264 video stream
-    AVStream *stream = nullptr;
-    AVCodecParameters *codec_params = nullptr;
-    for (int i = 0; i < fmt_ctx->nb_streams; i++) {
-        stream = fmt_ctx->streams[i];
-        codec_params = stream->codecpar;
-        if (codec_params->codec_type == AVMEDIA_TYPE_VIDEO) {
-            if (codec_params->codec_id == AV_CODEC_ID_H264) {
-                h264_stream_index = i;
-                break;
-            }
+    // call before avcodec_open2, the pool must outlive codec_ctx
+    void Attach(AVCodecContext *codec_ctx) {
+        if (!(codec_ctx->codec->capabilities & AV_CODEC_CAP_DR1)) {
+            printf("%s does not support custom buffers, using the default allocator\n", codec_ctx->codec->name);
+            return;
         }
-    }
-    if (h264_stream_index < 0) {
-        fprintf(stderr, "Could not find H264 video stream\n");
-        return false;
+        codec_ctx->opaque = this;
+        codec_ctx->get_buffer2 = GetBuffer2;
     }
 
-    // allocate bitstream filter context
-    const AVBitStreamFilter *bs_filter = av_bsf_get_by_name("h264_mp4toannexb");
-    if (bs_filter == nullptr) {
-        fprintf(stderr, "Could not find h264_mp4toannexb bitstream filter\n");
-        return false;
-    }
-    AVBSFContext *bsf_ctx = nullptr;
-    if ((error_code = av_bsf_alloc(bs_filter, &bsf_ctx)) < 0) {
-        fprintf(stderr, "Could not allocate bitstream filter context: %s\n", ErrorToString(error_code));
-        return false;
+    void PrintStats() const {
+        printf("Huge page frame pool: %lld buffers of %.1f MB, %lld on explicit huge pages, the rest advised for THP\n",
+               mappings_.load(), buffer_size_ / 1e6, huge_tlb_mappings_.load());
     }
 
-    // initialize bitstream filter context
-    if ((error_code = avcodec_parameters_copy(bsf_ctx->par_in, codec_params)) < 0) {
-        fprintf(stderr, "Could not copy codec parameters: %s\n", ErrorToString(error_code));
-        av_bsf_free(&bsf_ctx);
-        return false;
-    }
-    if ((error_code = av_bsf_init(bsf_ctx)) < 0) {
-        fprintf(stderr, "Could not initialize bitstream filter context: %s\n", ErrorToString(error_code));
-        av_bsf_free(&bsf_ctx);
-        return false;
-    }
+private:
+    static int GetBuffer2(AVCodecContext *codec_ctx, AVFrame *frame, int flags) {
+        auto *pool = static_cast<HugePageFramePool *>(codec_ctx->opaque);
+        const auto pix_fmt = static_cast<AVPixelFormat>(frame->format);
+        const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(pix_fmt);
+        if (desc == nullptr || (desc->flags & (AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_PAL))) {
+            return avcodec_default_get_buffer2(codec_ctx, frame, flags);
+        }
 
-    while (true) {
-        if ((error_code = av_read_frame(fmt_ctx, pkt)) < 0) {
-            if (error_code != AVERROR_EOF) {
-                fprintf(stderr, "Could not read frame: %s\n", ErrorToString(error_code));
-            } else {
-                printf("End of input file\n");
-            }
-            break;
+        std::lock_guard lock(pool->mutex_);
+        if ((pix_fmt != pool->format_ || frame->width != pool->width_ || frame->height != pool->height_) &&
+            !pool->Init(codec_ctx, pix_fmt, frame->width, frame->height)) {
+            return AVERROR(EINVAL);
         }
-        if (pkt->stream_index != h264_stream_index) {
-            av_packet_unref(pkt);
-            continue;
+        AVBufferRef *buf = av_buffer_pool_get(pool->pool_);
+        if (buf == nullptr) {
+            return AVERROR(ENOMEM);
         }
-
-        // send packet to bitstream filter
-        if ((error_code = av_bsf_send_packet(bsf_ctx, pkt)) < 0) {
-            fprintf(stderr, "Could not send packet to bitstream filter: %s\n", ErrorToString(error_code));
-            av_packet_unref(pkt);
-            continue;
+        frame->buf[0] = buf;
+        for (int i = 0; i < 4; ++i) {
+            frame->data[i] = pool->linesize_[i] ? buf->data + pool->offset_[i] : nullptr;
+            frame->linesize[i] = pool->linesize_[i];
         }
-        av_packet_unref(pkt);
+        frame->extended_data = frame->data;
+        return 0;
+    }
 
-        // receive packet from bitstream filter
-        while ((error_code = av_bsf_receive_packet(bsf_ctx, pkt)) == 0) {
-            if (!ofs.write(reinterpret_cast<const char *>(pkt->data), pkt->size)) {
-                fprintf(stderr, "Could not write ha64 file: ofstream is broken\n");
-                av_packet_unref(pkt);
-                av_bsf_free(&bsf_ctx);
-                return false;
+    // plane layout like libavcodec's own pool: dimensions padded by avcodec_align_dimensions2 for the codec's
+    // edge emulation, linesizes aligned, 16 + kFrameBufferAlign - 1 spare bytes after every plane for overreads
+    bool Init(AVCodecContext *codec_ctx, AVPixelFormat pix_fmt, int width, int height) {
+        av_buffer_pool_uninit(&pool_);
+        format_ = AV_PIX_FMT_NONE;
+        int aligned_width = width;
+        int aligned_height = height;
+        int linesize_align[AV_NUM_DATA_POINTERS] = {};
+        avcodec_align_dimensions2(codec_ctx, &aligned_width, &aligned_height, linesize_align);
+        int linesize[4] = {};
+        if (av_image_fill_linesizes(linesize, pix_fmt, aligned_width) < 0) {
+            return false;
+        }
+        ptrdiff_t aligned_linesize[4] = {};
+        for (int i = 0; i < 4; ++i) {
+            const int align = std::max(linesize_align[i], kFrameBufferAlign);
+            linesize_[i] = static_cast<int>(AlignUp(linesize[i], align));
+            aligned_linesize[i] = linesize_[i];
+        }
+        std::size_t plane_size[4] = {};
+        if (av_image_fill_plane_sizes(plane_size, pix_fmt, aligned_height, aligned_linesize) < 0) {
+            return false;
+        }
+        buffer_size_ = 0;
+        for (int i = 0; i < 4; ++i) {
+            offset_[i] = buffer_size_;
+            if (plane_size[i] > 0) {
+                buffer_size_ = AlignUp(buffer_size_ + plane_size[i] + 16 + kFrameBufferAlign - 1, kFrameBufferAlign);
             }
-            printf("Extracted %ld bytes of H264 data\n", pkt->size);
-            av_packet_unref(pkt);
         }
-        if (error_code != AVERROR(EAGAIN)) {
-            av_packet_unref(pkt);
-            fprintf(stderr, "Could not receive packet from bitstream filter: %s\n", ErrorToString(error_code));
+        buffer_size_ = AlignUp(buffer_size_, kHugePageSize); // the tail of the last huge page is usable anyway
+
+        if ((pool_ = av_buffer_pool_init2(buffer_size_, this, Alloc, nullptr)) == nullptr) {
+            return false;
         }
+        format_ = pix_fmt;
+        width_ = width;
+        height_ = height;
+        return true;
     }
 
-    av_bsf_free(&bsf_ctx);
-    return true;
-}
+    // one pool buffer on huge pages, counted so the benchmark can tell explicit huge pages from THP
+    static AVBufferRef *Alloc(void *opaque, std::size_t size) {
+        auto *pool = static_cast<HugePageFramePool *>(opaque);
+        bool huge_tlb = false;
+        AVBufferRef *buf = AllocHugePageBuffer(size, &huge_tlb);
+        if (buf == nullptr) {
+            return nullptr;
+        }
+        pool->mappings_++;
+        pool->huge_tlb_mappings_ += huge_tlb ? 1 : 0;
+        return buf;
+    }
 
-void ExtractVideoStreamAnnexB(const char *input_file, const char *output_file) {
-    int error_code{};
+    std::mutex mutex_;
+    AVBufferPool *pool_ = nullptr;
+    AVPixelFormat format_ = AV_PIX_FMT_NONE;
+    int width_ = 0;
+    int height_ = 0;
+    int linesize_[4] = {};
+    std::size_t offset_[4] = {};
+    std::size_t buffer_size_ = 0;
+    std::atomic<int64_t> mappings_{0};
+    std::atomic<int64_t> huge_tlb_mappings_{0};
+};
 
-    // open input_file
-    AVFormatContext *fmt_ctx = nullptr;
-    if ((error_code = avformat_open_input(&fmt_ctx, input_file, nullptr, nullptr)) < 0) {
-        fprintf(stderr, "Could not open source file '%s': %s\n", input_file, ErrorToString(error_code));
-        return;
-    }
-    if ((error_code = avformat_find_stream_info(fmt_ctx, nullptr)) < 0) {
-        fprintf(stderr, "Could not find stream information: %s\n", ErrorToString(error_code));
-        avformat_close_input(&fmt_ctx);
-        return;
-    }
+// Counts a hardware event of this process and of the threads it creates afterwards, e.g. the decoder's worker
+// threads (perf_event_open, Linux only). Counts of a thread are added when it exits, so read after the decoder
+// is freed. Value returns -1 when the event is unavailable
+class PerfCounter {
+public:
+    PerfCounter() = default;
 
-    // open output_file
-    std::ofstream ofs(output_file, std::ios::out | std::ios::binary);
-    if (!ofs.is_open()) {
-        fprintf(stderr, "Could not open output file '%s'\n", output_file);
-        avformat_close_input(&fmt_ctx);
-        return;
+    PerfCounter(const PerfCounter &) = delete;
+
+    PerfCounter &operator=(const PerfCounter &) = delete;
+
+    ~PerfCounter() {
+#ifdef __linux__
+        if (fd_ >= 0) {
+            close(fd_);
+        }
+#endif
+    }
+
+    bool Open(uint32_t type, uint64_t config) {
+#ifdef __linux__
+        perf_event_attr attr{};
+        attr.size = sizeof(attr);
+        attr.type = type;
+        attr.config = config;
+        attr.disabled = 1;
+        attr.inherit = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd_ = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+        if (fd_ >= 0) {
+            ioctl(fd_, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd_, PERF_EVENT_IOC_ENABLE, 0);
+        }
+        return fd_ >= 0;
+#else
+        (void) type;
+        (void) config;
+        return false;
+#endif
+    }
+
+    int64_t Value() const {
+#ifdef __linux__
+        uint64_t value = 0;
+        if (fd_ >= 0 && read(fd_, &value, sizeof(value)) == sizeof(value)) {
+            return static_cast<int64_t>(value);
+        }
+#endif
+        return -1;
+    }
+
+private:
+    int fd_ = -1;
+};
+
+static std::string GetFileExtension(std::string_view file_name) {
+    size_t pos = file_name.rfind('.');
+    if (pos == std::string::npos) {
+        return "";
+    }
+    std::string extension(file_name.substr(pos + 1));
+    for (char &c: extension) {
+        c = static_cast<char>(std::tolower(c));
+    }
+    return extension;
+}
+
+// where decoded frames go, both may be nullptr to only decode
+struct DecodeOutput {
+    YuvFileWriter *writer = nullptr;
+    FrameHashList *hashes = nullptr;
+};
+
+// frame is reused for every packet of the stream
+static bool InnerDecodeVideo(AVCodecContext *codec_ctx, AVPacket *pkt, AVFrame *frame, const DecodeOutput &output,
+                             DecodeStats &stats) {
+    if (!codec_ctx || !pkt || !frame) {
+        return false;
+    }
+
+    int error_code{};
+    bool logged = false;
+    bool written = true;
+
+    // send packet to decoder
+    if ((error_code = avcodec_send_packet(codec_ctx, pkt)) < 0) {
+        if (error_code != AVERROR(EAGAIN) && error_code != AVERROR_EOF) {
+            fprintf(stderr, "Failed to send packet to decoder: %s\n", ErrorToString(error_code));
+            return false;
+        }
+    }
+
+    // receive pixel data from decoder, until EOF
+    // avcodec_receive_frame unrefs the frame before filling it, the pixel data is owned by the decoder
+    while ((error_code = avcodec_receive_frame(codec_ctx, frame)) == 0) {
+        const auto pix_fmt = static_cast<AVPixelFormat>(frame->format);
+        stats.frames++;
+        if (output.hashes) {
+            output.hashes->Add(frame);
+        }
+
+        // log 1 time per frame
+        if (!logged) {
+            printf("Decode %dB AVPacket, %dx%d, pix_fmt=%s\n",
+                   pkt->size, frame->width, frame->height, av_get_pix_fmt_name(pix_fmt));
+            logged = true;
+        }
+
+        if (!output.writer || !written) {
+            continue;
+        }
+
+        // pack the planes of any pixel format without linesize padding into the current output batch, the raw
+        // file plays with ffplay -pix_fmt set to the logged format
+        if (!(written = output.writer->WriteFrame(frame))) {
+            fprintf(stderr, "Failed to write yuv file\n");
+        }
+    }
+    av_frame_unref(frame);
+
+    if (error_code != AVERROR(EAGAIN) && error_code != AVERROR_EOF) {
+        fprintf(stderr, "Failed to receive frame from decoder: %s\n", ErrorToString(error_code));
+        return false;
+    }
+
+    if (!written) {
+        return false;
+    }
+
+    return true;
+}
+
+// Feed one contiguous span to the parser until all of it is consumed and decode every complete frame. With
+// flush, an empty span is passed at the end so the parser returns the frame it still holds
+static bool ParseAndDecodeSpan(AVCodecParserContext *parser_ctx, AVCodecContext *codec_ctx, AVPacket *pkt,
+                               AVFrame *frame, const DecodeOutput &output, DecodeStats &stats,
+                               const uint8_t *data, std::size_t data_size, bool flush) {
+    while (data_size > 0 || flush) {
+        // with data_size == 0 this is the flush call
+        const int span = static_cast<int>(std::min<std::size_t>(data_size, std::numeric_limits<int>::max()));
+        int parsed = av_parser_parse2(parser_ctx, codec_ctx,
+                                      &pkt->data, &pkt->size,
+                                      data, span,
+                                      AV_NOPTS_VALUE, AV_NOPTS_VALUE, 0);
+        if (parsed < 0) {
+            fprintf(stderr, "Failed to parse video: %s\n", ErrorToString(parsed));
+            return false;
+        }
+        data += parsed;
+        data_size -= parsed;
+        if (pkt->size > 0) {
+            InnerDecodeVideo(codec_ctx, pkt, frame, output, stats);
+        }
+        if (span == 0) {
+            break;
+        }
+    }
+    return true;
+}
+
+// Parse the mapped file in place, no refill copies and no read syscalls. Only the last kMappedTailSize bytes
+// are copied, to give the parser the AV_INPUT_BUFFER_PADDING_SIZE zero bytes it may read past the end
+static bool DecodeMappedVideo(const MappedFile &input, AVCodecParserContext *parser_ctx, AVCodecContext *codec_ctx,
+                              AVPacket *pkt, AVFrame *frame, const DecodeOutput &output, DecodeStats &stats) {
+    const std::size_t tail_size = std::min(input.Size(), kMappedTailSize);
+    const std::size_t body_size = input.Size() - tail_size;
+    auto tail = std::make_unique<uint8_t[]>(tail_size + AV_INPUT_BUFFER_PADDING_SIZE);
+    std::memcpy(tail.get(), input.Data() + body_size, tail_size);
+    std::memset(tail.get() + tail_size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+
+    // reads past the end of the body land in the tail, which is still mapped
+    if (!ParseAndDecodeSpan(parser_ctx, codec_ctx, pkt, frame, output, stats, input.Data(), body_size, false) ||
+        !ParseAndDecodeSpan(parser_ctx, codec_ctx, pkt, frame, output, stats, tail.get(), tail_size, true)) {
+        return false;
+    }
+
+    // drain the decoder
+    pkt->data = nullptr;
+    pkt->size = 0;
+    InnerDecodeVideo(codec_ctx, pkt, frame, output, stats);
+    return true;
+}
+
+static void NoFree(void *, uint8_t *) {}
+
+// Decode access units found by AnnexBSplitter directly, the decoder gets every access unit as one packet. Packets
+// point straight into the mapping and reference it through one read-only AVBufferRef, so avcodec_send_packet does
+// not copy them either. Only an access unit that ends within AV_INPUT_BUFFER_PADDING_SIZE of the end of the file
+// is copied into a padded buffer
+static bool DecodeAnnexBVideo(const MappedFile &input, AVCodecContext *codec_ctx, AVPacket *pkt, AVFrame *frame,
+                              const DecodeOutput &output, DecodeStats &stats) {
+    AVBufferRef *mapping_ref = av_buffer_create(const_cast<uint8_t *>(input.Data()), input.Size(), NoFree, nullptr,
+                                                AV_BUFFER_FLAG_READONLY);
+    if (mapping_ref == nullptr) {
+        fprintf(stderr, "Failed to allocate AVBufferRef\n");
+        return false;
+    }
+    std::vector<uint8_t> tail;
+
+    bool success = true;
+    AnnexBSplitter splitter(input.Data(), input.Size());
+    const uint8_t *au = nullptr;
+    std::size_t au_size = 0;
+    while (splitter.Next(&au, &au_size)) {
+        const auto offset = static_cast<std::size_t>(au - input.Data());
+        if (offset + au_size + AV_INPUT_BUFFER_PADDING_SIZE <= input.Size()) {
+            if ((pkt->buf = av_buffer_ref(mapping_ref)) == nullptr) {
+                success = false;
+                break;
+            }
+            pkt->data = const_cast<uint8_t *>(au);
+        } else {
+            tail.assign(au, au + au_size);
+            tail.resize(au_size + AV_INPUT_BUFFER_PADDING_SIZE, 0);
+            pkt->data = tail.data();
+        }
+        pkt->size = static_cast<int>(au_size);
+        InnerDecodeVideo(codec_ctx, pkt, frame, output, stats);
+        av_packet_unref(pkt);
+    }
+
+    // drain the decoder
+    pkt->data = nullptr;
+    pkt->size = 0;
+    InnerDecodeVideo(codec_ctx, pkt, frame, output, stats);
+    av_buffer_unref(&mapping_ref);
+    splitter.PrintNalCounts();
+    return success;
+}
+
+// send pkt (or nullptr to flush when flush is true) through the bitstream filter and queue every filtered packet
+static bool FilterPacket(AVBSFContext *bsf_ctx, AVPacket *pkt, bool flush, PacketQueue &queue) {
+    int error_code{};
+    if ((error_code = av_bsf_send_packet(bsf_ctx, flush ? nullptr : pkt)) < 0) {
+        fprintf(stderr, "Could not send packet to bitstream filter: %s\n", ErrorToString(error_code));
+        av_packet_unref(pkt);
+        return false;
+    }
+    while ((error_code = av_bsf_receive_packet(bsf_ctx, pkt)) == 0) {
+        if (!queue.Push(pkt)) {
+            return false;
+        }
+    }
+    if (error_code != AVERROR(EAGAIN) && error_code != AVERROR_EOF) {
+        fprintf(stderr, "Could not receive packet from bitstream filter: %s\n", ErrorToString(error_code));
+        return false;
+    }
+    return true;
+}
+
+// body of the demux thread: read the packets of stream_index, pass them through bsf_ctx if it is not nullptr,
+// and queue them for the decoder. Always finishes the queue, so the decoder never waits forever
+static bool DemuxPackets(AVFormatContext *fmt_ctx, int stream_index, AVBSFContext *bsf_ctx, PacketQueue &queue) {
+    AVPacket *pkt = av_packet_alloc();
+    if (pkt == nullptr) {
+        fprintf(stderr, "Could not allocate AVPacket: av_packet_alloc()\n");
+        queue.Finish();
+        return false;
+    }
+
+    int error_code{};
+    bool success = true;
+    while (success) {
+        if ((error_code = av_read_frame(fmt_ctx, pkt)) < 0) {
+            if (error_code != AVERROR_EOF) {
+                fprintf(stderr, "Could not read frame: %s\n", ErrorToString(error_code));
+                success = false;
+            }
+            break;
+        }
+        if (pkt->stream_index != stream_index) {
+            av_packet_unref(pkt);
+            continue;
+        }
+        success = bsf_ctx ? FilterPacket(bsf_ctx, pkt, false, queue) : queue.Push(pkt);
+    }
+    if (success && bsf_ctx) {
+        success = FilterPacket(bsf_ctx, pkt, true, queue);
+    }
+
+    av_packet_free(&pkt);
+    queue.Finish();
+    return success;
+}
+
+// decode the best video stream of any container libavformat can open (mp4, mkv, ts, ...), with any decoder
+// avcodec_find_decoder knows. A demux thread runs av_read_frame and, for H.264/HEVC, the mp4toannexb filter,
+// this thread only decodes, so demuxing and decoding overlap
+static bool DecodeContainerVideo(const char *input_file, const char *output_file, const DecodeOptions &options,
+                                 DecodeStats &stats) {
+    int error_code{};
+
+    // open input_file
+    AVFormatContext *fmt_ctx = nullptr;
+    if ((error_code = avformat_open_input(&fmt_ctx, input_file, nullptr, nullptr)) < 0) {
+        fprintf(stderr, "Could not open source file '%s': %s\n", input_file, ErrorToString(error_code));
+        return false;
+    }
+    if ((error_code = avformat_find_stream_info(fmt_ctx, nullptr)) < 0) {
+        fprintf(stderr, "Could not find stream information: %s\n", ErrorToString(error_code));
+        avformat_close_input(&fmt_ctx);
+        return false;
+    }
+
+    // find the video stream and its decoder
+    const AVCodec *codec = nullptr;
+    const int stream_index = av_find_best_stream(fmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, &codec, 0);
+    if (stream_index < 0 || codec == nullptr) {
+        fprintf(stderr, "Could not find a decodable video stream: %s\n", ErrorToString(stream_index));
+        avformat_close_input(&fmt_ctx);
+        return false;
+    }
+    AVStream *stream = fmt_ctx->streams[stream_index];
+    printf("Decode %s video start\n", codec->name);
+
+    // H.264/HEVC in mp4/mkv are length prefixed, convert them to Annex B like the raw .h264 input.
+    // The filter passes streams that already are Annex B (ts) through unchanged
+    const char *bsf_name = stream->codecpar->codec_id == AV_CODEC_ID_H264   ? "h264_mp4toannexb"
+                           : stream->codecpar->codec_id == AV_CODEC_ID_HEVC ? "hevc_mp4toannexb"
+                                                                            : nullptr;
+    AVBSFContext *bsf_ctx = nullptr;
+    if (bsf_name) {
+        const AVBitStreamFilter *bs_filter = av_bsf_get_by_name(bsf_name);
+        if (bs_filter == nullptr) {
+            fprintf(stderr, "Could not find %s bitstream filter\n", bsf_name);
+            avformat_close_input(&fmt_ctx);
+            return false;
+        }
+        if ((error_code = av_bsf_alloc(bs_filter, &bsf_ctx)) < 0) {
+            fprintf(stderr, "Could not allocate bitstream filter context: %s\n", ErrorToString(error_code));
+            avformat_close_input(&fmt_ctx);
+            return false;
+        }
+        bsf_ctx->time_base_in = stream->time_base;
+        if ((error_code = avcodec_parameters_copy(bsf_ctx->par_in, stream->codecpar)) < 0 ||
+            (error_code = av_bsf_init(bsf_ctx)) < 0) {
+            fprintf(stderr, "Could not initialize bitstream filter context: %s\n", ErrorToString(error_code));
+            av_bsf_free(&bsf_ctx);
+            avformat_close_input(&fmt_ctx);
+            return false;
+        }
+    }
+
+    // allocate and initialize AVCodecContext, with the extradata the decoder will actually receive
+    AVCodecContext *codec_ctx = avcodec_alloc_context3(codec);
+    if (codec_ctx == nullptr) {
+        fprintf(stderr, "Failed to allocate AVCodecContext: %d\n", codec->id);
+        av_bsf_free(&bsf_ctx);
+        avformat_close_input(&fmt_ctx);
+        return false;
+    }
+    if ((error_code = avcodec_parameters_to_context(codec_ctx, bsf_ctx ? bsf_ctx->par_out : stream->codecpar)) < 0) {
+        fprintf(stderr, "Failed to copy codec parameters: %s\n", ErrorToString(error_code));
+        avcodec_free_context(&codec_ctx);
+        av_bsf_free(&bsf_ctx);
+        avformat_close_input(&fmt_ctx);
+        return false;
+    }
+    codec_ctx->pkt_timebase = stream->time_base;
+    codec_ctx->thread_count = options.thread_count > 0
+                                  ? options.thread_count
+                                  : std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+    codec_ctx->thread_type = options.thread_type;
+    HugePageFramePool frame_pool;
+    if (options.huge_page_buffers) {
+        frame_pool.Attach(codec_ctx);
+    }
+    if ((error_code = avcodec_open2(codec_ctx, codec, nullptr)) < 0) {
+        fprintf(stderr, "Failed to init AVCodecContext: %s\n", ErrorToString(error_code));
+        avcodec_free_context(&codec_ctx);
+        av_bsf_free(&bsf_ctx);
+        avformat_close_input(&fmt_ctx);
+        return false;
+    }
+
+    // open outputs, allocate AVPacket and AVFrame once for the whole stream
+    YuvFileWriter writer;
+    FrameHashList hashes;
+    AVPacket *pkt = av_packet_alloc();
+    AVFrame *frame = av_frame_alloc();
+    bool success = true;
+    if (output_file && !writer.Open(output_file)) {
+        fprintf(stderr, "Failed to open output file: %s\n", output_file);
+        success = false;
+    } else if (options.hash_file && !hashes.Open(options.hash_file)) {
+        fprintf(stderr, "Failed to open hash file: %s\n", options.hash_file);
+        success = false;
+    } else if (pkt == nullptr || frame == nullptr) {
+        fprintf(stderr, "Failed to allocate AVPacket or AVFrame\n");
+        success = false;
+    }
+    if (!success) {
+        av_frame_free(&frame);
+        av_packet_free(&pkt);
+        avcodec_free_context(&codec_ctx);
+        av_bsf_free(&bsf_ctx);
+        avformat_close_input(&fmt_ctx);
+        return false;
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    const DecodeOutput output{output_file ? &writer : nullptr, options.hash_file ? &hashes : nullptr};
+    PacketQueue queue;
+    bool demux_success = true;
+    std::thread demux_thread([&]() -> void {
+        demux_success = DemuxPackets(fmt_ctx, stream_index, bsf_ctx, queue);
+    });
+    while (queue.Pop(pkt)) {
+        InnerDecodeVideo(codec_ctx, pkt, frame, output, stats);
+        av_packet_unref(pkt);
+    }
+
+    // drain the decoder
+    pkt->data = nullptr;
+    pkt->size = 0;
+    InnerDecodeVideo(codec_ctx, pkt, frame, output, stats);
+    queue.Abort();
+    demux_thread.join();
+    success = demux_success;
+
+    if (output.writer && !writer.Close()) {
+        fprintf(stderr, "Failed to write yuv file: %s\n", output_file);
+        success = false;
+    }
+    if (output.hashes && !hashes.Close()) {
+        fprintf(stderr, "Failed to write hash file: %s\n", options.hash_file);
+        success = false;
+    }
+    stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf("Decode %s video end: %lld frames in %.3f s (%.1f fps), %d threads, decoder waited %.3f s for packets\n",
+           codec->name, stats.frames, stats.seconds, stats.frames / stats.seconds, codec_ctx->thread_count,
+           queue.WaitSeconds());
+    if (output.writer) {
+        printf("Wrote %.1f MB in %lld writes (%.1f MB/s), decoder waited %.3f s for the disk\n",
+               writer.BytesWritten() / 1e6, writer.Writes(), writer.BytesWritten() / 1e6 / stats.seconds,
+               writer.WaitSeconds());
+    }
+    if (options.huge_page_buffers) {
+        frame_pool.PrintStats();
+    }
+
+    av_frame_free(&frame);
+    av_packet_free(&pkt);
+    avcodec_free_context(&codec_ctx);
+    av_bsf_free(&bsf_ctx);
+    avformat_close_input(&fmt_ctx);
+    return success;
+}
+
+// output_file may be nullptr to only decode, e.g. for benchmarking
+bool DecodeVideo(const char *input_file, const char *output_file, const DecodeOptions &options, DecodeStats &stats) {
+    int error_code{};
+
+    // check file extension
+    AVCodecID codec_id{};
+    std::string file_extension = GetFileExtension(input_file);
+    if (file_extension == "h264") {
+        codec_id = AV_CODEC_ID_H264;
+        printf("Decode H264 video start\n");
+    } else {
+        // mp4, mkv, ts, ... go through libavformat
+        return DecodeContainerVideo(input_file, output_file, options, stats);
+    }
+
+    // find AVCodec
+    const AVCodec *codec = avcodec_find_decoder(codec_id);
+    if (codec == nullptr) {
+        fprintf(stderr, "AVCodec not found: %d\n", codec_id);
+        return false;
+    }
+
+    // open input_file and output_file
+    MappedFile mapped_input;
+    std::ifstream ifs;
+    if (options.mmap_input || options.annexb_splitter) {
+        if (!mapped_input.Open(input_file)) {
+            fprintf(stderr, "Failed to map input file: %s\n", input_file);
+            return false;
+        }
+    } else {
+        ifs.open(input_file, std::ios::in | std::ios::binary);
+        if (!ifs.is_open()) {
+            fprintf(stderr, "Failed to open input file: %s\n", input_file);
+            return false;
+        }
+    }
+    YuvFileWriter writer;
+    if (output_file && !writer.Open(output_file)) {
+        fprintf(stderr, "Failed to open output file: %s\n", output_file);
+        return false;
+    }
+    FrameHashList hashes;
+    if (options.hash_file && !hashes.Open(options.hash_file)) {
+        fprintf(stderr, "Failed to open hash file: %s\n", options.hash_file);
+        return false;
+    }
+
+    // initialize AVCodecParserContext
+    AVCodecParserContext *parser_ctx = av_parser_init(codec->id);
+    if (parser_ctx == nullptr) {
+        fprintf(stderr, "Failed to init AVCodecParserContext: %d\n", codec->id);
+        return false;
+    }
+
+    // allocate AVCodecContext
+    AVCodecContext *codec_ctx = avcodec_alloc_context3(codec);
+    if (codec_ctx == nullptr) {
+        fprintf(stderr, "Failed to allocate AVCodecContext: %d\n", codec->id);
+        av_parser_close(parser_ctx);
+        return false;
+    }
+
+    // frame threading decodes several frames at once (adds thread_count - 1 frames of delay),
+    // slice threading splits one frame when the stream has multiple slices
+    codec_ctx->thread_count = options.thread_count > 0
+                                  ? options.thread_count
+                                  : std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+    codec_ctx->thread_type = options.thread_type;
+    HugePageFramePool frame_pool;
+    if (options.huge_page_buffers) {
+        frame_pool.Attach(codec_ctx);
+    }
+
+    // initialize AVCodecContext
+    if ((error_code = avcodec_open2(codec_ctx, codec, nullptr)) < 0) {
+        fprintf(stderr, "Failed to init AVCodecContext: %s\n", ErrorToString(error_code));
+        avcodec_free_context(&codec_ctx);
+        av_parser_close(parser_ctx);
+        return false;
+    }
+
+    // allocate AVPacket and AVFrame once for the whole stream
+    AVPacket *pkt = av_packet_alloc();
+    AVFrame *frame = av_frame_alloc();
+    if (pkt == nullptr || frame == nullptr) {
+        fprintf(stderr, "Failed to allocate AVPacket or AVFrame\n");
+        av_frame_free(&frame);
+        av_packet_free(&pkt);
+        avcodec_free_context(&codec_ctx);
+        av_parser_close(parser_ctx);
+        return false;
+    }
+
+    // allocate input buffer
+    const std::size_t input_buffer_size = kInputVideoBufferSize + AV_INPUT_BUFFER_PADDING_SIZE;
+    auto input_buffer = std::make_unique<uint8_t[]>(input_buffer_size); // std=c++17
+    std::memset(input_buffer.get(), 0, input_buffer_size);
+    uint8_t *data = input_buffer.get();
+
+    const auto start = std::chrono::steady_clock::now();
+    const DecodeOutput output{output_file ? &writer : nullptr, options.hash_file ? &hashes : nullptr};
+    bool success = true;
+    size_t data_size{};
+    if (options.annexb_splitter) {
+        success = DecodeAnnexBVideo(mapped_input, codec_ctx, pkt, frame, output, stats);
+    } else if (options.mmap_input) {
+        success = DecodeMappedVideo(mapped_input, parser_ctx, codec_ctx, pkt, frame, output, stats);
+    }
+    while (!options.mmap_input && !options.annexb_splitter) {
+        // refill input buffer
+        if (data_size < kInputVideoBufferRefillThreshold && !ifs.eof()) {
+            if (data_size > 0) {
+                std::memcpy(input_buffer.get(), data, data_size);
+            }
+            data = input_buffer.get();
+            std::size_t bytes_to_read = kInputVideoBufferRefillThreshold - data_size;
+            if (!ifs.read(reinterpret_cast<char *>(data) + data_size, static_cast<std::streamsize>(bytes_to_read))) {
+                if (!ifs.eof()) {
+                    fprintf(stderr, "Failed to read input file: %s\n", input_file);
+                    success = false;
+                    break;
+                }
+                fprintf(stderr, "End of ifstream: %s\n", input_file);
+            }
+            data_size += ifs.gcount();
+        }
+
+        // parse an video frame. if success, pkt->data == data && pkt->size == parsed
+        int parsed = av_parser_parse2(parser_ctx, codec_ctx,
+                                      &pkt->data, &pkt->size,
+                                      data, static_cast<int>(data_size),
+                                      AV_NOPTS_VALUE, AV_NOPTS_VALUE, 0);
+        if (parsed < 0) {
+            fprintf(stderr, "Failed to parse video: %s\n", ErrorToString(parsed));
+            success = false;
+            break;
+        }
+        data += parsed;
+        data_size -= parsed;
+
+        // decode video and write to output_file
+        if (pkt->size > 0) {
+            InnerDecodeVideo(codec_ctx, pkt, frame, output, stats);
+        }
+
+        // if decode end, drain the decoder
+        if (data_size == 0 && ifs.eof()) {
+            pkt->data = nullptr;
+            pkt->size = 0;
+            InnerDecodeVideo(codec_ctx, pkt, frame, output, stats);
+            break;
+        }
+    }
+
+    // end-to-end wall time includes the last batches reaching the disk
+    if (output.writer && !writer.Close()) {
+        fprintf(stderr, "Failed to write yuv file: %s\n", output_file);
+        success = false;
+    }
+    if (output.hashes && !hashes.Close()) {
+        fprintf(stderr, "Failed to write hash file: %s\n", options.hash_file);
+        success = false;
+    }
+    stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf("Decode H264 video end: %lld frames in %.3f s (%.1f fps), %d threads\n",
+           stats.frames, stats.seconds, stats.frames / stats.seconds, codec_ctx->thread_count);
+    if (output.writer) {
+        printf("Wrote %.1f MB in %lld writes (%.1f MB/s), decoder waited %.3f s for the disk\n",
+               writer.BytesWritten() / 1e6, writer.Writes(), writer.BytesWritten() / 1e6 / stats.seconds,
+               writer.WaitSeconds());
+    }
+    if (options.huge_page_buffers) {
+        frame_pool.PrintStats();
+    }
+
+    av_frame_free(&frame);
+    av_packet_free(&pkt);
+    avcodec_free_context(&codec_ctx);
+    av_parser_close(parser_ctx);
+    return success;
+}
+
+// decode input_file without output once per thread count from 1 to max_threads
+bool BenchmarkDecodeVideo(const char *input_file, int max_threads, const DecodeOptions &options) {
+    double single_thread_fps = 0.0;
+    printf("%8s %10s %10s %10s %12s\n", "threads", "frames", "fps", "speedup", "efficiency");
+    for (int threads = 1; threads <= max_threads; ++threads) {
+        DecodeStats stats;
+        DecodeOptions thread_options = options;
+        thread_options.thread_count = threads;
+        if (!DecodeVideo(input_file, nullptr, thread_options, stats)) {
+            return false;
+        }
+        const double fps = stats.frames / stats.seconds;
+        if (threads == 1) {
+            single_thread_fps = fps;
+        }
+        printf("%8d %10lld %10.1f %9.2fx %11.0f%%\n", threads, stats.frames, fps, fps / single_thread_fps,
+               fps / single_thread_fps / threads * 100);
+    }
+    return true;
+}
+
+// decode input_file without output with the default allocator and with HugePageFramePool, dTLB misses cover the
+// decoder's threads too
+bool BenchmarkHugePages(const char *input_file, const DecodeOptions &options) {
+    printf("%10s %10s %10s %22s %22s\n", "buffers", "frames", "fps", "dTLB load misses/frame",
+           "dTLB store misses/frame");
+    for (const bool huge_pages: {false, true}) {
+        DecodeOptions allocator_options = options;
+        allocator_options.huge_page_buffers = huge_pages;
+        PerfCounter load_misses;
+        PerfCounter store_misses;
+#ifdef __linux__
+        load_misses.Open(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                             (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+        store_misses.Open(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_WRITE << 8) |
+                                              (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+#endif
+        DecodeStats stats;
+        if (!DecodeVideo(input_file, nullptr, allocator_options, stats)) {
+            return false;
+        }
+        const int64_t frames = std::max<int64_t>(stats.frames, 1);
+        const int64_t loads = load_misses.Value();
+        const int64_t stores = store_misses.Value();
+        printf("%10s %10lld %10.1f %22s %22s\n", huge_pages ? "huge" : "default", stats.frames,
+               stats.frames / stats.seconds,
+               loads < 0 ? "n/a" : std::to_string(loads / frames).c_str(),
+               stores < 0 ? "n/a" : std::to_string(stores / frames).c_str());
+    }
+    return true;
+}
+
+// call fn(nal_type, nal, nal_size) for every NAL unit of an Annex B buffer, nal starts with its start code
+template<typename Fn>
+static void ForEachNal(const uint8_t *data, std::size_t size, Fn fn) {
+    const uint8_t *end = data + size;
+    const uint8_t *start_code = FindStartCode(data, end);
+    while (start_code + 3 < end) {
+        const uint8_t *next = FindStartCode(start_code + 3, end);
+        fn(start_code[3] & 0x1f, start_code, static_cast<std::size_t>(next - start_code));
+        start_code = next;
+    }
+}
+
+// an IDR access unit and everything up to the next one, decodable on its own
+struct GopSegment {
+    std::vector<uint8_t> parameter_sets; // every SPS and PPS seen before the segment, sent as the first packet
+    std::vector<std::pair<const uint8_t *, std::size_t>> access_units;
+    std::vector<AVFrame *> frames; // decoded frames in output order, not yet taken by the writer
+    bool done = false; // every frame of the segment has been added to frames
+};
+
+static int64_t FrameBytes(const AVFrame *frame) {
+    int64_t bytes = 0;
+    for (const AVBufferRef *buf: frame->buf) {
+        bytes += buf ? static_cast<int64_t>(buf->size) : 0;
+    }
+    return bytes;
+}
+
+// keep the newest copy of every distinct parameter set last, so it wins when a stream redefines an id
+static void RememberParameterSet(std::vector<std::vector<uint8_t>> &sets, const uint8_t *nal, std::size_t size) {
+    std::vector<uint8_t> set(nal, nal + size);
+    const auto it = std::find(sets.begin(), sets.end(), set);
+    if (it != sets.end()) {
+        sets.erase(it);
+    }
+    sets.push_back(std::move(set));
+}
+
+static std::vector<GopSegment> SplitGopSegments(const MappedFile &input) {
+    std::vector<GopSegment> segments(1);
+    std::vector<std::vector<uint8_t>> sps_list;
+    std::vector<std::vector<uint8_t>> pps_list;
+    AnnexBSplitter splitter(input.Data(), input.Size());
+    const uint8_t *au = nullptr;
+    std::size_t au_size = 0;
+    while (splitter.Next(&au, &au_size)) {
+        bool idr = false;
+        ForEachNal(au, au_size, [&](int type, const uint8_t *, std::size_t) -> void { idr = idr || type == 5; });
+        if (idr && !segments.back().access_units.empty()) {
+            GopSegment &segment = segments.emplace_back();
+            // SPS before PPS, a PPS refers to its SPS
+            for (const auto &sets: {&sps_list, &pps_list}) {
+                for (const auto &set: *sets) {
+                    segment.parameter_sets.insert(segment.parameter_sets.end(), set.begin(), set.end());
+                }
+            }
+        }
+        ForEachNal(au, au_size, [&](int type, const uint8_t *nal, std::size_t nal_size) -> void {
+            if (type == 7) {
+                RememberParameterSet(sps_list, nal, nal_size);
+            } else if (type == 8) {
+                RememberParameterSet(pps_list, nal, nal_size);
+            }
+        });
+        segments.back().access_units.emplace_back(au, au_size);
+    }
+    if (segments.back().access_units.empty()) {
+        segments.pop_back();
+    }
+    return segments;
+}
+
+// send one packet (nullptr data drains) and move every frame it produces into frames
+static bool DecodeSegmentPacket(AVCodecContext *codec_ctx, AVPacket *pkt, AVFrame *frame,
+                                std::vector<AVFrame *> &frames) {
+    int error_code = avcodec_send_packet(codec_ctx, pkt);
+    if (error_code < 0 && error_code != AVERROR(EAGAIN) && error_code != AVERROR_EOF) {
+        fprintf(stderr, "Failed to send packet to decoder: %s\n", ErrorToString(error_code));
+        return false;
+    }
+    while ((error_code = avcodec_receive_frame(codec_ctx, frame)) == 0) {
+        AVFrame *out = av_frame_alloc();
+        if (out == nullptr) {
+            return false;
+        }
+        av_frame_move_ref(out, frame);
+        frames.push_back(out);
+    }
+    return error_code == AVERROR(EAGAIN) || error_code == AVERROR_EOF;
+}
+
+// Decode the IDR-delimited segments of input_file on workers single-threaded decoders, then write the frames in
+// stream order through a reorder buffer. Frames of the head segment are written while it is still decoding.
+// Workers stay at most kGopReorderWindow segments ahead of the writer, and a worker ahead of the head segment
+// blocks while kGopBufferedFrameBytes of decoded frames are waiting, which bounds the memory for 4K and long GOPs
+bool DecodeVideoGopParallel(const char *input_file, const char *output_file, int workers, DecodeStats &stats) {
+    MappedFile input;
+    if (!input.Open(input_file)) {
+        fprintf(stderr, "Failed to map input file: %s\n", input_file);
+        return false;
+    }
+    const AVCodec *codec = avcodec_find_decoder(AV_CODEC_ID_H264);
+    if (codec == nullptr) {
+        fprintf(stderr, "AVCodec not found: %d\n", AV_CODEC_ID_H264);
+        return false;
+    }
+    YuvFileWriter writer;
+    if (output_file && !writer.Open(output_file)) {
+        fprintf(stderr, "Failed to open output file: %s\n", output_file);
+        return false;
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    std::vector<GopSegment> segments = SplitGopSegments(input);
+    const auto reorder_window = static_cast<std::size_t>(workers) * kGopReorderWindow;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::size_t written = 0; // segments handed to the writer, guarded by mutex
+    int64_t buffered_bytes = 0; // decoded frames waiting for the writer, guarded by mutex
+    std::atomic<std::size_t> next_segment{0};
+    std::atomic<bool> failed{false};
+
+    std::vector<std::thread> threads;
+    for (int worker = 0; worker < workers; ++worker) {
+        threads.emplace_back([&]() -> void {
+            AVCodecContext *codec_ctx = avcodec_alloc_context3(codec);
+            AVPacket *pkt = av_packet_alloc();
+            AVFrame *frame = av_frame_alloc();
+            bool ok = codec_ctx && pkt && frame;
+            if (ok) {
+                codec_ctx->thread_count = 1; // parallelism comes from the segments
+                ok = avcodec_open2(codec_ctx, codec, nullptr) >= 0;
+            }
+            while (ok && !failed) {
+                const std::size_t index = next_segment.fetch_add(1);
+                if (index >= segments.size()) {
+                    break;
+                }
+                {
+                    std::unique_lock lock(mutex);
+                    cv.wait(lock, [&]() -> bool { return index < written + reorder_window || failed; });
+                }
+                GopSegment &segment = segments[index];
+                std::vector<AVFrame *> frames;
+                // hand new frames to the writer, the head segment never waits or the writer could not progress
+                const auto publish = [&](bool done) -> void {
+                    int64_t bytes = 0;
+                    for (const AVFrame *out: frames) {
+                        bytes += FrameBytes(out);
+                    }
+                    {
+                        std::unique_lock lock(mutex);
+                        cv.wait(lock, [&]() -> bool {
+                            return index == written || buffered_bytes + bytes <= kGopBufferedFrameBytes || failed;
+                        });
+                        segment.frames.insert(segment.frames.end(), frames.begin(), frames.end());
+                        segment.done = done;
+                        buffered_bytes += bytes;
+                    }
+                    frames.clear();
+                    cv.notify_all();
+                };
+                if (!segment.parameter_sets.empty()) {
+                    pkt->data = segment.parameter_sets.data();
+                    pkt->size = static_cast<int>(segment.parameter_sets.size());
+                    ok = DecodeSegmentPacket(codec_ctx, pkt, frame, frames);
+                }
+                for (const auto &[au, au_size]: segment.access_units) {
+                    pkt->data = const_cast<uint8_t *>(au);
+                    pkt->size = static_cast<int>(au_size);
+                    ok = ok && DecodeSegmentPacket(codec_ctx, pkt, frame, frames);
+                    if (ok && !frames.empty()) {
+                        publish(false);
+                    }
+                }
+                pkt->data = nullptr;
+                pkt->size = 0;
+                ok = ok && DecodeSegmentPacket(codec_ctx, pkt, frame, frames);
+                avcodec_flush_buffers(codec_ctx); // leave draining mode for the next segment
+                publish(true);
+            }
+            if (!ok) {
+                failed = true;
+                cv.notify_all();
+            }
+            av_frame_free(&frame);
+            av_packet_free(&pkt);
+            avcodec_free_context(&codec_ctx);
+        });
+    }
+
+    // reorder buffer: segments finish in any order, frames leave in stream order as soon as their segment is the
+    // head segment
+    bool success = true;
+    for (std::size_t index = 0; index < segments.size(); ++index) {
+        bool done = false;
+        while (!done) {
+            std::vector<AVFrame *> frames;
+            {
+                std::unique_lock lock(mutex);
+                GopSegment &segment = segments[index];
+                cv.wait(lock, [&]() -> bool { return segment.done || !segment.frames.empty() || failed; });
+                if (failed) {
+                    success = false;
+                    break;
+                }
+                frames.swap(segment.frames);
+                done = segment.done;
+                for (const AVFrame *out: frames) {
+                    buffered_bytes -= FrameBytes(out);
+                }
+            }
+            cv.notify_all();
+            for (AVFrame *out: frames) {
+                if (output_file && success && !writer.WriteFrame(out)) {
+                    fprintf(stderr, "Failed to write yuv file\n");
+                    success = false;
+                }
+                av_frame_free(&out);
+            }
+            stats.frames += static_cast<int64_t>(frames.size());
+        }
+        if (!success) {
+            break;
+        }
+        {
+            std::lock_guard lock(mutex);
+            written = index + 1;
+        }
+        cv.notify_all();
+    }
+    if (!success) {
+        failed = true;
+        cv.notify_all();
+    }
+    for (auto &thread: threads) {
+        thread.join();
+    }
+    for (auto &segment: segments) {
+        for (AVFrame *out: segment.frames) {
+            av_frame_free(&out);
+        }
+    }
+    if (output_file && !writer.Close()) {
+        success = false;
+    }
+    stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf("GOP parallel decode: %zu segments, %lld frames in %.3f s (%.1f fps), %d workers\n",
+           segments.size(), stats.frames, stats.seconds, stats.frames / stats.seconds, workers);
+    return success && !failed;
+}
+
+// GOP parallel decoding without output once per worker count from 1 to max_workers
+bool BenchmarkGopParallel(const char *input_file, int max_workers) {
+    double single_worker_fps = 0.0;
+    printf("%8s %10s %10s %10s %12s\n", "workers", "frames", "fps", "speedup", "efficiency");
+    for (int workers = 1; workers <= max_workers; ++workers) {
+        DecodeStats stats;
+        if (!DecodeVideoGopParallel(input_file, nullptr, workers, stats)) {
+            return false;
+        }
+        const double fps = stats.frames / stats.seconds;
+        if (workers == 1) {
+            single_worker_fps = fps;
+        }
+        printf("%8d %10lld %10.1f %9.2fx %11.0f%%\n", workers, stats.frames, fps, fps / single_worker_fps,
+               fps / single_worker_fps / workers * 100);
+    }
+    return true;
+}
+
+// thumbnails are JPEG (full range YUV420P) unless the output file name ends with .png
+static AVPixelFormat ThumbnailPixelFormat(const char *file_name) {
+    return GetFileExtension(file_name) == "png" ? AV_PIX_FMT_RGB24 : AV_PIX_FMT_YUVJ420P;
+}
+
+static AVFrame *AllocImage(AVPixelFormat pix_fmt, int width, int height) {
+    AVFrame *image = av_frame_alloc();
+    if (image == nullptr) {
+        return nullptr;
+    }
+    image->format = pix_fmt;
+    image->width = width;
+    image->height = height;
+    if (av_frame_get_buffer(image, 0) < 0) {
+        av_frame_free(&image);
+    }
+    return image;
+}
+
+// black background of a sprite sheet, image is YUVJ420P or RGB24
+static void ClearImage(AVFrame *image) {
+    for (int plane = 0; plane < 3 && image->data[plane]; ++plane) {
+        const int rows = plane == 0 ? image->height : (image->height + 1) / 2;
+        const std::size_t size = static_cast<std::size_t>(image->linesize[plane]) * rows;
+        std::memset(image->data[plane], plane == 0 ? 0 : 0x80, size);
+    }
+}
+
+// copy a thumbnail into the sheet at pixel position (x, y), both are YUVJ420P or RGB24, x and y are even
+static void CopyTile(AVFrame *sheet, const AVFrame *tile, int x, int y) {
+    if (sheet->format == AV_PIX_FMT_RGB24) {
+        av_image_copy_plane(sheet->data[0] + y * sheet->linesize[0] + x * 3, sheet->linesize[0],
+                            tile->data[0], tile->linesize[0], tile->width * 3, tile->height);
+        return;
+    }
+    for (int plane = 0; plane < 3; ++plane) {
+        const int shift = plane == 0 ? 0 : 1;
+        av_image_copy_plane(sheet->data[plane] + (y >> shift) * sheet->linesize[plane] + (x >> shift),
+                            sheet->linesize[plane], tile->data[plane], tile->linesize[plane],
+                            tile->width >> shift, tile->height >> shift);
+    }
+}
+
+static bool EncodeImage(const AVFrame *image, const char *file_name) {
+    const bool png = image->format == AV_PIX_FMT_RGB24;
+    const AVCodec *codec = avcodec_find_encoder(png ? AV_CODEC_ID_PNG : AV_CODEC_ID_MJPEG);
+    AVCodecContext *codec_ctx = codec ? avcodec_alloc_context3(codec) : nullptr;
+    AVPacket *pkt = av_packet_alloc();
+    if (codec_ctx == nullptr || pkt == nullptr) {
+        fprintf(stderr, "Failed to create image encoder for %s\n", file_name);
+        av_packet_free(&pkt);
+        avcodec_free_context(&codec_ctx);
+        return false;
+    }
+    codec_ctx->width = image->width;
+    codec_ctx->height = image->height;
+    codec_ctx->pix_fmt = static_cast<AVPixelFormat>(image->format);
+    codec_ctx->time_base = AVRational{1, 25};
+    if (!png) {
+        codec_ctx->color_range = AVCOL_RANGE_JPEG;
+        codec_ctx->flags |= AV_CODEC_FLAG_QSCALE;
+        codec_ctx->global_quality = FF_QP2LAMBDA * 3;
+    }
+
+    int error_code{};
+    bool success = false;
+    std::ofstream ofs(file_name, std::ios::out | std::ios::binary);
+    if (!ofs.is_open()) {
+        fprintf(stderr, "Failed to open output file: %s\n", file_name);
+    } else if ((error_code = avcodec_open2(codec_ctx, codec, nullptr)) < 0 ||
+               (error_code = avcodec_send_frame(codec_ctx, image)) < 0 ||
+               (error_code = avcodec_send_frame(codec_ctx, nullptr)) < 0) {
+        fprintf(stderr, "Failed to encode %s: %s\n", file_name, ErrorToString(error_code));
+    } else {
+        while ((error_code = avcodec_receive_packet(codec_ctx, pkt)) == 0) {
+            ofs.write(reinterpret_cast<const char *>(pkt->data), pkt->size);
+            av_packet_unref(pkt);
+        }
+        success = error_code == AVERROR_EOF && ofs.good();
+    }
+    av_packet_free(&pkt);
+    avcodec_free_context(&codec_ctx);
+    return success;
+}
+
+// swscale context that runs on all cores, libswscale splits the slices among its own threads
+static SwsContext *CreateThumbnailScaler(const AVFrame *src, const AVFrame *dst) {
+    SwsContext *sws_ctx = sws_alloc_context();
+    if (sws_ctx == nullptr) {
+        return nullptr;
+    }
+    av_opt_set_int(sws_ctx, "srcw", src->width, 0);
+    av_opt_set_int(sws_ctx, "srch", src->height, 0);
+    av_opt_set_int(sws_ctx, "src_format", src->format, 0);
+    av_opt_set_int(sws_ctx, "dstw", dst->width, 0);
+    av_opt_set_int(sws_ctx, "dsth", dst->height, 0);
+    av_opt_set_int(sws_ctx, "dst_format", dst->format, 0);
+    av_opt_set_int(sws_ctx, "sws_flags", SWS_AREA, 0);
+    av_opt_set_int(sws_ctx, "threads", 0, 0); // 0: one per core
+    if (sws_init_context(sws_ctx, nullptr, nullptr) < 0) {
+        sws_freeContext(sws_ctx);
+        return nullptr;
+    }
+    return sws_ctx;
+}
+
+// Decode only keyframes (skip_frame = AVDISCARD_NONKEY, non-key packets are not even sent), with lowres where
+// the decoder supports it, and scale one keyframe per interval into a sprite sheet or into single images.
+// When an interval is set, the demuxer seeks forward to the next capture time where it can. Every thumbnail
+// has the size derived from the first captured frame, the scaler follows resolution changes of the source.
+// output may be nullptr to measure decoding and scaling only
+bool GenerateThumbnails(const char *input_file, const char *output, const ThumbnailOptions &options,
+                        DecodeStats &stats) {
+    int error_code{};
+    AVFormatContext *fmt_ctx = nullptr;
+    if ((error_code = avformat_open_input(&fmt_ctx, input_file, nullptr, nullptr)) < 0 ||
+        (error_code = avformat_find_stream_info(fmt_ctx, nullptr)) < 0) {
+        fprintf(stderr, "Failed to open input file %s: %s\n", input_file, ErrorToString(error_code));
+        avformat_close_input(&fmt_ctx);
+        return false;
+    }
+    const AVCodec *codec = nullptr;
+    const int stream_index = av_find_best_stream(fmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, &codec, 0);
+    AVCodecContext *codec_ctx = stream_index >= 0 ? avcodec_alloc_context3(codec) : nullptr;
+    if (codec_ctx == nullptr ||
+        avcodec_parameters_to_context(codec_ctx, fmt_ctx->streams[stream_index]->codecpar) < 0) {
+        fprintf(stderr, "Failed to find a decodable video stream in %s\n", input_file);
+        avcodec_free_context(&codec_ctx);
+        avformat_close_input(&fmt_ctx);
+        return false;
+    }
+    const AVRational time_base = fmt_ctx->streams[stream_index]->time_base;
+    if (options.keyframes_only) {
+        codec_ctx->skip_frame = AVDISCARD_NONKEY;
+        codec_ctx->lowres = std::min(options.lowres, static_cast<int>(codec->max_lowres));
+    }
+    codec_ctx->thread_count = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+    if ((error_code = avcodec_open2(codec_ctx, codec, nullptr)) < 0) {
+        fprintf(stderr, "Failed to init AVCodecContext: %s\n", ErrorToString(error_code));
+        avcodec_free_context(&codec_ctx);
+        avformat_close_input(&fmt_ctx);
+        return false;
+    }
+
+    const AVPixelFormat thumb_fmt = ThumbnailPixelFormat(output ? output : "");
+    AVPacket *pkt = av_packet_alloc();
+    AVFrame *frame = av_frame_alloc();
+    SwsContext *sws_ctx = nullptr;
+    int sws_src_w = 0; // source geometry sws_ctx was created for
+    int sws_src_h = 0;
+    int sws_src_fmt = AV_PIX_FMT_NONE;
+    int thumb_w = 0; // fixed by the first captured frame, so every tile of the sheet has the same size
+    int thumb_h = 0;
+    std::vector<AVFrame *> thumbnails;
+    double next_capture = 0.0;
+    double last_capture = -1.0;
+    bool can_seek = options.keyframes_only && options.interval > 0.0;
+    bool success = pkt && frame;
+    const auto start = std::chrono::steady_clock::now();
+
+    while (success) {
+        const bool eof = av_read_frame(fmt_ctx, pkt) < 0;
+        if (!eof && (pkt->stream_index != stream_index ||
+                     (options.keyframes_only && !(pkt->flags & AV_PKT_FLAG_KEY)))) {
+            av_packet_unref(pkt);
+            continue;
+        }
+        // at the end an empty packet drains the decoder
+        error_code = avcodec_send_packet(codec_ctx, eof ? nullptr : pkt);
+        av_packet_unref(pkt);
+        if (error_code < 0 && error_code != AVERROR(EAGAIN) && error_code != AVERROR_EOF) {
+            fprintf(stderr, "Failed to send packet to decoder: %s\n", ErrorToString(error_code));
+            success = false;
+            break;
+        }
+        bool seek = false;
+        while (avcodec_receive_frame(codec_ctx, frame) == 0) {
+            stats.frames++;
+            // frames without any timestamp are assumed to be 25 fps, like the raw h264 demuxer does
+            const int64_t pts = frame->best_effort_timestamp;
+            const double seconds = pts != AV_NOPTS_VALUE ? pts * av_q2d(time_base) : stats.frames / 25.0;
+            // the full decode baseline captures the same keyframes as the keyframe-only decode
+            if (seconds < next_capture || !(frame->flags & AV_FRAME_FLAG_KEY) || frame->width <= 0) {
+                continue;
+            }
+            if (seconds <= last_capture) {
+                can_seek = false; // the demuxer seeks backwards, read sequentially from here on
+            }
+            last_capture = seconds;
+            next_capture = options.interval > 0.0 ? seconds + options.interval : seconds;
+
+            // lowres changes the decoded size, and TS or adaptive inputs may change it mid-stream. The scaler is
+            // recreated whenever the source geometry changes, which keeps its worker threads otherwise
+            if (thumb_w == 0) {
+                thumb_w = std::max(2, options.width & ~1);
+                thumb_h = std::max(2, static_cast<int>(static_cast<int64_t>(thumb_w) * frame->height / frame->width));
+                thumb_h &= ~1;
+            }
+            AVFrame *thumb = AllocImage(thumb_fmt, thumb_w, thumb_h);
+            if (thumb && (sws_ctx == nullptr || frame->width != sws_src_w || frame->height != sws_src_h ||
+                          frame->format != sws_src_fmt)) {
+                sws_freeContext(sws_ctx);
+                sws_ctx = CreateThumbnailScaler(frame, thumb);
+                sws_src_w = frame->width;
+                sws_src_h = frame->height;
+                sws_src_fmt = frame->format;
+            }
+            if (thumb == nullptr || sws_ctx == nullptr) {
+                fprintf(stderr, "Failed to create thumbnail scaler\n");
+                av_frame_free(&thumb);
+                success = false;
+                break;
+            }
+            sws_scale(sws_ctx, frame->data, frame->linesize, 0, frame->height, thumb->data, thumb->linesize);
+            thumbnails.push_back(thumb);
+            seek = can_seek;
+        }
+        if (eof) {
+            break;
+        }
+        if (seek) {
+            const auto target = static_cast<int64_t>(next_capture / av_q2d(time_base));
+            if (av_seek_frame(fmt_ctx, stream_index, target, 0) >= 0) {
+                avcodec_flush_buffers(codec_ctx);
+            } else {
+                can_seek = false;
+            }
+        }
+    }
+    stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    if (success && output && !thumbnails.empty()) {
+        if (options.columns > 0) {
+            const int columns = std::min(options.columns, static_cast<int>(thumbnails.size()));
+            const int rows = (static_cast<int>(thumbnails.size()) + columns - 1) / columns;
+            const int tile_w = thumbnails[0]->width;
+            const int tile_h = thumbnails[0]->height;
+            AVFrame *sheet = AllocImage(thumb_fmt, columns * tile_w, rows * tile_h);
+            if (sheet) {
+                ClearImage(sheet);
+                for (std::size_t i = 0; i < thumbnails.size(); ++i) {
+                    CopyTile(sheet, thumbnails[i], static_cast<int>(i % columns) * tile_w,
+                             static_cast<int>(i / columns) * tile_h);
+                }
+            }
+            success = sheet && EncodeImage(sheet, output);
+            av_frame_free(&sheet);
+        } else {
+            // output is a printf pattern such as thumb_%04d.jpg
+            for (std::size_t i = 0; i < thumbnails.size() && success; ++i) {
+                char file_name[1024] = {};
+                std::snprintf(file_name, sizeof(file_name), output, static_cast<int>(i));
+                success = EncodeImage(thumbnails[i], file_name);
+            }
+        }
+    }
+    printf("%s: %lld frames decoded, %zu thumbnails in %.3f s (lowres=%d)\n",
+           options.keyframes_only ? "Keyframe decode" : "Full decode", stats.frames, thumbnails.size(),
+           stats.seconds, codec_ctx->lowres);
+
+    for (AVFrame *thumb: thumbnails) {
+        av_frame_free(&thumb);
+    }
+    sws_freeContext(sws_ctx);
+    av_frame_free(&frame);
+    av_packet_free(&pkt);
+    avcodec_free_context(&codec_ctx);
+    avformat_close_input(&fmt_ctx);
+    return success;
+}
+
+// same thumbnails from a full decode and from the keyframe-only decode, without writing images
+bool BenchmarkThumbnails(const char *input_file, ThumbnailOptions options) {
+    DecodeStats full_stats;
+    DecodeStats keyframe_stats;
+    options.keyframes_only = false;
+    if (!GenerateThumbnails(input_file, nullptr, options, full_stats)) {
+        return false;
+    }
+    options.keyframes_only = true;
+    if (!GenerateThumbnails(input_file, nullptr, options, keyframe_stats)) {
+        return false;
+    }
+    printf("Keyframe-only speedup: %.1fx (%.3f s -> %.3f s)\n", full_stats.seconds / keyframe_stats.seconds,
+           full_stats.seconds, keyframe_stats.seconds);
+    return true;
+}
+
+// access unit splitting only, no decoding: av_parser_parse2 over the mapped file against AnnexBSplitter
+bool BenchmarkSplitters(const char *input_file) {
+    MappedFile input;
+    if (!input.Open(input_file)) {
+        fprintf(stderr, "Failed to map input file: %s\n", input_file);
+        return false;
+    }
+    AVCodecParserContext *parser_ctx = av_parser_init(AV_CODEC_ID_H264);
+    AVCodecContext *codec_ctx = avcodec_alloc_context3(avcodec_find_decoder(AV_CODEC_ID_H264));
+    if (parser_ctx == nullptr || codec_ctx == nullptr) {
+        fprintf(stderr, "Failed to init H264 parser\n");
+        avcodec_free_context(&codec_ctx);
+        av_parser_close(parser_ctx);
+        return false;
+    }
+
+    // the mapped body and a zero padded copy of the last kMappedTailSize bytes, same as DecodeMappedVideo, so the
+    // parser never reads past the mapping. The tail copy is part of the measurement
+    const double megabytes = input.Size() / 1e6;
+    auto start = std::chrono::steady_clock::now();
+    const std::size_t tail_size = std::min(input.Size(), kMappedTailSize);
+    const std::size_t body_size = input.Size() - tail_size;
+    auto tail = std::make_unique<uint8_t[]>(tail_size + AV_INPUT_BUFFER_PADDING_SIZE);
+    std::memcpy(tail.get(), input.Data() + body_size, tail_size);
+    std::memset(tail.get() + tail_size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+    int64_t parser_packets = 0;
+    const auto parse_span = [&](const uint8_t *data, std::size_t data_size, bool last) -> void {
+        while (true) {
+            uint8_t *out = nullptr;
+            int out_size = 0;
+            const int span = static_cast<int>(std::min<std::size_t>(data_size, std::numeric_limits<int>::max()));
+            if (span == 0 && !last) {
+                break;
+            }
+            const int parsed = av_parser_parse2(parser_ctx, codec_ctx, &out, &out_size, data, span,
+                                                AV_NOPTS_VALUE, AV_NOPTS_VALUE, 0);
+            if (parsed < 0) {
+                break;
+            }
+            data += parsed;
+            data_size -= parsed;
+            parser_packets += out_size > 0;
+            if (span == 0) {
+                break; // flushed
+            }
+        }
+    };
+    parse_span(input.Data(), body_size, false);
+    parse_span(tail.get(), tail_size, true);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf("av_parser_parse2: %lld access units in %.3f ms (%.0f MB/s)\n", parser_packets, seconds * 1000,
+           megabytes / seconds);
+
+    start = std::chrono::steady_clock::now();
+    AnnexBSplitter splitter(input.Data(), input.Size());
+    const uint8_t *au = nullptr;
+    std::size_t au_size = 0;
+    while (splitter.Next(&au, &au_size)) {
+    }
+    seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf("AnnexBSplitter:   %lld access units in %.3f ms (%.0f MB/s)\n", splitter.AccessUnitCount(),
+           seconds * 1000, megabytes / seconds);
+    splitter.PrintNalCounts();
+
+    avcodec_free_context(&codec_ctx);
+    av_parser_close(parser_ctx);
+    return true;
+}
+
+// how a codec is stored as an elementary file: raw through a bitstream filter, or through a lightweight muxer
+struct ElementaryFormat {
+    AVCodecID codec_id;
+    const char *extension;
+    const char *bsf; // Annex B conversion, written without a muxer
+    const char *muxer; // adts/ogg/... adds the framing the raw packets lack
+};
+
+static constexpr ElementaryFormat kElementaryFormats[] = {
+    {AV_CODEC_ID_H264, "h264", "h264_mp4toannexb", nullptr},
+    {AV_CODEC_ID_HEVC, "hevc", "hevc_mp4toannexb", nullptr},
+    {AV_CODEC_ID_AAC, "aac", nullptr, "adts"},
+    {AV_CODEC_ID_OPUS, "opus", nullptr, "ogg"},
+    {AV_CODEC_ID_VORBIS, "ogg", nullptr, "ogg"},
+    {AV_CODEC_ID_FLAC, "flac", nullptr, "flac"},
+    {AV_CODEC_ID_MP3, "mp3", nullptr, "mp3"},
+    {AV_CODEC_ID_AC3, "ac3", nullptr, "ac3"},
+};
+
+struct ExtractOutput {
+    int stream_index = -1;
+    std::string file_name;
+    AVBSFContext *bsf_ctx = nullptr;
+    AVFormatContext *mux_ctx = nullptr;
+    std::unique_ptr<ChunkFileWriter> writer;
+    int64_t packets = 0;
+};
+
+static void CloseExtractOutput(ExtractOutput &output) {
+    av_bsf_free(&output.bsf_ctx);
+    if (output.mux_ctx) {
+        if (output.mux_ctx->pb) {
+            av_freep(&output.mux_ctx->pb->buffer);
+            avio_context_free(&output.mux_ctx->pb);
+        }
+        avformat_free_context(output.mux_ctx);
+        output.mux_ctx = nullptr;
+    }
+}
+
+// create the bitstream filter or the muxer of one output, the muxer writes through a custom AVIO into the writer
+static bool OpenExtractOutput(const AVStream *stream, const ElementaryFormat &format, ExtractOutput &output) {
+    int error_code{};
+    output.writer = std::make_unique<ChunkFileWriter>();
+    if (!output.writer->Open(output.file_name.c_str(), kExtractChunkSize, kExtractMaxQueuedChunks)) {
+        fprintf(stderr, "Could not open output file '%s'\n", output.file_name.c_str());
+        return false;
+    }
+
+    if (format.bsf) {
+        const AVBitStreamFilter *bs_filter = av_bsf_get_by_name(format.bsf);
+        if (bs_filter == nullptr) {
+            fprintf(stderr, "Could not find %s bitstream filter\n", format.bsf);
+            return false;
+        }
+        if ((error_code = av_bsf_alloc(bs_filter, &output.bsf_ctx)) < 0) {
+            fprintf(stderr, "Could not allocate bitstream filter context: %s\n", ErrorToString(error_code));
+            return false;
+        }
+        output.bsf_ctx->time_base_in = stream->time_base;
+        if ((error_code = avcodec_parameters_copy(output.bsf_ctx->par_in, stream->codecpar)) < 0 ||
+            (error_code = av_bsf_init(output.bsf_ctx)) < 0) {
+            fprintf(stderr, "Could not initialize bitstream filter context: %s\n", ErrorToString(error_code));
+            return false;
+        }
+        return true;
+    }
+
+    if ((error_code = avformat_alloc_output_context2(&output.mux_ctx, nullptr, format.muxer,
+                                                     output.file_name.c_str())) < 0) {
+        fprintf(stderr, "Could not allocate %s muxer: %s\n", format.muxer, ErrorToString(error_code));
+        return false;
+    }
+    AVStream *out_stream = avformat_new_stream(output.mux_ctx, nullptr);
+    if (out_stream == nullptr) {
+        fprintf(stderr, "Could not allocate output stream\n");
+        return false;
+    }
+    if ((error_code = avcodec_parameters_copy(out_stream->codecpar, stream->codecpar)) < 0) {
+        fprintf(stderr, "Could not copy codec parameters: %s\n", ErrorToString(error_code));
+        return false;
+    }
+    out_stream->codecpar->codec_tag = 0;
+    out_stream->time_base = stream->time_base;
+
+    auto *io_buffer = static_cast<uint8_t *>(av_malloc(kExtractIOBufferSize));
+    if (io_buffer == nullptr) {
+        fprintf(stderr, "Could not allocate AVIO buffer\n");
+        return false;
+    }
+    output.mux_ctx->pb = avio_alloc_context(io_buffer, kExtractIOBufferSize, 1, output.writer.get(), nullptr,
+                                            &ChunkFileWriter::WritePacket, nullptr);
+    if (output.mux_ctx->pb == nullptr) {
+        fprintf(stderr, "Could not allocate AVIOContext\n");
+        av_free(io_buffer);
+        return false;
+    }
+    output.mux_ctx->flags |= AVFMT_FLAG_CUSTOM_IO;
+    if ((error_code = avformat_write_header(output.mux_ctx, nullptr)) < 0) {
+        fprintf(stderr, "Could not write %s header: %s\n", format.muxer, ErrorToString(error_code));
+        return false;
+    }
+    return true;
+}
+
+// write one demuxed packet, pkt is unreferenced. flush drains the bitstream filter instead, pkt is then only
+// used to receive the filtered packets
+static bool WriteExtractPacket(ExtractOutput &output, const AVStream *stream, AVPacket *pkt, bool flush) {
+    int error_code{};
+    if (output.mux_ctx) {
+        if (flush) {
+            return true;
+        }
+        AVStream *out_stream = output.mux_ctx->streams[0];
+        pkt->stream_index = 0;
+        pkt->pos = -1;
+        av_packet_rescale_ts(pkt, stream->time_base, out_stream->time_base);
+        error_code = av_write_frame(output.mux_ctx, pkt);
+        av_packet_unref(pkt);
+        if (error_code < 0) {
+            fprintf(stderr, "Could not write packet to %s: %s\n", output.file_name.c_str(), ErrorToString(error_code));
+            return false;
+        }
+        output.packets++;
+        return true;
+    }
+
+    if ((error_code = av_bsf_send_packet(output.bsf_ctx, flush ? nullptr : pkt)) < 0) {
+        fprintf(stderr, "Could not send packet to bitstream filter: %s\n", ErrorToString(error_code));
+        av_packet_unref(pkt);
+        return false;
+    }
+    while ((error_code = av_bsf_receive_packet(output.bsf_ctx, pkt)) == 0) {
+        const bool written = output.writer->Write(pkt->data, pkt->size);
+        av_packet_unref(pkt);
+        if (!written) {
+            fprintf(stderr, "Could not write %s\n", output.file_name.c_str());
+            return false;
+        }
+        output.packets++;
+    }
+    if (error_code != AVERROR(EAGAIN) && error_code != AVERROR_EOF) {
+        fprintf(stderr, "Could not receive packet from bitstream filter: %s\n", ErrorToString(error_code));
+        return false;
+    }
+    return true;
+}
+
+// Extract the selected streams (all supported ones if streams is empty) of input_file in a single demux pass,
+// each to <output_prefix>.<stream_index>.<extension>
+bool ExtractElementaryStreams(const char *input_file, const char *output_prefix, const std::vector<int> &streams) {
+    int error_code{};
+
+    // open input_file
+    AVFormatContext *fmt_ctx = nullptr;
+    if ((error_code = avformat_open_input(&fmt_ctx, input_file, nullptr, nullptr)) < 0) {
+        fprintf(stderr, "Could not open source file '%s': %s\n", input_file, ErrorToString(error_code));
+        return false;
+    }
+    if ((error_code = avformat_find_stream_info(fmt_ctx, nullptr)) < 0) {
+        fprintf(stderr, "Could not find stream information: %s\n", ErrorToString(error_code));
+        avformat_close_input(&fmt_ctx);
+        return false;
+    }
+
+    // one output per selected stream, output_of maps a stream index to its output
+    std::vector<ExtractOutput> outputs;
+    std::vector<int> output_of(fmt_ctx->nb_streams, -1);
+    outputs.reserve(fmt_ctx->nb_streams);
+    bool success = true;
+    for (unsigned int i = 0; i < fmt_ctx->nb_streams && success; ++i) {
+        const int index = static_cast<int>(i);
+        if (!streams.empty() && std::find(streams.begin(), streams.end(), index) == streams.end()) {
+            continue;
+        }
+        const AVStream *stream = fmt_ctx->streams[i];
+        const auto format = std::find_if(std::begin(kElementaryFormats), std::end(kElementaryFormats),
+                                         [stream](const ElementaryFormat &f) -> bool {
+                                             return f.codec_id == stream->codecpar->codec_id;
+                                         });
+        if (format == std::end(kElementaryFormats)) {
+            printf("Skip stream %d: no elementary format for %s\n", index,
+                   avcodec_get_name(stream->codecpar->codec_id));
+            continue;
+        }
+        ExtractOutput &output = outputs.emplace_back();
+        output.stream_index = index;
+        output.file_name = std::string(output_prefix) + "." + std::to_string(index) + "." + format->extension;
+        output_of[i] = static_cast<int>(outputs.size() - 1);
+        success = OpenExtractOutput(stream, *format, output);
+    }
+    if (success && outputs.empty()) {
+        fprintf(stderr, "No stream to extract\n");
+        success = false;
     }
 
     // allocate AVPacket
-    AVPacket *pkt = nullptr;
-    if ((pkt = av_packet_alloc()) == nullptr) {
+    AVPacket *pkt = av_packet_alloc();
+    if (success && pkt == nullptr) {
         fprintf(stderr, "Could not allocate AVPacket: av_packet_alloc()\n");
-        avformat_close_input(&fmt_ctx);
-        return;
+        success = false;
+    }
+
+    // single demux pass, packets of unselected streams are dropped right away
+    const auto start = std::chrono::steady_clock::now();
+    while (success) {
+        if ((error_code = av_read_frame(fmt_ctx, pkt)) < 0) {
+            if (error_code != AVERROR_EOF) {
+                fprintf(stderr, "Could not read frame: %s\n", ErrorToString(error_code));
+                success = false;
+            }
+            break;
+        }
+        // demuxers with AVFMTCTX_NOHEADER (mpegts, flv) may add streams after output_of was sized
+        const int output_index = static_cast<std::size_t>(pkt->stream_index) < output_of.size()
+                                     ? output_of[pkt->stream_index]
+                                     : -1;
+        if (output_index < 0) {
+            av_packet_unref(pkt);
+            continue;
+        }
+        success = WriteExtractPacket(outputs[output_index], fmt_ctx->streams[pkt->stream_index], pkt, false);
     }
 
-    InnerExtractVideoStreamAnnexB(fmt_ctx, pkt, ofs);
+    // flush the bitstream filters and muxers, wait for the writer threads
+    int64_t total_bytes = 0;
+    for (ExtractOutput &output: outputs) {
+        const AVStream *stream = fmt_ctx->streams[output.stream_index];
+        if (success && pkt && !WriteExtractPacket(output, stream, pkt, true)) {
+            success = false;
+        }
+        if (success && output.mux_ctx && (error_code = av_write_trailer(output.mux_ctx)) < 0) {
+            fprintf(stderr, "Could not write trailer: %s\n", ErrorToString(error_code));
+            success = false;
+        }
+        if (output.mux_ctx && output.mux_ctx->pb) {
+            avio_flush(output.mux_ctx->pb);
+        }
+        if (output.writer && !output.writer->Close()) {
+            fprintf(stderr, "Could not write %s\n", output.file_name.c_str());
+            success = false;
+        }
+        if (output.writer) {
+            total_bytes += output.writer->BytesWritten();
+            printf("Stream %d (%s): %lld packets, %.1f MB -> %s\n", output.stream_index,
+                   avcodec_get_name(stream->codecpar->codec_id), output.packets, output.writer->BytesWritten() / 1e6,
+                   output.file_name.c_str());
+        }
+        CloseExtractOutput(output);
+    }
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf("Extracted %zu streams in one pass: %.1f MB in %.3f s (%.1f MB/s)\n", outputs.size(), total_bytes / 1e6,
+           seconds, total_bytes / 1e6 / seconds);
 
-    ofs.close();
     av_packet_free(&pkt);
     avformat_close_input(&fmt_ctx);
+    return success;
 }
 
-int main() {
-    ExtractVideoStreamAnnexB("../../../../yuv420p_640x360_25fps.mp4", "../../../../yuv420p_640x360_25fps.h264");
-    return 0;
+int main(int argc, char *argv[]) {
+    // ffmpeg -i yuv420p_640x360_25fps.mp4 -an -c:v copy yuv420p_640x360_25fps.h264
+    // ffplay -pixel_format yuv420p -video_size 640x360 -framerate 25 yuv420p_640x360_25fps.yuv
+    const char *input_file = "../../../../yuv420p_640x360_25fps.h264";
+    const char *output_file = "../../../../yuv420p_640x360_25fps.yuv";
+
+    // usage: ffmpeg_decode_video [--threads <n>] [--thread-type <frame|slice|both>] [--benchmark [max_threads]]
+    //                            [--no-mmap] [--splitter <parser|annexb>] [--benchmark-splitter]
+    //                            [--gop-parallel <workers>] [--benchmark-gop [max_workers]]
+    //                            [--thumbnails <sheet.jpg|sheet.png|thumb_%04d.jpg>] [--interval <seconds>]
+    //                            [--thumb-width <pixels>] [--columns <n>] [--benchmark-thumbnails]
+    //                            [--hash <hash_file>] [--huge-pages] [--benchmark-huge-pages]
+    //                            [--extract <output_prefix> [--streams <i,j,...>]]
+    //                            [input_file [output_file]], input_file is raw .h264 or any container
+    //                            libavformat can open
+    DecodeOptions options;
+    int benchmark_threads = 0;
+    bool benchmark_splitter = false;
+    int gop_workers = 0;
+    int benchmark_gop_workers = 0;
+    ThumbnailOptions thumbnail_options;
+    const char *thumbnail_output = nullptr;
+    bool benchmark_thumbnails = false;
+    bool benchmark_huge_pages = false;
+    const char *extract_prefix = nullptr;
+    std::vector<int> extract_streams;
+    std::vector<const char *> files;
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        if (arg == "--threads" && i + 1 < argc) {
+            options.thread_count = std::max(std::atoi(argv[++i]), 0);
+        } else if (arg == "--thread-type" && i + 1 < argc) {
+            const std::string type = argv[++i];
+            options.thread_type = type == "frame" ? FF_THREAD_FRAME
+                                  : type == "slice" ? FF_THREAD_SLICE
+                                  : FF_THREAD_FRAME | FF_THREAD_SLICE;
+        } else if (arg == "--hash" && i + 1 < argc) {
+            options.hash_file = argv[++i];
+        } else if (arg == "--extract" && i + 1 < argc) {
+            extract_prefix = argv[++i];
+        } else if (arg == "--streams" && i + 1 < argc) {
+            for (const char *p = argv[++i]; *p; ++p) {
+                if (p == argv[i] || p[-1] == ',') {
+                    extract_streams.push_back(std::atoi(p));
+                }
+            }
+        } else if (arg == "--huge-pages") {
+            options.huge_page_buffers = true;
+        } else if (arg == "--benchmark-huge-pages") {
+            benchmark_huge_pages = true;
+        } else if (arg == "--no-mmap") {
+            options.mmap_input = false;
+        } else if (arg == "--splitter" && i + 1 < argc) {
+            options.annexb_splitter = std::string(argv[++i]) == "annexb";
+        } else if (arg == "--benchmark-splitter") {
+            benchmark_splitter = true;
+        } else if (arg == "--thumbnails" && i + 1 < argc) {
+            thumbnail_output = argv[++i];
+        } else if (arg == "--interval" && i + 1 < argc) {
+            thumbnail_options.interval = std::max(std::atof(argv[++i]), 0.0);
+        } else if (arg == "--thumb-width" && i + 1 < argc) {
+            thumbnail_options.width = std::max(std::atoi(argv[++i]), 2);
+        } else if (arg == "--columns" && i + 1 < argc) {
+            thumbnail_options.columns = std::max(std::atoi(argv[++i]), 0);
+        } else if (arg == "--benchmark-thumbnails") {
+            benchmark_thumbnails = true;
+        } else if (arg == "--gop-parallel" && i + 1 < argc) {
+            gop_workers = std::max(std::atoi(argv[++i]), 1);
+        } else if (arg == "--benchmark-gop") {
+            benchmark_gop_workers = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+            if (i + 1 < argc && std::atoi(argv[i + 1]) > 0) {
+                benchmark_gop_workers = std::atoi(argv[++i]);
+            }
+        } else if (arg == "--benchmark") {
+            benchmark_threads = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+            if (i + 1 < argc && std::atoi(argv[i + 1]) > 0) {
+                benchmark_threads = std::atoi(argv[++i]);
+            }
+        } else {
+            files.push_back(argv[i]);
+        }
+    }
+    if (!files.empty()) {
+        input_file = files[0];
+    }
+    if (files.size() > 1) {
+        output_file = files[1];
+    }
+
+    if (extract_prefix) {
+        // ffmpeg_decode_video --extract ../../../../yuv420p_640x360_25fps ../../../../yuv420p_640x360_25fps.mp4
+        if (files.empty()) {
+            input_file = "../../../../yuv420p_640x360_25fps.mp4";
+        }
+        return ExtractElementaryStreams(input_file, extract_prefix, extract_streams) ? 0 : 1;
+    }
+    if (benchmark_splitter) {
+        return BenchmarkSplitters(input_file) ? 0 : 1;
+    }
+    if (benchmark_thumbnails) {
+        return BenchmarkThumbnails(input_file, thumbnail_options) ? 0 : 1;
+    }
+    if (thumbnail_output) {
+        DecodeStats stats;
+        return GenerateThumbnails(input_file, thumbnail_output, thumbnail_options, stats) ? 0 : 1;
+    }
+    if (benchmark_gop_workers > 0) {
+        return BenchmarkGopParallel(input_file, benchmark_gop_workers) ? 0 : 1;
+    }
+    if (gop_workers > 0) {
+        DecodeStats stats;
+        return DecodeVideoGopParallel(input_file, output_file, gop_workers, stats) ? 0 : 1;
+    }
+    if (benchmark_huge_pages) {
+        return BenchmarkHugePages(input_file, options) ? 0 : 1;
+    }
+    if (benchmark_threads > 0) {
+        return BenchmarkDecodeVideo(input_file, benchmark_threads, options) ? 0 : 1;
+    }
+    // verification decodes write only the hash list, no yuv file
+    DecodeStats stats;
+    return DecodeVideo(input_file, options.hash_file ? nullptr : output_file, options, stats) ? 0 : 1;
 }
 #endif
+
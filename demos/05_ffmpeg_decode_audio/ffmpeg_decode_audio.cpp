@@ -1,12 +1,107 @@
 extern "C" {
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
+#include <libavutil/samplefmt.h>
+#include <libavutil/channel_layout.h>
+#include <libswresample/swresample.h>
 }
 
+#include <cmath>
+#include <cerrno>
+#include <deque>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstring>
 #include <fstream>
+#include <algorithm>
+#include <type_traits>
+#include <condition_variable>
+
+#ifdef _WIN32
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "audio_interleave.h"
+#include "mapped_file.h"
+
+// Count heap allocations for --benchmark-codecs. With glibc, malloc and friends defined in the executable take
+// the place of the libc ones in every shared library as well, FFmpeg's av_malloc (posix_memalign) included.
+// The counter is per thread: a decoder with thread_count 1 allocates on the thread that drives it, so every run
+// counts only its own allocations, and the concurrent decoders of the all-cores run do not share a cache line
+#if defined(__GLIBC__) && !defined(AUDIO_NO_ALLOCATION_COUNTER)
+#define AUDIO_ALLOCATION_COUNTER 1
+static thread_local int64_t allocation_count = 0;
+
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void *__libc_memalign(size_t alignment, size_t size);
+
+void *malloc(size_t size) noexcept {
+    allocation_count++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) noexcept {
+    allocation_count++;
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) noexcept {
+    allocation_count++;
+    return __libc_realloc(ptr, size);
+}
+
+int posix_memalign(void **ptr, size_t alignment, size_t size) noexcept {
+    allocation_count++;
+    *ptr = __libc_memalign(alignment, size);
+    return *ptr ? 0 : ENOMEM;
+}
+
+void *aligned_alloc(size_t alignment, size_t size) noexcept {
+    allocation_count++;
+    return __libc_memalign(alignment, size);
+}
+}
+#endif
 
 static constexpr std::size_t kInputAudioBufferSize = 20480;
 static constexpr int kInputAudioBufferRefillThreshold = 4096;
+static constexpr int kAdtsHeaderSize = 7; // 9 with CRC, aac_frame_length always includes the header
+static constexpr uint32_t kAdtsMaxFrameSize = 0x1FFF; // aac_frame_length is 13 bits
+static constexpr std::size_t kSeekPrerollFrames = 1; // decoded and dropped, the MDCT overlap needs the previous frame
+static constexpr std::size_t kSinkQueueCapacity = 32; // frames a sink may lag behind before the decoder blocks
+static constexpr int kTruePeakOversampling = 4; // BS.1770-4 Annex 2
+static constexpr int kTruePeakTaps = 12; // per polyphase branch, 48-tap interpolation filter
+static constexpr int kSyntheticSampleRate = 48000;
+static constexpr int kSyntheticChannels = 2;
+static constexpr int kSyntheticSeconds = 10;
+static constexpr double kCodecBenchmarkSeconds = 1.0; // minimum decoding time of every measurement
+
+struct DecodeOptions {
+    bool adts_splitter = false; // split the mapped .aac file with AdtsIndex instead of av_parser_parse2
+    double start_seconds = 0.0; // > 0 seeks through the ADTS index, implies adts_splitter
+    const char *index_file = nullptr; // load the ADTS index from this file, or build and save it, implies adts_splitter
+    const char *wav_file = nullptr; // WavSink output
+    const char *resample_file = nullptr; // ResampleSink output, a wav file
+    int resample_rate = 16000;
+    int resample_channels = 1;
+    bool stats = false; // StatsSink
+    const char *loudness_file = nullptr; // LoudnessSink JSON report
+};
 thread_local static char error_buffer[AV_ERROR_MAX_STRING_SIZE] = {}; // store FFmpeg error string
 
 static char *ErrorToString(const int error_code) {
@@ -14,6 +109,1007 @@ static char *ErrorToString(const int error_code) {
     return av_make_error_string(error_buffer, AV_ERROR_MAX_STRING_SIZE, error_code);
 }
 
+struct AdtsHeader {
+    int frame_length = 0; // header included
+    int samples = 0; // 1024 per raw data block
+    int sample_rate = 0;
+    int channels = 0; // 0: described by a PCE in the raw data
+};
+
+// ADTS fixed + variable header:
+// syncword(12) id(1) layer(2) protection_absent(1) profile(2) sampling_frequency_index(4) private(1)
+// channel_configuration(3) original(1) home(1) copyright_id(2) aac_frame_length(13) buffer_fullness(11)
+// number_of_raw_data_blocks_in_frame(2)
+static bool ParseAdtsHeader(const uint8_t *p, std::size_t available, AdtsHeader &header) {
+    static constexpr int kSampleRates[] = {96000, 88200, 64000, 48000, 44100, 32000, 24000, 22050, 16000, 12000,
+                                           11025, 8000, 7350};
+    if (available < kAdtsHeaderSize || p[0] != 0xFF || (p[1] & 0xF6) != 0xF0) {
+        return false; // no syncword, or layer != 0
+    }
+    const int sample_rate_index = (p[2] >> 2) & 0x0F;
+    if (sample_rate_index >= static_cast<int>(std::size(kSampleRates))) {
+        return false;
+    }
+    header.frame_length = ((p[3] & 0x03) << 11) | (p[4] << 3) | (p[5] >> 5);
+    header.samples = 1024 * ((p[6] & 0x03) + 1);
+    header.sample_rate = kSampleRates[sample_rate_index];
+    header.channels = ((p[2] & 0x01) << 2) | (p[3] >> 6);
+    const int header_size = (p[1] & 0x01) ? kAdtsHeaderSize : kAdtsHeaderSize + 2;
+    return header.frame_length > header_size && static_cast<std::size_t>(header.frame_length) <= available;
+}
+
+// one index record, written to the index file as is
+struct AdtsFrame {
+    uint64_t offset = 0;
+    uint32_t size = 0;
+    uint32_t samples = 0;
+    int64_t first_sample = 0; // position of the frame's first sample in the stream
+};
+static_assert(sizeof(AdtsFrame) == 24);
+
+struct AdtsIndexHeader {
+    char magic[8] = {'A', 'D', 'T', 'S', 'I', 'D', 'X', '2'};
+    uint64_t file_size = 0; // an index only matches the file it was built from: same size and last write time
+    int64_t modified_time = 0;
+    uint32_t sample_rate = 0;
+    uint32_t channels = 0;
+    uint64_t frame_count = 0;
+};
+static_assert(sizeof(AdtsIndexHeader) == 40);
+
+// Frame offsets of an ADTS stream. Build walks the 7-byte headers by aac_frame_length and never touches the
+// payload; a header only counts when the next frame also starts with a valid header, otherwise the walk
+// resyncs byte by byte (skips an ID3 tag or garbage). Find maps a timestamp to a frame without any scanning
+class AdtsIndex {
+public:
+    bool Build(const uint8_t *data, std::size_t size) {
+        frames_.clear();
+        skipped_bytes_ = 0;
+        std::size_t pos = 0;
+        int64_t first_sample = 0;
+        AdtsHeader header;
+        AdtsHeader next;
+        while (pos + kAdtsHeaderSize <= size) {
+            const bool valid = ParseAdtsHeader(data + pos, size - pos, header);
+            const std::size_t next_pos = pos + header.frame_length;
+            const bool last = valid && size - next_pos < kAdtsHeaderSize; // allow a few trailing bytes
+            if (!valid || (!last && !ParseAdtsHeader(data + next_pos, size - next_pos, next))) {
+                pos++;
+                skipped_bytes_++;
+                continue;
+            }
+            if (frames_.empty()) {
+                sample_rate_ = header.sample_rate;
+                channels_ = header.channels;
+            }
+            frames_.push_back({pos, static_cast<uint32_t>(header.frame_length), static_cast<uint32_t>(header.samples),
+                               first_sample});
+            first_sample += header.samples;
+            pos = next_pos;
+        }
+        skipped_bytes_ += size - pos;
+        return !frames_.empty();
+    }
+
+    // The index file is not trusted: frame_count is bounded by the file size before anything is allocated, and
+    // every record must lie inside the file, follow the previous one and continue its sample count
+    bool Load(const char *file_name, std::size_t file_size, int64_t modified_time) {
+        std::ifstream ifs(file_name, std::ios::in | std::ios::binary);
+        AdtsIndexHeader header;
+        AdtsIndexHeader expected;
+        if (!ifs.read(reinterpret_cast<char *>(&header), sizeof(header)) ||
+            std::memcmp(header.magic, expected.magic, sizeof(header.magic)) != 0 || header.file_size != file_size ||
+            header.modified_time != modified_time || header.sample_rate == 0 ||
+            header.frame_count > file_size / (kAdtsHeaderSize + 1)) {
+            return false;
+        }
+        frames_.resize(header.frame_count);
+        if (!ifs.read(reinterpret_cast<char *>(frames_.data()),
+                      static_cast<std::streamsize>(frames_.size() * sizeof(AdtsFrame))) ||
+            !ValidFrames(file_size)) {
+            frames_.clear();
+            return false;
+        }
+        sample_rate_ = static_cast<int>(header.sample_rate);
+        channels_ = static_cast<int>(header.channels);
+        return !frames_.empty();
+    }
+
+    bool Save(const char *file_name, std::size_t file_size, int64_t modified_time) const {
+        std::ofstream ofs(file_name, std::ios::out | std::ios::binary);
+        AdtsIndexHeader header;
+        header.file_size = file_size;
+        header.modified_time = modified_time;
+        header.sample_rate = static_cast<uint32_t>(sample_rate_);
+        header.channels = static_cast<uint32_t>(channels_);
+        header.frame_count = frames_.size();
+        ofs.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        ofs.write(reinterpret_cast<const char *>(frames_.data()),
+                  static_cast<std::streamsize>(frames_.size() * sizeof(AdtsFrame)));
+        return static_cast<bool>(ofs);
+    }
+
+    // the frame that contains the sample at seconds, binary search over first_sample
+    std::size_t Find(double seconds) const {
+        const auto sample = static_cast<int64_t>(seconds * sample_rate_);
+        const auto it = std::upper_bound(frames_.begin(), frames_.end(), sample,
+                                         [](int64_t value, const AdtsFrame &frame) -> bool {
+                                             return value < frame.first_sample;
+                                         });
+        return it == frames_.begin() ? 0 : static_cast<std::size_t>(it - frames_.begin() - 1);
+    }
+
+    const std::vector<AdtsFrame> &Frames() const { return frames_; }
+
+    int SampleRate() const { return sample_rate_; }
+
+    int Channels() const { return channels_; }
+
+    std::size_t SkippedBytes() const { return skipped_bytes_; }
+
+private:
+    bool ValidFrames(std::size_t file_size) const {
+        uint64_t end = 0;
+        int64_t first_sample = 0;
+        for (const AdtsFrame &frame : frames_) {
+            if (frame.size <= kAdtsHeaderSize || frame.size > kAdtsMaxFrameSize || frame.samples == 0 ||
+                frame.offset < end || frame.size > file_size || frame.offset > file_size - frame.size ||
+                frame.first_sample != first_sample) {
+                return false;
+            }
+            end = frame.offset + frame.size;
+            first_sample += frame.samples;
+        }
+        return true;
+    }
+
+    std::vector<AdtsFrame> frames_;
+    int sample_rate_ = 0;
+    int channels_ = 0;
+    std::size_t skipped_bytes_ = 0;
+};
+
+// Streaming wav writer: the header is written up front with 0xFFFFFFFF sizes, which streaming readers accept,
+// and Close seeks back to fill in the real RIFF and data sizes
+class WavFile {
+public:
+    bool Open(const char *file_name) {
+        ofs_.open(file_name, std::ios::out | std::ios::binary);
+        return ofs_.is_open();
+    }
+
+    // sample_fmt must be packed, u8/s16/s32 are written as PCM, flt/dbl as IEEE float
+    bool WriteHeader(AVSampleFormat sample_fmt, int channels, int sample_rate) {
+        const int bytes_per_sample = av_get_bytes_per_sample(sample_fmt);
+        const bool is_float = sample_fmt == AV_SAMPLE_FMT_FLT || sample_fmt == AV_SAMPLE_FMT_DBL;
+        if (av_sample_fmt_is_planar(sample_fmt) || sample_fmt == AV_SAMPLE_FMT_S64 || bytes_per_sample <= 0) {
+            return false;
+        }
+        uint8_t header[44] = {};
+        auto put16 = [&header](int pos, uint32_t value) -> void {
+            header[pos] = static_cast<uint8_t>(value);
+            header[pos + 1] = static_cast<uint8_t>(value >> 8);
+        };
+        auto put32 = [&put16](int pos, uint32_t value) -> void {
+            put16(pos, value & 0xFFFF);
+            put16(pos + 2, value >> 16);
+        };
+        std::memcpy(header, "RIFF", 4);
+        put32(4, 0xFFFFFFFF);
+        std::memcpy(header + 8, "WAVEfmt ", 8);
+        put32(16, 16);
+        put16(20, is_float ? 3 : 1); // WAVE_FORMAT_IEEE_FLOAT or WAVE_FORMAT_PCM
+        put16(22, channels);
+        put32(24, sample_rate);
+        put32(28, sample_rate * channels * bytes_per_sample);
+        put16(32, channels * bytes_per_sample);
+        put16(34, bytes_per_sample * 8);
+        std::memcpy(header + 36, "data", 4);
+        put32(40, 0xFFFFFFFF);
+        ofs_.write(reinterpret_cast<const char *>(header), sizeof(header));
+        return static_cast<bool>(ofs_);
+    }
+
+    bool Write(const uint8_t *data, std::size_t size) {
+        data_bytes_ += size;
+        return static_cast<bool>(ofs_.write(reinterpret_cast<const char *>(data), static_cast<std::streamsize>(size)));
+    }
+
+    // sizes that do not fit in 32 bits keep the 0xFFFFFFFF placeholders
+    bool Close() {
+        if (!ofs_.is_open()) {
+            return true;
+        }
+        if (data_bytes_ + 36 <= 0xFFFFFFFFull) {
+            const uint32_t sizes[2] = {static_cast<uint32_t>(data_bytes_ + 36), static_cast<uint32_t>(data_bytes_)};
+            for (int i = 0; i < 2; ++i) {
+                const uint8_t bytes[4] = {static_cast<uint8_t>(sizes[i]), static_cast<uint8_t>(sizes[i] >> 8),
+                                          static_cast<uint8_t>(sizes[i] >> 16), static_cast<uint8_t>(sizes[i] >> 24)};
+                ofs_.seekp(i == 0 ? 4 : 40);
+                ofs_.write(reinterpret_cast<const char *>(bytes), sizeof(bytes));
+            }
+        }
+        ofs_.close();
+        return !ofs_.fail();
+    }
+
+    uint64_t DataBytes() const { return data_bytes_; }
+
+private:
+    std::ofstream ofs_;
+    uint64_t data_bytes_ = 0;
+};
+
+// A consumer of decoded frames, runs on its own SinkWorker thread. Consume gets a reference to a decoded frame,
+// which it must not modify, Close is called once after the last frame
+class AudioSink {
+public:
+    virtual ~AudioSink() = default;
+
+    virtual const char *Name() const = 0;
+
+    virtual bool Consume(const AVFrame *frame) = 0;
+
+    virtual bool Close() = 0;
+};
+
+// the decoded stream as wav, planar formats are interleaved with the kernels above
+class WavSink : public AudioSink {
+public:
+    bool Open(const char *file_name) { return wav_.Open(file_name); }
+
+    const char *Name() const override { return "wav"; }
+
+    bool Consume(const AVFrame *frame) override {
+        const auto sample_fmt = static_cast<AVSampleFormat>(frame->format);
+        const int channels = frame->ch_layout.nb_channels;
+        if (!header_written_) {
+            if (!wav_.WriteHeader(av_get_packed_sample_fmt(sample_fmt), channels, frame->sample_rate)) {
+                fprintf(stderr, "Unsupported wav sample format: %s\n", av_get_sample_fmt_name(sample_fmt));
+                return false;
+            }
+            header_written_ = true;
+        }
+        const std::size_t frame_bytes = static_cast<std::size_t>(frame->nb_samples) *
+                                        av_get_bytes_per_sample(sample_fmt) * channels;
+        const InterleaveFn interleave = GetInterleaveKernel(sample_fmt, channels);
+        if (interleave == nullptr) {
+            return wav_.Write(frame->data[0], frame_bytes);
+        }
+        if (buffer_.size() < frame_bytes) {
+            buffer_.resize(frame_bytes);
+        }
+        interleave(buffer_.data(), frame->extended_data, frame->nb_samples, channels);
+        return wav_.Write(buffer_.data(), frame_bytes);
+    }
+
+    bool Close() override {
+        printf("wav sink: %.1f MB\n", wav_.DataBytes() / 1e6);
+        return wav_.Close();
+    }
+
+private:
+    WavFile wav_;
+    bool header_written_ = false;
+    std::vector<uint8_t> buffer_;
+};
+
+// resample to s16 at sample_rate with channels channels (16 kHz mono for speech by default), written as wav.
+// The SwrContext is created from the first frame
+class ResampleSink : public AudioSink {
+public:
+    ~ResampleSink() override { swr_free(&swr_ctx_); }
+
+    bool Open(const char *file_name, int sample_rate, int channels) {
+        sample_rate_ = sample_rate;
+        av_channel_layout_default(&ch_layout_, channels);
+        return wav_.Open(file_name) && wav_.WriteHeader(AV_SAMPLE_FMT_S16, channels, sample_rate);
+    }
+
+    const char *Name() const override { return "resample"; }
+
+    bool Consume(const AVFrame *frame) override {
+        int error_code{};
+        if (swr_ctx_ == nullptr) {
+            if ((error_code = swr_alloc_set_opts2(&swr_ctx_, &ch_layout_, AV_SAMPLE_FMT_S16, sample_rate_,
+                                                  &frame->ch_layout, static_cast<AVSampleFormat>(frame->format),
+                                                  frame->sample_rate, 0, nullptr)) < 0 ||
+                (error_code = swr_init(swr_ctx_)) < 0) {
+                fprintf(stderr, "Failed to init SwrContext: %s\n", ErrorToString(error_code));
+                return false;
+            }
+        }
+        return Convert(const_cast<const uint8_t **>(frame->extended_data), frame->nb_samples);
+    }
+
+    // flush the samples buffered in the resampler
+    bool Close() override {
+        const bool flushed = swr_ctx_ == nullptr || Convert(nullptr, 0);
+        printf("resample sink: %d Hz %d channels, %.1f MB\n", sample_rate_, ch_layout_.nb_channels,
+               wav_.DataBytes() / 1e6);
+        return wav_.Close() && flushed;
+    }
+
+private:
+    bool Convert(const uint8_t **in, int in_samples) {
+        const int out_samples = swr_get_out_samples(swr_ctx_, in_samples);
+        if (out_samples <= 0) {
+            return true;
+        }
+        buffer_.resize(static_cast<std::size_t>(out_samples) * 2 * ch_layout_.nb_channels);
+        uint8_t *out[1] = {buffer_.data()};
+        const int converted = swr_convert(swr_ctx_, out, out_samples, in, in_samples);
+        if (converted < 0) {
+            fprintf(stderr, "Failed to resample: %s\n", ErrorToString(converted));
+            return false;
+        }
+        return wav_.Write(buffer_.data(), static_cast<std::size_t>(converted) * 2 * ch_layout_.nb_channels);
+    }
+
+    WavFile wav_;
+    SwrContext *swr_ctx_ = nullptr;
+    AVChannelLayout ch_layout_{};
+    int sample_rate_ = 0;
+    std::vector<uint8_t> buffer_;
+};
+
+// per channel peak, RMS, DC offset and full-scale sample count, integer formats are scaled to [-1, 1)
+class StatsSink : public AudioSink {
+public:
+    const char *Name() const override { return "stats"; }
+
+    bool Consume(const AVFrame *frame) override {
+        const auto sample_fmt = static_cast<AVSampleFormat>(frame->format);
+        const int channels = frame->ch_layout.nb_channels;
+        if (channels_.empty()) {
+            channels_.resize(channels);
+            sample_rate_ = frame->sample_rate;
+        }
+        if (static_cast<int>(channels_.size()) != channels) {
+            fprintf(stderr, "Channel count changed: %zu -> %d\n", channels_.size(), channels);
+            return false;
+        }
+        const bool planar = av_sample_fmt_is_planar(sample_fmt);
+        for (int c = 0; c < channels; ++c) {
+            const uint8_t *data = planar ? frame->extended_data[c] : frame->data[0];
+            const int stride = planar ? 1 : channels;
+            const int offset = planar ? 0 : c;
+            switch (av_get_packed_sample_fmt(sample_fmt)) {
+                case AV_SAMPLE_FMT_U8:
+                    Accumulate<uint8_t>(data, offset, stride, frame->nb_samples, 1.0 / 128, -128.0, channels_[c]);
+                    break;
+                case AV_SAMPLE_FMT_S16:
+                    Accumulate<int16_t>(data, offset, stride, frame->nb_samples, 1.0 / 32768, 0.0, channels_[c]);
+                    break;
+                case AV_SAMPLE_FMT_S32:
+                    Accumulate<int32_t>(data, offset, stride, frame->nb_samples, 1.0 / 2147483648.0, 0.0,
+                                        channels_[c]);
+                    break;
+                case AV_SAMPLE_FMT_FLT:
+                    Accumulate<float>(data, offset, stride, frame->nb_samples, 1.0, 0.0, channels_[c]);
+                    break;
+                case AV_SAMPLE_FMT_DBL:
+                    Accumulate<double>(data, offset, stride, frame->nb_samples, 1.0, 0.0, channels_[c]);
+                    break;
+                default:
+                    fprintf(stderr, "Unsupported stats sample format: %s\n", av_get_sample_fmt_name(sample_fmt));
+                    return false;
+            }
+        }
+        samples_ += frame->nb_samples;
+        return true;
+    }
+
+    bool Close() override {
+        printf("stats sink: %lld samples, %.3f s\n", samples_,
+               sample_rate_ > 0 ? static_cast<double>(samples_) / sample_rate_ : 0.0);
+        for (std::size_t c = 0; c < channels_.size(); ++c) {
+            const ChannelStats &stats = channels_[c];
+            const double n = std::max<double>(static_cast<double>(samples_), 1.0);
+            printf("  channel %zu: peak %.2f dBFS, rms %.2f dBFS, dc %.6f, %lld full-scale samples\n", c,
+                   20 * std::log10(std::max(stats.peak, 1e-10)),
+                   10 * std::log10(std::max(stats.sum_squares / n, 1e-20)), stats.sum / n, stats.full_scale);
+        }
+        return true;
+    }
+
+private:
+    struct ChannelStats {
+        double peak = 0.0;
+        double sum = 0.0;
+        double sum_squares = 0.0;
+        int64_t full_scale = 0;
+    };
+
+    template<typename T>
+    static void Accumulate(const uint8_t *data, int offset, int stride, int nb_samples, double scale, double bias,
+                           ChannelStats &stats) {
+        const auto *samples = reinterpret_cast<const T *>(data) + offset;
+        double peak = stats.peak;
+        double sum = 0.0;
+        double sum_squares = 0.0;
+        int64_t full_scale = 0;
+        // the largest positive integer sample is one step below 1.0, float samples clip at 1.0
+        const double full_scale_threshold = std::is_floating_point_v<T> ? 1.0 : 1.0 - scale;
+        for (int i = 0; i < nb_samples; ++i) {
+            const double value = (static_cast<double>(samples[i * stride]) + bias) * scale;
+            const double magnitude = std::fabs(value);
+            peak = std::max(peak, magnitude);
+            sum += value;
+            sum_squares += value * value;
+            full_scale += magnitude >= full_scale_threshold ? 1 : 0;
+        }
+        stats.peak = peak;
+        stats.sum += sum;
+        stats.sum_squares += sum_squares;
+        stats.full_scale += full_scale;
+    }
+
+    std::vector<ChannelStats> channels_;
+    int sample_rate_ = 0;
+    int64_t samples_ = 0;
+};
+
+// Two channels of double samples, the lanes of one SSE2 register. The loudness filters run on channel pairs,
+// their recurrences are serial in time, so the vector width goes across channels
+#ifdef AUDIO_SSE2
+using Pair = __m128d;
+
+static inline Pair PairLoad(const double *p) { return _mm_loadu_pd(p); }
+
+static inline void PairStore(double *p, Pair v) { _mm_storeu_pd(p, v); }
+
+static inline Pair PairSet(double v) { return _mm_set1_pd(v); }
+
+static inline Pair PairAdd(Pair a, Pair b) { return _mm_add_pd(a, b); }
+
+static inline Pair PairSub(Pair a, Pair b) { return _mm_sub_pd(a, b); }
+
+static inline Pair PairMul(Pair a, Pair b) { return _mm_mul_pd(a, b); }
+
+static inline Pair PairMax(Pair a, Pair b) { return _mm_max_pd(a, b); }
+
+static inline Pair PairAbs(Pair a) { return _mm_andnot_pd(_mm_set1_pd(-0.0), a); }
+#else
+struct Pair {
+    double v[2];
+};
+
+static inline Pair PairLoad(const double *p) { return {{p[0], p[1]}}; }
+
+static inline void PairStore(double *p, Pair v) {
+    p[0] = v.v[0];
+    p[1] = v.v[1];
+}
+
+static inline Pair PairSet(double v) { return {{v, v}}; }
+
+static inline Pair PairAdd(Pair a, Pair b) { return {{a.v[0] + b.v[0], a.v[1] + b.v[1]}}; }
+
+static inline Pair PairSub(Pair a, Pair b) { return {{a.v[0] - b.v[0], a.v[1] - b.v[1]}}; }
+
+static inline Pair PairMul(Pair a, Pair b) { return {{a.v[0] * b.v[0], a.v[1] * b.v[1]}}; }
+
+static inline Pair PairMax(Pair a, Pair b) { return {{std::max(a.v[0], b.v[0]), std::max(a.v[1], b.v[1])}}; }
+
+static inline Pair PairAbs(Pair a) { return {{std::fabs(a.v[0]), std::fabs(a.v[1])}}; }
+#endif
+
+struct Biquad {
+    double b0 = 1.0;
+    double b1 = 0.0;
+    double b2 = 0.0;
+    double a1 = 0.0;
+    double a2 = 0.0;
+};
+
+// BS.1770 K-weighting for any sample rate: a high shelf (the head) followed by the RLB high-pass, from the
+// analog prototypes the 48 kHz coefficients of the standard are derived from
+static void KWeightingFilters(double sample_rate, Biquad &shelf, Biquad &high_pass) {
+    constexpr double kPi = 3.14159265358979323846;
+    double f0 = 1681.974450955533;
+    double q = 0.7071752369554196;
+    double k = std::tan(kPi * f0 / sample_rate);
+    const double vh = std::pow(10.0, 3.999843853973347 / 20.0);
+    const double vb = std::pow(vh, 0.4996667741545416);
+    double a0 = 1.0 + k / q + k * k;
+    shelf.b0 = (vh + vb * k / q + k * k) / a0;
+    shelf.b1 = 2.0 * (k * k - vh) / a0;
+    shelf.b2 = (vh - vb * k / q + k * k) / a0;
+    shelf.a1 = 2.0 * (k * k - 1.0) / a0;
+    shelf.a2 = (1.0 - k / q + k * k) / a0;
+
+    f0 = 38.13547087602444;
+    q = 0.5003270373238773;
+    k = std::tan(kPi * f0 / sample_rate);
+    a0 = 1.0 + k / q + k * k;
+    high_pass.b0 = 1.0;
+    high_pass.b1 = -2.0;
+    high_pass.b2 = 1.0;
+    high_pass.a1 = 2.0 * (k * k - 1.0) / a0;
+    high_pass.a2 = (1.0 - k / q + k * k) / a0;
+}
+
+// BS.1770 channel weights: LFE is excluded, surround channels count 1.41 (+1.5 dB)
+static double LoudnessChannelWeight(const AVChannelLayout *ch_layout, int index) {
+    switch (av_channel_layout_channel_from_index(ch_layout, index)) {
+        case AV_CHAN_LOW_FREQUENCY:
+        case AV_CHAN_LOW_FREQUENCY_2:
+            return 0.0;
+        case AV_CHAN_BACK_LEFT:
+        case AV_CHAN_BACK_RIGHT:
+        case AV_CHAN_SIDE_LEFT:
+        case AV_CHAN_SIDE_RIGHT:
+        case AV_CHAN_SIDE_SURROUND_LEFT:
+        case AV_CHAN_SIDE_SURROUND_RIGHT:
+            return 1.41;
+        default:
+            return 1.0;
+    }
+}
+
+// EBU R128 measurement in the decode pass: integrated loudness (400 ms blocks, 75 % overlap, -70 LUFS absolute
+// and -10 LU relative gates), loudness range (3 s short-term loudness every 100 ms, -20 LU relative gate,
+// 10th to 95th percentile) and true peak from a 4x polyphase interpolator. Both filters and the interpolator
+// process two channels per SSE2 register. Only 100 ms sub-block energies are kept, every measure is derived
+// from them at Close, which writes a JSON report
+class LoudnessSink : public AudioSink {
+public:
+    bool Open(const char *report_file) {
+        report_file_ = report_file;
+        std::ofstream ofs(report_file, std::ios::out | std::ios::binary); // fail before decoding, not after
+        return ofs.is_open();
+    }
+
+    const char *Name() const override { return "loudness"; }
+
+    bool Consume(const AVFrame *frame) override {
+        const auto start = std::chrono::steady_clock::now();
+        if (pairs_.empty() && !Init(frame)) {
+            return false;
+        }
+        if (frame->ch_layout.nb_channels != channels_ || frame->sample_rate != sample_rate_) {
+            fprintf(stderr, "Loudness input changed: %d channels %d Hz\n", frame->ch_layout.nb_channels,
+                    frame->sample_rate);
+            return false;
+        }
+        if (!Convert(frame)) {
+            return false;
+        }
+
+        // process up to the next 100 ms boundary at a time, all pairs share the sub-block position
+        const int nb_samples = frame->nb_samples;
+        for (int i = 0; i < nb_samples;) {
+            const int chunk = std::min(nb_samples - i, sub_block_size_ - sub_block_fill_);
+            for (PairState &pair: pairs_) {
+                Process(pair, i, chunk);
+            }
+            i += chunk;
+            sub_block_fill_ += chunk;
+            if (sub_block_fill_ == sub_block_size_) {
+                double energy = 0.0;
+                for (int c = 0; c < channels_; ++c) {
+                    energy += weights_[c] * pairs_[c / 2].sum_squares[c % 2] / sub_block_size_;
+                }
+                sub_blocks_.push_back(energy);
+                for (PairState &pair: pairs_) {
+                    pair.sum_squares[0] = pair.sum_squares[1] = 0.0;
+                }
+                sub_block_fill_ = 0;
+            }
+        }
+
+        // keep the last kTruePeakTaps - 1 input samples as the interpolator history of the next frame
+        for (PairState &pair: pairs_) {
+            std::memmove(pair.input.data(), pair.input.data() + 2 * nb_samples,
+                         2 * (kTruePeakTaps - 1) * sizeof(double));
+        }
+        samples_ += nb_samples;
+        analysis_seconds_ += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        return true;
+    }
+
+    bool Close() override {
+        const double integrated = IntegratedLoudness();
+        const double range = LoudnessRange();
+        double true_peak = 0.0;
+        double sample_peak = 0.0;
+        for (int c = 0; c < channels_; ++c) {
+            // the last kTruePeakTaps / 2 samples never reach the delayed pass-through branch
+            PairState &pair = pairs_[c / 2];
+            pair.true_peak[c % 2] = std::max(pair.true_peak[c % 2], pair.sample_peak[c % 2]);
+            true_peak = std::max(true_peak, pair.true_peak[c % 2]);
+            sample_peak = std::max(sample_peak, pair.sample_peak[c % 2]);
+        }
+        const double duration = sample_rate_ > 0 ? static_cast<double>(samples_) / sample_rate_ : 0.0;
+
+        // JSON has no -inf, silence is reported as null
+        auto number = [](double value, const char *format) -> std::string {
+            if (!std::isfinite(value)) {
+                return "null";
+            }
+            char text[32] = {};
+            std::snprintf(text, sizeof(text), format, value);
+            return text;
+        };
+        auto decibels = [](double linear) -> double { return 20.0 * std::log10(linear); };
+        std::string json = "{\n";
+        json += "  \"integrated_lufs\": " + number(integrated, "%.2f") + ",\n";
+        json += "  \"loudness_range_lu\": " + number(range, "%.2f") + ",\n";
+        json += "  \"true_peak_dbtp\": " + number(decibels(true_peak), "%.2f") + ",\n";
+        json += "  \"sample_peak_dbfs\": " + number(decibels(sample_peak), "%.2f") + ",\n";
+        json += "  \"channels\": [";
+        for (int c = 0; c < channels_; ++c) {
+            json += std::string(c ? ", " : "") + "{\"weight\": " + number(weights_[c], "%.2f") +
+                    ", \"true_peak_dbtp\": " + number(decibels(pairs_[c / 2].true_peak[c % 2]), "%.2f") +
+                    ", \"sample_peak_dbfs\": " + number(decibels(pairs_[c / 2].sample_peak[c % 2]), "%.2f") + "}";
+        }
+        json += "],\n";
+        json += "  \"sample_rate\": " + std::to_string(sample_rate_) + ",\n";
+        json += "  \"duration_seconds\": " + number(duration, "%.3f") + ",\n";
+        json += "  \"analysis_seconds\": " + number(analysis_seconds_, "%.3f") + "\n";
+        json += "}\n";
+
+        std::ofstream ofs(report_file_, std::ios::out | std::ios::binary);
+        ofs.write(json.data(), static_cast<std::streamsize>(json.size()));
+        printf("loudness sink: I %s LUFS, LRA %s LU, TP %s dBTP, analysis %.1fx realtime -> %s\n",
+               number(integrated, "%.1f").c_str(), number(range, "%.1f").c_str(),
+               number(decibels(true_peak), "%.1f").c_str(), duration / std::max(analysis_seconds_, 1e-9),
+               report_file_);
+        return static_cast<bool>(ofs);
+    }
+
+private:
+    // two channels, the input is stored interleaved per pair (c0 c1 c0 c1 ...) after kTruePeakTaps - 1
+    // samples of history
+    struct PairState {
+        std::vector<double> input;
+        double shelf_state[2][2] = {}; // transposed direct form II, [state][lane]
+        double high_pass_state[2][2] = {};
+        double sum_squares[2] = {};
+        double sample_peak[2] = {};
+        double true_peak[2] = {};
+    };
+
+    bool Init(const AVFrame *frame) {
+        channels_ = frame->ch_layout.nb_channels;
+        sample_rate_ = frame->sample_rate;
+        if (channels_ <= 0 || sample_rate_ < 100) {
+            fprintf(stderr, "Unsupported loudness input: %d channels %d Hz\n", channels_, sample_rate_);
+            return false;
+        }
+        sub_block_size_ = sample_rate_ / 10;
+        pairs_.resize((channels_ + 1) / 2);
+        weights_.resize(channels_);
+        for (int c = 0; c < channels_; ++c) {
+            weights_[c] = LoudnessChannelWeight(&frame->ch_layout, c);
+        }
+        KWeightingFilters(sample_rate_, shelf_, high_pass_);
+
+        // windowed sinc low-pass at the original Nyquist frequency, split into kTruePeakOversampling branches.
+        // The filter is centred on tap kLength / 2, a multiple of kTruePeakOversampling, so branch 0 hits the
+        // zeros of the sinc everywhere but the centre: it is a pure delay of kTruePeakTaps / 2 input samples and
+        // passes the original samples through, the true peak can never come out below the sample peak
+        constexpr double kPi = 3.14159265358979323846;
+        constexpr int kLength = kTruePeakOversampling * kTruePeakTaps;
+        const double cutoff = 0.5 / kTruePeakOversampling; // cycles per oversampled sample
+        for (int m = 0; m < kLength; ++m) {
+            const int x = m - kLength / 2;
+            double tap = x == 0 ? 1.0 : 0.0;
+            if (x % kTruePeakOversampling != 0) {
+                const double sinc = std::sin(2.0 * kPi * cutoff * x) / (kPi * x);
+                const double window = 0.42 + 0.5 * std::cos(2.0 * kPi * x / kLength) +
+                                      0.08 * std::cos(4.0 * kPi * x / kLength); // Blackman
+                tap = sinc * window * kTruePeakOversampling;
+            }
+            interpolator_[m % kTruePeakOversampling][m / kTruePeakOversampling] = tap;
+        }
+        return true;
+    }
+
+    // convert one frame of any sample format to doubles in [-1, 1), behind the history of every pair
+    bool Convert(const AVFrame *frame) {
+        const auto sample_fmt = static_cast<AVSampleFormat>(frame->format);
+        const bool planar = av_sample_fmt_is_planar(sample_fmt);
+        const std::size_t size = 2 * static_cast<std::size_t>(kTruePeakTaps - 1 + frame->nb_samples);
+        for (PairState &pair: pairs_) {
+            if (pair.input.size() < size) {
+                pair.input.resize(size, 0.0); // the lane of a missing odd channel stays 0
+            }
+        }
+        for (int c = 0; c < channels_; ++c) {
+            const uint8_t *data = planar ? frame->extended_data[c] : frame->data[0];
+            const int stride = planar ? 1 : channels_;
+            const int offset = planar ? 0 : c;
+            double *dst = pairs_[c / 2].input.data() + 2 * (kTruePeakTaps - 1) + c % 2;
+            switch (av_get_packed_sample_fmt(sample_fmt)) {
+                case AV_SAMPLE_FMT_U8:
+                    ConvertChannel<uint8_t>(data, offset, stride, frame->nb_samples, 1.0 / 128, -128.0, dst);
+                    break;
+                case AV_SAMPLE_FMT_S16:
+                    ConvertChannel<int16_t>(data, offset, stride, frame->nb_samples, 1.0 / 32768, 0.0, dst);
+                    break;
+                case AV_SAMPLE_FMT_S32:
+                    ConvertChannel<int32_t>(data, offset, stride, frame->nb_samples, 1.0 / 2147483648.0, 0.0, dst);
+                    break;
+                case AV_SAMPLE_FMT_FLT:
+                    ConvertChannel<float>(data, offset, stride, frame->nb_samples, 1.0, 0.0, dst);
+                    break;
+                case AV_SAMPLE_FMT_DBL:
+                    ConvertChannel<double>(data, offset, stride, frame->nb_samples, 1.0, 0.0, dst);
+                    break;
+                default:
+                    fprintf(stderr, "Unsupported loudness sample format: %s\n", av_get_sample_fmt_name(sample_fmt));
+                    return false;
+            }
+        }
+        return true;
+    }
+
+    template<typename T>
+    static void ConvertChannel(const uint8_t *data, int offset, int stride, int nb_samples, double scale,
+                               double bias, double *dst) {
+        const auto *samples = reinterpret_cast<const T *>(data) + offset;
+        for (int i = 0; i < nb_samples; ++i) {
+            dst[2 * i] = (static_cast<double>(samples[i * stride]) + bias) * scale;
+        }
+    }
+
+    // K-weighting, energy, sample peak and true peak of samples [begin, begin + count) of one pair
+    void Process(PairState &pair, int begin, int count) {
+        const Pair sb0 = PairSet(shelf_.b0), sb1 = PairSet(shelf_.b1), sb2 = PairSet(shelf_.b2);
+        const Pair sa1 = PairSet(shelf_.a1), sa2 = PairSet(shelf_.a2);
+        const Pair hb0 = PairSet(high_pass_.b0), hb1 = PairSet(high_pass_.b1), hb2 = PairSet(high_pass_.b2);
+        const Pair ha1 = PairSet(high_pass_.a1), ha2 = PairSet(high_pass_.a2);
+        Pair s1 = PairLoad(pair.shelf_state[0]);
+        Pair s2 = PairLoad(pair.shelf_state[1]);
+        Pair h1 = PairLoad(pair.high_pass_state[0]);
+        Pair h2 = PairLoad(pair.high_pass_state[1]);
+        Pair sum_squares = PairLoad(pair.sum_squares);
+        Pair sample_peak = PairLoad(pair.sample_peak);
+        Pair true_peak = PairLoad(pair.true_peak);
+
+        Pair taps[kTruePeakOversampling][kTruePeakTaps];
+        for (int k = 0; k < kTruePeakOversampling; ++k) {
+            for (int t = 0; t < kTruePeakTaps; ++t) {
+                taps[k][t] = PairSet(interpolator_[k][t]);
+            }
+        }
+
+        const double *input = pair.input.data() + 2 * (kTruePeakTaps - 1);
+        for (int i = begin; i < begin + count; ++i) {
+            const Pair x = PairLoad(input + 2 * i);
+            const Pair y = PairAdd(PairMul(sb0, x), s1);
+            s1 = PairSub(PairAdd(PairMul(sb1, x), s2), PairMul(sa1, y));
+            s2 = PairSub(PairMul(sb2, x), PairMul(sa2, y));
+            const Pair z = PairAdd(PairMul(hb0, y), h1);
+            h1 = PairSub(PairAdd(PairMul(hb1, y), h2), PairMul(ha1, z));
+            h2 = PairSub(PairMul(hb2, y), PairMul(ha2, z));
+            sum_squares = PairAdd(sum_squares, PairMul(z, z));
+            sample_peak = PairMax(sample_peak, PairAbs(x));
+
+            for (int k = 0; k < kTruePeakOversampling; ++k) {
+                Pair acc = PairSet(0.0);
+                for (int t = 0; t < kTruePeakTaps; ++t) {
+                    acc = PairAdd(acc, PairMul(taps[k][t], PairLoad(input + 2 * (i - t))));
+                }
+                true_peak = PairMax(true_peak, PairAbs(acc));
+            }
+        }
+
+        PairStore(pair.shelf_state[0], s1);
+        PairStore(pair.shelf_state[1], s2);
+        PairStore(pair.high_pass_state[0], h1);
+        PairStore(pair.high_pass_state[1], h2);
+        PairStore(pair.sum_squares, sum_squares);
+        PairStore(pair.sample_peak, sample_peak);
+        PairStore(pair.true_peak, true_peak);
+    }
+
+    static double Lufs(double energy) { return -0.691 + 10.0 * std::log10(energy); }
+
+    // mean energy of every window of `length` sub-blocks, advancing one sub-block at a time
+    std::vector<double> Windows(std::size_t length) const {
+        std::vector<double> energies;
+        if (sub_blocks_.size() < length) {
+            return energies;
+        }
+        double sum = 0.0;
+        for (std::size_t i = 0; i < sub_blocks_.size(); ++i) {
+            sum += sub_blocks_[i];
+            if (i >= length) {
+                sum -= sub_blocks_[i - length];
+            }
+            if (i + 1 >= length) {
+                energies.push_back(std::max(sum, 0.0) / length);
+            }
+        }
+        return energies;
+    }
+
+    double IntegratedLoudness() const {
+        const std::vector<double> blocks = Windows(4); // 400 ms, 75 % overlap
+        double sum = 0.0;
+        std::size_t count = 0;
+        for (const double energy: blocks) {
+            if (Lufs(energy) > -70.0) {
+                sum += energy;
+                count++;
+            }
+        }
+        if (count == 0) {
+            return -INFINITY;
+        }
+        const double relative_gate = Lufs(sum / count) - 10.0;
+        sum = 0.0;
+        count = 0;
+        for (const double energy: blocks) {
+            if (Lufs(energy) > -70.0 && Lufs(energy) > relative_gate) {
+                sum += energy;
+                count++;
+            }
+        }
+        return count > 0 ? Lufs(sum / count) : -INFINITY;
+    }
+
+    double LoudnessRange() const {
+        const std::vector<double> short_term = Windows(30); // 3 s
+        std::vector<double> loudness;
+        double sum = 0.0;
+        for (const double energy: short_term) {
+            if (Lufs(energy) > -70.0) {
+                loudness.push_back(Lufs(energy));
+                sum += energy;
+            }
+        }
+        if (loudness.empty()) {
+            return 0.0;
+        }
+        const double relative_gate = Lufs(sum / loudness.size()) - 20.0;
+        loudness.erase(std::remove_if(loudness.begin(), loudness.end(),
+                                      [relative_gate](double value) -> bool { return value <= relative_gate; }),
+                       loudness.end());
+        if (loudness.empty()) {
+            return 0.0;
+        }
+        std::sort(loudness.begin(), loudness.end());
+        auto percentile = [&loudness](double p) -> double {
+            return loudness[static_cast<std::size_t>(std::lround(p * (loudness.size() - 1)))];
+        };
+        return percentile(0.95) - percentile(0.10);
+    }
+
+    const char *report_file_ = nullptr;
+    int channels_ = 0;
+    int sample_rate_ = 0;
+    int sub_block_size_ = 0; // 100 ms
+    int sub_block_fill_ = 0;
+    Biquad shelf_;
+    Biquad high_pass_;
+    double interpolator_[kTruePeakOversampling][kTruePeakTaps] = {};
+    std::vector<PairState> pairs_;
+    std::vector<double> weights_;
+    std::vector<double> sub_blocks_; // weighted channel energy sum of every complete 100 ms sub-block
+    int64_t samples_ = 0;
+    double analysis_seconds_ = 0.0;
+};
+
+// Runs one sink on its own thread behind a bounded queue of frame references, Push blocks while the sink is
+// kSinkQueueCapacity frames behind. After a sink fails the remaining frames are dropped, not consumed
+class SinkWorker {
+public:
+    explicit SinkWorker(std::unique_ptr<AudioSink> sink) : sink_(std::move(sink)) {
+        thread_ = std::thread(&SinkWorker::Run, this);
+    }
+
+    SinkWorker(const SinkWorker &) = delete;
+
+    SinkWorker &operator=(const SinkWorker &) = delete;
+
+    ~SinkWorker() { Close(); }
+
+    // shares the frame's buffers, no samples are copied
+    bool Push(const AVFrame *frame) {
+        AVFrame *ref = av_frame_clone(frame);
+        if (ref == nullptr) {
+            return false;
+        }
+        const auto start = std::chrono::steady_clock::now();
+        {
+            std::unique_lock lock(mutex_);
+            cv_.wait(lock, [this]() -> bool { return queue_.size() < kSinkQueueCapacity; });
+            queue_.push_back(ref);
+        }
+        wait_seconds_ += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        cv_.notify_all();
+        return true;
+    }
+
+    // consume the queued frames, close the sink and join, returns false if the sink failed
+    bool Close() {
+        if (thread_.joinable()) {
+            {
+                std::lock_guard lock(mutex_);
+                closing_ = true;
+            }
+            cv_.notify_all();
+            thread_.join();
+        }
+        return ok_;
+    }
+
+    const char *Name() const { return sink_->Name(); }
+
+    // time the decoder spent blocked on this sink, i.e. the sink was the bottleneck
+    double WaitSeconds() const { return wait_seconds_; }
+
+private:
+    void Run() {
+        while (true) {
+            AVFrame *frame = nullptr;
+            {
+                std::unique_lock lock(mutex_);
+                cv_.wait(lock, [this]() -> bool { return !queue_.empty() || closing_; });
+                if (queue_.empty()) {
+                    break;
+                }
+                frame = queue_.front();
+                queue_.pop_front();
+            }
+            cv_.notify_all();
+            ok_ = ok_ && sink_->Consume(frame);
+            av_frame_free(&frame);
+        }
+        ok_ = sink_->Close() && ok_;
+    }
+
+    std::unique_ptr<AudioSink> sink_;
+    std::thread thread_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<AVFrame *> queue_;
+    bool closing_ = false;
+    bool ok_ = true; // touched by the worker thread only until it is joined
+    double wait_seconds_ = 0.0; // touched by the decoding thread only
+};
+
+// hands every decoded frame to all sinks by reference
+class FrameFanOut {
+public:
+    void Add(std::unique_ptr<AudioSink> sink) { workers_.push_back(std::make_unique<SinkWorker>(std::move(sink))); }
+
+    bool Empty() const { return workers_.empty(); }
+
+    bool Push(const AVFrame *frame) {
+        bool ok = true;
+        for (const auto &worker: workers_) {
+            ok = worker->Push(frame) && ok;
+        }
+        return ok;
+    }
+
+    bool Close() {
+        bool ok = true;
+        for (const auto &worker: workers_) {
+            if (!worker->Close()) {
+                fprintf(stderr, "%s sink failed\n", worker->Name());
+                ok = false;
+            }
+            printf("%s sink: decoder waited %.3f s\n", worker->Name(), worker->WaitSeconds());
+        }
+        return ok;
+    }
+
+private:
+    std::vector<std::unique_ptr<SinkWorker>> workers_;
+};
+
+// where decoded frames go, both may be nullptr to only decode
+struct DecodeOutput {
+    std::ofstream *ofs = nullptr;
+    FrameFanOut *sinks = nullptr;
+};
+
 static std::string GetFileExtension(std::string_view file_name) {
     size_t pos = file_name.rfind('.');
     if (pos == std::string::npos) {
@@ -26,11 +1122,15 @@ static std::string GetFileExtension(std::string_view file_name) {
     return extension;
 }
 
-static bool InnerDecodeAudio(AVCodecContext *codec_ctx, AVPacket *pkt, std::ofstream &ofs) {
+// packed_buffer is reused for every frame, planar frames are interleaved into it and written with one call
+static bool InnerDecodeAudio(AVCodecContext *codec_ctx, AVPacket *pkt, const DecodeOutput &output,
+                             std::vector<uint8_t> &packed_buffer) {
     if (!codec_ctx || !pkt) {
         return false;
     }
 
+    std::ofstream *ofs = output.ofs;
+
     int error_code{};
     bool logged = false;
 
@@ -56,12 +1156,16 @@ static bool InnerDecodeAudio(AVCodecContext *codec_ctx, AVPacket *pkt, std::ofst
 
         // log 1 time per frame
         if (!logged) {
-            printf("Decode a %d bytes AAC frame, sample_rate=%d, channels=%d, sample_format=%d, is_planar=%d\n",
-                   pkt->size, codec_ctx->sample_rate, codec_ctx->ch_layout.nb_channels, codec_ctx->sample_fmt,
+            printf("Decode a %d bytes %s frame, sample_rate=%d, channels=%d, sample_format=%d, is_planar=%d\n",
+                   pkt->size, avcodec_get_name(codec_ctx->codec_id), codec_ctx->sample_rate,
+                   codec_ctx->ch_layout.nb_channels, codec_ctx->sample_fmt,
                    is_planar);
             logged = true;
         }
 
+        if (output.sinks && !output.sinks->Push(frame)) {
+            fprintf(stderr, "Failed to hand frame to sinks\n");
+        }
         if (!ofs) {
             continue;
         }
@@ -77,16 +1181,20 @@ static bool InnerDecodeAudio(AVCodecContext *codec_ctx, AVPacket *pkt, std::ofst
         // if packed format: LRLR...LRLR, LR in data[0]
         // output format only support packed
         if (is_planar) {
-            for (int i = 0; i < frame->nb_samples; ++i) {
-                for (int j = 0; j < codec_ctx->ch_layout.nb_channels; ++j) {
-                    if (!ofs.write(reinterpret_cast<char *>(frame->data[j] + i * bytes_per_sample), bytes_per_sample)) {
-                        fprintf(stderr, "Failed to write pcm file, ofstream is broken\n");
-                        continue;
-                    }
-                }
+            const int channels = codec_ctx->ch_layout.nb_channels;
+            const InterleaveFn interleave = GetInterleaveKernel(codec_ctx->sample_fmt, channels);
+            const std::size_t frame_bytes = static_cast<std::size_t>(frame->nb_samples) * bytes_per_sample * channels;
+            if (packed_buffer.size() < frame_bytes) {
+                packed_buffer.resize(frame_bytes);
+            }
+            interleave(packed_buffer.data(), frame->extended_data, frame->nb_samples, channels);
+            if (!ofs->write(reinterpret_cast<char *>(packed_buffer.data()),
+                            static_cast<std::streamsize>(frame_bytes))) {
+                fprintf(stderr, "Failed to write pcm file, ofstream is broken\n");
+                continue;
             }
         } else {
-            if (!ofs.write(reinterpret_cast<char *>(frame->data[0]),
+            if (!ofs->write(reinterpret_cast<char *>(frame->data[0]),
                            frame->nb_samples * bytes_per_sample * codec_ctx->ch_layout.nb_channels)) {
                 fprintf(stderr, "Failed to write pcm file, ofstream is broken\n");
                 continue;
@@ -101,14 +1209,199 @@ static bool InnerDecodeAudio(AVCodecContext *codec_ctx, AVPacket *pkt, std::ofst
         return false;
     }
 
-    if (!ofs) {
+    if (ofs && !*ofs) {
+        return false;
+    }
+
+    return true;
+}
+
+static void NoFree(void *, uint8_t *) {}
+
+// Decode the indexed frames starting at first_frame. Packets point straight into the mapping and reference it
+// through one AVBufferRef, so avcodec_send_packet does not copy them either. Only frames that end within
+// AV_INPUT_BUFFER_PADDING_SIZE of the end of the file are copied into a padded buffer
+static bool DecodeAdtsAudio(const MappedFile &input, const AdtsIndex &index, std::size_t first_frame,
+                            AVCodecContext *codec_ctx, AVPacket *pkt, const DecodeOutput &output,
+                            std::vector<uint8_t> &packed_buffer) {
+    AVBufferRef *mapping_ref = av_buffer_create(const_cast<uint8_t *>(input.Data()), input.Size(), NoFree, nullptr,
+                                                AV_BUFFER_FLAG_READONLY);
+    if (mapping_ref == nullptr) {
+        fprintf(stderr, "Failed to allocate AVBufferRef\n");
         return false;
     }
+    uint8_t tail[kAdtsMaxFrameSize + AV_INPUT_BUFFER_PADDING_SIZE] = {};
+
+    bool success = true;
+    const std::vector<AdtsFrame> &frames = index.Frames();
+    const std::size_t preroll_frame = first_frame >= kSeekPrerollFrames ? first_frame - kSeekPrerollFrames : 0;
+    for (std::size_t i = preroll_frame; i < frames.size() && success; ++i) {
+        const AdtsFrame &frame = frames[i];
+        if (frame.offset + frame.size + AV_INPUT_BUFFER_PADDING_SIZE <= input.Size()) {
+            if ((pkt->buf = av_buffer_ref(mapping_ref)) == nullptr) {
+                success = false;
+                break;
+            }
+            pkt->data = const_cast<uint8_t *>(input.Data()) + frame.offset;
+        } else {
+            std::memcpy(tail, input.Data() + frame.offset, frame.size);
+            std::memset(tail + frame.size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+            pkt->data = tail;
+        }
+        pkt->size = static_cast<int>(frame.size);
+        success = InnerDecodeAudio(codec_ctx, pkt, i < first_frame ? DecodeOutput{} : output, packed_buffer);
+        av_packet_unref(pkt);
+    }
+
+    // drain the decoder
+    pkt->data = nullptr;
+    pkt->size = 0;
+    InnerDecodeAudio(codec_ctx, pkt, output, packed_buffer);
+    av_buffer_unref(&mapping_ref);
+    return success;
+}
 
+// every sink gets its own worker thread
+static bool AddSinks(const DecodeOptions &options, FrameFanOut &sinks) {
+    if (options.wav_file) {
+        auto sink = std::make_unique<WavSink>();
+        if (!sink->Open(options.wav_file)) {
+            fprintf(stderr, "Failed to open wav file: %s\n", options.wav_file);
+            return false;
+        }
+        sinks.Add(std::move(sink));
+    }
+    if (options.resample_file) {
+        auto sink = std::make_unique<ResampleSink>();
+        if (!sink->Open(options.resample_file, options.resample_rate, options.resample_channels)) {
+            fprintf(stderr, "Failed to open resample file: %s\n", options.resample_file);
+            return false;
+        }
+        sinks.Add(std::move(sink));
+    }
+    if (options.stats) {
+        sinks.Add(std::make_unique<StatsSink>());
+    }
+    if (options.loudness_file) {
+        auto sink = std::make_unique<LoudnessSink>();
+        if (!sink->Open(options.loudness_file)) {
+            fprintf(stderr, "Failed to open loudness report: %s\n", options.loudness_file);
+            return false;
+        }
+        sinks.Add(std::move(sink));
+    }
     return true;
 }
 
-void DecodeAudio(const char *input_file, const char *output_file) {
+// mp3, m4a, opus, flac, ac3, mka, ... go through libavformat, any audio decoder avcodec_find_decoder knows works
+static bool DecodeContainerAudio(const char *input_file, const char *output_file, const DecodeOptions &options) {
+    int error_code{};
+
+    // open input_file
+    AVFormatContext *fmt_ctx = nullptr;
+    if ((error_code = avformat_open_input(&fmt_ctx, input_file, nullptr, nullptr)) < 0) {
+        fprintf(stderr, "Could not open source file '%s': %s\n", input_file, ErrorToString(error_code));
+        return false;
+    }
+    if ((error_code = avformat_find_stream_info(fmt_ctx, nullptr)) < 0) {
+        fprintf(stderr, "Could not find stream information: %s\n", ErrorToString(error_code));
+        avformat_close_input(&fmt_ctx);
+        return false;
+    }
+
+    // find the audio stream and its decoder
+    const AVCodec *codec = nullptr;
+    const int stream_index = av_find_best_stream(fmt_ctx, AVMEDIA_TYPE_AUDIO, -1, -1, &codec, 0);
+    if (stream_index < 0 || codec == nullptr) {
+        fprintf(stderr, "Could not find a decodable audio stream: %s\n", ErrorToString(stream_index));
+        avformat_close_input(&fmt_ctx);
+        return false;
+    }
+    AVStream *stream = fmt_ctx->streams[stream_index];
+    printf("Decode %s audio start\n", codec->name);
+
+    // allocate and initialize AVCodecContext, extradata (AudioSpecificConfig, OpusHead, STREAMINFO) included
+    AVCodecContext *codec_ctx = avcodec_alloc_context3(codec);
+    if (codec_ctx == nullptr) {
+        fprintf(stderr, "Failed to allocate AVCodecContext: %d\n", codec->id);
+        avformat_close_input(&fmt_ctx);
+        return false;
+    }
+    if ((error_code = avcodec_parameters_to_context(codec_ctx, stream->codecpar)) < 0) {
+        fprintf(stderr, "Failed to copy codec parameters: %s\n", ErrorToString(error_code));
+        avcodec_free_context(&codec_ctx);
+        avformat_close_input(&fmt_ctx);
+        return false;
+    }
+    codec_ctx->pkt_timebase = stream->time_base;
+    if ((error_code = avcodec_open2(codec_ctx, codec, nullptr)) < 0) {
+        fprintf(stderr, "Failed to init AVCodecContext: %s\n", ErrorToString(error_code));
+        avcodec_free_context(&codec_ctx);
+        avformat_close_input(&fmt_ctx);
+        return false;
+    }
+
+    // open outputs, allocate AVPacket once for the whole stream
+    std::ofstream ofs(output_file, std::ios::out | std::ios::binary);
+    AVPacket *pkt = av_packet_alloc();
+    FrameFanOut sinks;
+    bool success = true;
+    if (!ofs.is_open()) {
+        fprintf(stderr, "Failed to open output file: %s\n", output_file);
+        success = false;
+    } else if (pkt == nullptr) {
+        fprintf(stderr, "Failed to allocate AVPacket: av_packet_alloc()\n");
+        success = false;
+    } else if (!AddSinks(options, sinks)) {
+        success = false;
+    }
+    if (!success) {
+        sinks.Close();
+        av_packet_free(&pkt);
+        avcodec_free_context(&codec_ctx);
+        avformat_close_input(&fmt_ctx);
+        return false;
+    }
+
+    const DecodeOutput output{&ofs, sinks.Empty() ? nullptr : &sinks};
+    std::vector<uint8_t> packed_buffer;
+    while ((error_code = av_read_frame(fmt_ctx, pkt)) >= 0) {
+        if (pkt->stream_index == stream_index && !InnerDecodeAudio(codec_ctx, pkt, output, packed_buffer)) {
+            success = false;
+        }
+        av_packet_unref(pkt);
+        if (!success) {
+            break;
+        }
+    }
+    if (success && error_code != AVERROR_EOF) {
+        fprintf(stderr, "Failed to read frame: %s\n", ErrorToString(error_code));
+        success = false;
+    }
+
+    // drain the decoder
+    pkt->data = nullptr;
+    pkt->size = 0;
+    if (!InnerDecodeAudio(codec_ctx, pkt, output, packed_buffer)) {
+        success = false;
+    }
+
+    printf("Decode %s audio end\n", codec->name);
+    if (!sinks.Close()) {
+        success = false;
+    }
+    if (!ofs) {
+        fprintf(stderr, "Failed to write pcm file: %s\n", output_file);
+        success = false;
+    }
+
+    av_packet_free(&pkt);
+    avcodec_free_context(&codec_ctx);
+    avformat_close_input(&fmt_ctx);
+    return success;
+}
+
+bool DecodeAudio(const char *input_file, const char *output_file, const DecodeOptions &options) {
     int error_code{};
 
     // check file extension
@@ -117,35 +1410,70 @@ void DecodeAudio(const char *input_file, const char *output_file) {
     if (file_extension == "aac") {
         codec_id = AV_CODEC_ID_AAC;
         printf("Decode AAC audio start\n");
+    } else if (options.adts_splitter || options.start_seconds > 0.0 || options.index_file) {
+        fprintf(stderr, "--splitter adts, --start and --index need an ADTS .aac input: %s\n", input_file);
+        return false;
     } else {
-        fprintf(stderr, "Unsupported audio format: %s\n", file_extension.c_str());
-        return;
+        return DecodeContainerAudio(input_file, output_file, options);
     }
 
     // find AVCodec
     const AVCodec *codec = avcodec_find_decoder(codec_id);
     if (codec == nullptr) {
         fprintf(stderr, "AVCodec not found: %d\n", codec_id);
-        return;
+        return false;
     }
 
     // open input_file and output_file
     std::ifstream ifs(input_file, std::ios::in | std::ios::binary);
     if (!ifs.is_open()) {
         fprintf(stderr, "Failed to open input file: %s\n", input_file);
-        return;
+        return false;
     }
     std::ofstream ofs(output_file, std::ios::out | std::ios::binary);
     if (!ofs.is_open()) {
         fprintf(stderr, "Failed to open output file: %s\n", output_file);
-        return;
+        return false;
+    }
+
+    // build or load the ADTS frame index of the mapped input
+    const bool adts_splitter = options.adts_splitter || options.start_seconds > 0.0 || options.index_file;
+    MappedFile mapped_input;
+    AdtsIndex adts_index;
+    std::size_t first_frame = 0;
+    if (adts_splitter) {
+        if (!mapped_input.Open(input_file)) {
+            fprintf(stderr, "Failed to map input file: %s\n", input_file);
+            return false;
+        }
+        const auto start = std::chrono::steady_clock::now();
+        const bool loaded = options.index_file && adts_index.Load(options.index_file, mapped_input.Size(),
+                                                                         mapped_input.ModifiedTime());
+        if (!loaded && !adts_index.Build(mapped_input.Data(), mapped_input.Size())) {
+            fprintf(stderr, "No ADTS frame found: %s\n", input_file);
+            return false;
+        }
+        if (!loaded && options.index_file && !adts_index.Save(options.index_file, mapped_input.Size(),
+                                                                    mapped_input.ModifiedTime())) {
+            fprintf(stderr, "Failed to write index file: %s\n", options.index_file);
+        }
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        printf("ADTS index %s: %zu frames, %d Hz, %d channels, %zu bytes skipped, %.3f ms\n",
+               loaded ? "loaded" : "built", adts_index.Frames().size(), adts_index.SampleRate(),
+               adts_index.Channels(), adts_index.SkippedBytes(), seconds * 1000);
+        if (options.start_seconds > 0.0) {
+            first_frame = adts_index.Find(options.start_seconds);
+            const AdtsFrame &frame = adts_index.Frames()[first_frame];
+            printf("Seek to %.3f s: frame %zu at byte %llu, %.3f s\n", options.start_seconds, first_frame,
+                   frame.offset, static_cast<double>(frame.first_sample) / adts_index.SampleRate());
+        }
     }
 
     // initialize AVCodecParserContext
     AVCodecParserContext *parser_ctx = av_parser_init(codec->id);
     if (parser_ctx == nullptr) {
         fprintf(stderr, "Failed to init AVCodecParserContext: %d\n", codec->id);
-        return;
+        return false;
     }
 
     // allocate AVCodecContext
@@ -153,7 +1481,7 @@ void DecodeAudio(const char *input_file, const char *output_file) {
     if (codec_ctx == nullptr) {
         fprintf(stderr, "Failed to allocate AVCodecContext: %d\n", codec->id);
         av_parser_close(parser_ctx);
-        return;
+        return false;
     }
 
     // initialize AVCodecContext
@@ -161,7 +1489,7 @@ void DecodeAudio(const char *input_file, const char *output_file) {
         fprintf(stderr, "Failed to init AVCodecContext: %s\n", ErrorToString(error_code));
         avcodec_free_context(&codec_ctx);
         av_parser_close(parser_ctx);
-        return;
+        return false;
     }
 
     // allocate AVPacket
@@ -170,7 +1498,7 @@ void DecodeAudio(const char *input_file, const char *output_file) {
         fprintf(stderr, "Failed to allocate AVPacket: av_packet_alloc()\n");
         avcodec_free_context(&codec_ctx);
         av_parser_close(parser_ctx);
-        return;
+        return false;
     }
 
     // allocate input buffer
@@ -178,9 +1506,25 @@ void DecodeAudio(const char *input_file, const char *output_file) {
     auto input_buffer = std::make_unique<uint8_t[]>(input_buffer_size); // std=c++17
     std::memset(input_buffer.get(), 0, input_buffer_size);
     uint8_t *data = input_buffer.get();
+    std::vector<uint8_t> packed_buffer;
+
+    FrameFanOut sinks;
+    if (!AddSinks(options, sinks)) {
+        sinks.Close();
+        av_packet_free(&pkt);
+        avcodec_free_context(&codec_ctx);
+        av_parser_close(parser_ctx);
+        return false;
+    }
+    const DecodeOutput output{&ofs, sinks.Empty() ? nullptr : &sinks};
+
+    bool success = true;
+    if (adts_splitter) {
+        success = DecodeAdtsAudio(mapped_input, adts_index, first_frame, codec_ctx, pkt, output, packed_buffer);
+    }
 
     size_t data_size{};
-    while (true) {
+    while (!adts_splitter) {
         // refill input buffer
         if (data_size < kInputAudioBufferRefillThreshold && !ifs.eof()) {
             if (data_size > 0) {
@@ -191,6 +1535,7 @@ void DecodeAudio(const char *input_file, const char *output_file) {
             if (!ifs.read(reinterpret_cast<char *>(data) + data_size, static_cast<std::streamsize>(bytes_to_read))) {
                 if (!ifs.eof()) {
                     fprintf(stderr, "Failed to read input file: %s\n", input_file);
+                    success = false;
                     break;
                 }
                 fprintf(stderr, "End of ifstream: %s\n", input_file);
@@ -205,6 +1550,7 @@ void DecodeAudio(const char *input_file, const char *output_file) {
                                       AV_NOPTS_VALUE, AV_NOPTS_VALUE, 0);
         if (parsed < 0) {
             fprintf(stderr, "Failed to parse audio: %s\n", ErrorToString(parsed));
+            success = false;
             break;
         }
         data += parsed;
@@ -212,28 +1558,565 @@ void DecodeAudio(const char *input_file, const char *output_file) {
 
         // decode audio and write to output_file
         if (pkt->size > 0) {
-            InnerDecodeAudio(codec_ctx, pkt, ofs);
+            InnerDecodeAudio(codec_ctx, pkt, output, packed_buffer);
         }
 
         // if decode end, drain the decoder
         if (data_size == 0 && ifs.eof()) {
             pkt->data = nullptr;
             pkt->size = 0;
-            InnerDecodeAudio(codec_ctx, pkt, ofs);
+            InnerDecodeAudio(codec_ctx, pkt, output, packed_buffer);
             break;
         }
     }
 
     printf("Decode AAC audio end\n");
+    if (!sinks.Close()) {
+        success = false;
+    }
 
     av_packet_free(&pkt);
     avcodec_free_context(&codec_ctx);
     av_parser_close(parser_ctx);
+    return success;
+}
+
+// Check every kernel against the generic scalar one (interleave, then deinterleave back to the source) and
+// measure its throughput against the scalar kernel and the old one-ofstream-write-per-sample loop
+bool BenchmarkInterleave() {
+    constexpr int kSamples = 1024; // a typical AAC frame
+    constexpr int kIterations = 20000;
+    const AVSampleFormat formats[] = {AV_SAMPLE_FMT_U8P, AV_SAMPLE_FMT_S16P, AV_SAMPLE_FMT_S32P, AV_SAMPLE_FMT_FLTP,
+                                      AV_SAMPLE_FMT_DBLP};
+    const int channel_counts[] = {1, 2, 6, 8};
+
+    printf("%6s %8s %12s %12s %12s %12s\n", "format", "channels", "kernel", "scalar GB/s", "kernel GB/s",
+           "write/sample");
+    for (const AVSampleFormat sample_fmt: formats) {
+        for (const int channels: channel_counts) {
+            const int bytes_per_sample = av_get_bytes_per_sample(sample_fmt);
+            const std::size_t plane_bytes = static_cast<std::size_t>(kSamples) * bytes_per_sample;
+            std::vector<std::vector<uint8_t>> planes(channels, std::vector<uint8_t>(plane_bytes));
+            std::vector<std::vector<uint8_t>> restored(channels, std::vector<uint8_t>(plane_bytes));
+            std::vector<const uint8_t *> src(channels);
+            std::vector<uint8_t *> dst(channels);
+            for (int c = 0; c < channels; ++c) {
+                for (std::size_t i = 0; i < plane_bytes; ++i) {
+                    planes[c][i] = static_cast<uint8_t>(i * 31 + c * 7 + (i >> 8));
+                }
+                src[c] = planes[c].data();
+                dst[c] = restored[c].data();
+            }
+            std::vector<uint8_t> expected(plane_bytes * channels);
+            std::vector<uint8_t> packed(plane_bytes * channels);
+
+            // 3 channels has no specialization, so this is the generic scalar kernel of the sample size
+            const char *name = nullptr;
+            const InterleaveFn scalar = GetInterleaveKernel(sample_fmt, 3);
+            const InterleaveFn kernel = GetInterleaveKernel(sample_fmt, channels, &name);
+            const DeinterleaveFn deinterleave = GetDeinterleaveKernel(sample_fmt, channels);
+            scalar(expected.data(), src.data(), kSamples, channels);
+            kernel(packed.data(), src.data(), kSamples, channels);
+            deinterleave(dst.data(), packed.data(), kSamples, channels);
+            if (packed != expected || restored != planes) {
+                fprintf(stderr, "Kernel mismatch: %s, %d channels, %s\n", av_get_sample_fmt_name(sample_fmt),
+                        channels, name);
+                return false;
+            }
+
+            auto measure = [&](auto fn) -> double {
+                const auto start = std::chrono::steady_clock::now();
+                for (int i = 0; i < kIterations; ++i) {
+                    fn();
+                }
+                const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                return static_cast<double>(packed.size()) * kIterations / seconds / 1e9;
+            };
+            const double scalar_gbps = measure([&]() -> void {
+                scalar(packed.data(), src.data(), kSamples, channels);
+            });
+            const double kernel_gbps = measure([&]() -> void {
+                kernel(packed.data(), src.data(), kSamples, channels);
+            });
+
+            // the old output path, one std::ostream::write per sample per channel (into memory, no disk involved)
+            std::string sink;
+            sink.reserve(packed.size());
+            const auto start = std::chrono::steady_clock::now();
+            for (int n = 0; n < kIterations / 100; ++n) {
+                sink.clear();
+                for (int i = 0; i < kSamples; ++i) {
+                    for (int c = 0; c < channels; ++c) {
+                        sink.append(reinterpret_cast<const char *>(src[c] + i * bytes_per_sample), bytes_per_sample);
+                    }
+                }
+            }
+            const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            const double per_sample_gbps = static_cast<double>(packed.size()) * (kIterations / 100) / seconds / 1e9;
+
+            printf("%6s %8d %12s %12.2f %12.2f %12.2f\n", av_get_sample_fmt_name(sample_fmt), channels, name,
+                   scalar_gbps, kernel_gbps, per_sample_gbps);
+        }
+    }
+    return true;
+}
+
+// The packets of one audio stream held in memory, so the codec benchmark measures the decoder and not the input
+struct PacketStream {
+    std::string name;
+    AVCodecParameters *par = nullptr;
+    AVRational time_base{1, 1};
+    int frame_size = 0; // samples per channel and packet, 0 when it varies or is unknown
+    std::vector<AVPacket *> packets;
+
+    PacketStream() = default;
+
+    PacketStream(const PacketStream &) = delete;
+
+    PacketStream &operator=(const PacketStream &) = delete;
+
+    ~PacketStream() {
+        for (AVPacket *&pkt: packets) {
+            av_packet_free(&pkt);
+        }
+        avcodec_parameters_free(&par);
+    }
+};
+
+// one sample of a deterministic test signal: two tones per channel and some noise, so lossless codecs cannot
+// collapse it to nothing
+static double SyntheticSample(int channel, int64_t index, uint32_t &noise) {
+    constexpr double kPi = 3.14159265358979323846;
+    noise = noise * 1664525u + 1013904223u;
+    const double t = static_cast<double>(index) / kSyntheticSampleRate;
+    return 0.3 * std::sin(2.0 * kPi * 440.0 * (channel + 1) * t) + 0.1 * std::sin(2.0 * kPi * 3000.0 * t) +
+           0.01 * (static_cast<double>(noise >> 8) / (1 << 24) - 0.5);
+}
+
+static void StoreSample(AVFrame *frame, int channel, int index, double value) {
+    const auto sample_fmt = static_cast<AVSampleFormat>(frame->format);
+    const bool planar = av_sample_fmt_is_planar(sample_fmt);
+    uint8_t *data = planar ? frame->extended_data[channel] : frame->data[0];
+    const int i = planar ? index : index * frame->ch_layout.nb_channels + channel;
+    switch (av_get_packed_sample_fmt(sample_fmt)) {
+        case AV_SAMPLE_FMT_U8:
+            data[i] = static_cast<uint8_t>(std::lrint(value * 127.0) + 128);
+            break;
+        case AV_SAMPLE_FMT_S16:
+            reinterpret_cast<int16_t *>(data)[i] = static_cast<int16_t>(std::lrint(value * 32767.0));
+            break;
+        case AV_SAMPLE_FMT_S32:
+            reinterpret_cast<int32_t *>(data)[i] = static_cast<int32_t>(std::lrint(value * 2147483647.0));
+            break;
+        case AV_SAMPLE_FMT_FLT:
+            reinterpret_cast<float *>(data)[i] = static_cast<float>(value);
+            break;
+        case AV_SAMPLE_FMT_DBL:
+            reinterpret_cast<double *>(data)[i] = value;
+            break;
+        default:
+            break;
+    }
+}
+
+// encode kSyntheticSeconds of the test signal with encoder_name into memory, false if the encoder is missing or
+// does not take every one of options ("key=value:key=value", e.g. the frame size of the sweep)
+static bool EncodeSyntheticStream(const char *encoder_name, const char *options, PacketStream &stream) {
+    int error_code{};
+    const AVCodec *codec = avcodec_find_encoder_by_name(encoder_name);
+    if (codec == nullptr) {
+        return false;
+    }
+
+    // first supported sample format, 48 kHz unless the encoder does not take it
+    int nb_sample_fmts{};
+    const void *sample_fmts = nullptr;
+    avcodec_get_supported_config(nullptr, codec, AV_CODEC_CONFIG_SAMPLE_FORMAT, 0, &sample_fmts, &nb_sample_fmts);
+    int nb_sample_rates{};
+    const void *sample_rates = nullptr;
+    avcodec_get_supported_config(nullptr, codec, AV_CODEC_CONFIG_SAMPLE_RATE, 0, &sample_rates, &nb_sample_rates);
+    int sample_rate = nb_sample_rates > 0 ? *static_cast<const int *>(sample_rates) : kSyntheticSampleRate;
+    for (int i = 0; i < nb_sample_rates; ++i) {
+        if (static_cast<const int *>(sample_rates)[i] == kSyntheticSampleRate) {
+            sample_rate = kSyntheticSampleRate;
+        }
+    }
+
+    AVCodecContext *codec_ctx = avcodec_alloc_context3(codec);
+    if (codec_ctx == nullptr) {
+        fprintf(stderr, "Failed to allocate AVCodecContext: %s\n", encoder_name);
+        return false;
+    }
+    codec_ctx->sample_fmt = nb_sample_fmts > 0 ? *static_cast<const AVSampleFormat *>(sample_fmts)
+                                               : AV_SAMPLE_FMT_FLTP;
+    codec_ctx->sample_rate = sample_rate;
+    codec_ctx->time_base = {1, sample_rate};
+    codec_ctx->bit_rate = codec->id == AV_CODEC_ID_FLAC ? 0 : 192000;
+    codec_ctx->strict_std_compliance = FF_COMPLIANCE_EXPERIMENTAL; // the native opus encoder
+    av_channel_layout_default(&codec_ctx->ch_layout, kSyntheticChannels);
+    AVDictionary *open_options = nullptr;
+    if (options && (error_code = av_dict_parse_string(&open_options, options, "=", ":", 0)) < 0) {
+        fprintf(stderr, "Invalid %s options '%s': %s\n", encoder_name, options, ErrorToString(error_code));
+        av_dict_free(&open_options);
+        avcodec_free_context(&codec_ctx);
+        return false;
+    }
+    error_code = avcodec_open2(codec_ctx, codec, &open_options);
+    const bool options_unused = av_dict_count(open_options) > 0; // e.g. frame_duration given to the native opus
+    av_dict_free(&open_options);
+    if (error_code < 0 || options_unused) {
+        if (error_code < 0) {
+            fprintf(stderr, "Failed to open %s encoder: %s\n", encoder_name, ErrorToString(error_code));
+        }
+        avcodec_free_context(&codec_ctx);
+        return false;
+    }
+
+    AVFrame *frame = av_frame_alloc();
+    AVPacket *pkt = av_packet_alloc();
+    bool success = frame != nullptr && pkt != nullptr;
+    if (success) {
+        frame->format = codec_ctx->sample_fmt;
+        frame->sample_rate = sample_rate;
+        frame->nb_samples = codec_ctx->frame_size > 0 ? codec_ctx->frame_size : 1024;
+        success = av_channel_layout_copy(&frame->ch_layout, &codec_ctx->ch_layout) >= 0 &&
+                  av_frame_get_buffer(frame, 0) >= 0;
+    }
+
+    // whole frames only, not every encoder accepts a short last frame
+    uint32_t noise = 1;
+    const int64_t nb_frames =
+            success ? static_cast<int64_t>(kSyntheticSeconds) * sample_rate / std::max(frame->nb_samples, 1) : 0;
+    for (int64_t n = 0; n <= nb_frames && success; ++n) {
+        AVFrame *input = n < nb_frames ? frame : nullptr; // then flush
+        if (input) {
+            success = av_frame_make_writable(frame) >= 0;
+            for (int i = 0; i < frame->nb_samples && success; ++i) {
+                for (int c = 0; c < kSyntheticChannels; ++c) {
+                    StoreSample(frame, c, i, SyntheticSample(c, n * frame->nb_samples + i, noise));
+                }
+            }
+            frame->pts = n * frame->nb_samples;
+        }
+        if ((error_code = avcodec_send_frame(codec_ctx, input)) < 0) {
+            fprintf(stderr, "Failed to send frame to %s encoder: %s\n", encoder_name, ErrorToString(error_code));
+            success = false;
+        }
+        while (success && (error_code = avcodec_receive_packet(codec_ctx, pkt)) == 0) {
+            AVPacket *packet = av_packet_alloc();
+            if (packet == nullptr) {
+                success = false;
+                break;
+            }
+            av_packet_move_ref(packet, pkt);
+            stream.packets.push_back(packet);
+        }
+    }
+
+    stream.name = std::string("synthetic (") + encoder_name + ")";
+    stream.time_base = codec_ctx->time_base;
+    stream.frame_size = frame ? frame->nb_samples : 0;
+    if (success && ((stream.par = avcodec_parameters_alloc()) == nullptr ||
+                    avcodec_parameters_from_context(stream.par, codec_ctx) < 0)) {
+        success = false;
+    }
+    if (!success) {
+        fprintf(stderr, "Failed to encode the synthetic signal with %s\n", encoder_name);
+    }
+
+    av_packet_free(&pkt);
+    av_frame_free(&frame);
+    avcodec_free_context(&codec_ctx);
+    return success;
+}
+
+// read every packet of the best audio stream of input_file into memory
+static bool ReadStreamPackets(const char *input_file, PacketStream &stream) {
+    int error_code{};
+    AVFormatContext *fmt_ctx = nullptr;
+    if ((error_code = avformat_open_input(&fmt_ctx, input_file, nullptr, nullptr)) < 0) {
+        fprintf(stderr, "Could not open source file '%s': %s\n", input_file, ErrorToString(error_code));
+        return false;
+    }
+    const int stream_index = avformat_find_stream_info(fmt_ctx, nullptr) < 0
+                                 ? AVERROR_STREAM_NOT_FOUND
+                                 : av_find_best_stream(fmt_ctx, AVMEDIA_TYPE_AUDIO, -1, -1, nullptr, 0);
+    if (stream_index < 0) {
+        fprintf(stderr, "Could not find an audio stream in '%s': %s\n", input_file, ErrorToString(stream_index));
+        avformat_close_input(&fmt_ctx);
+        return false;
+    }
+    const AVStream *av_stream = fmt_ctx->streams[stream_index];
+    stream.name = input_file;
+    stream.time_base = av_stream->time_base;
+    stream.frame_size = av_stream->codecpar->frame_size;
+    if ((stream.par = avcodec_parameters_alloc()) == nullptr ||
+        avcodec_parameters_copy(stream.par, av_stream->codecpar) < 0) {
+        avformat_close_input(&fmt_ctx);
+        return false;
+    }
+
+    AVPacket *pkt = av_packet_alloc();
+    while (pkt != nullptr && (error_code = av_read_frame(fmt_ctx, pkt)) >= 0) {
+        if (pkt->stream_index != stream_index) {
+            av_packet_unref(pkt);
+            continue;
+        }
+        stream.packets.push_back(pkt);
+        pkt = av_packet_alloc();
+    }
+    av_packet_free(&pkt);
+    avformat_close_input(&fmt_ctx);
+    return !stream.packets.empty();
+}
+
+struct CodecRun {
+    int64_t samples = 0; // per channel
+    int64_t frames = 0;
+    int64_t output_bytes = 0; // packed pcm
+    int64_t allocations = -1; // < 0 without an allocation counter
+    double seconds = 0.0;
+    AVSampleFormat sample_fmt = AV_SAMPLE_FMT_NONE;
+};
+
+// decode the whole stream `passes` times with one single-threaded decoder, into a reused packed buffer
+static bool DecodePacketStream(const PacketStream &stream, int passes, CodecRun &run) {
+    const AVCodec *codec = avcodec_find_decoder(stream.par->codec_id);
+    if (codec == nullptr) {
+        fprintf(stderr, "AVCodec not found: %s\n", avcodec_get_name(stream.par->codec_id));
+        return false;
+    }
+    AVCodecContext *codec_ctx = avcodec_alloc_context3(codec);
+    AVFrame *frame = av_frame_alloc();
+    if (codec_ctx == nullptr || frame == nullptr || avcodec_parameters_to_context(codec_ctx, stream.par) < 0) {
+        fprintf(stderr, "Failed to allocate %s decoder\n", codec->name);
+        av_frame_free(&frame);
+        avcodec_free_context(&codec_ctx);
+        return false;
+    }
+    codec_ctx->pkt_timebase = stream.time_base;
+    codec_ctx->thread_count = 1; // per core numbers
+    int error_code{};
+    if ((error_code = avcodec_open2(codec_ctx, codec, nullptr)) < 0) {
+        fprintf(stderr, "Failed to init AVCodecContext: %s\n", ErrorToString(error_code));
+        av_frame_free(&frame);
+        avcodec_free_context(&codec_ctx);
+        return false;
+    }
+
+    std::vector<uint8_t> packed_buffer;
+    bool success = true;
+#ifdef AUDIO_ALLOCATION_COUNTER
+    const int64_t allocations = allocation_count;
+#endif
+    const auto start = std::chrono::steady_clock::now();
+    for (int pass = 0; pass < passes && success; ++pass) {
+        for (std::size_t i = 0; i <= stream.packets.size() && success; ++i) {
+            const AVPacket *pkt = i < stream.packets.size() ? stream.packets[i] : nullptr; // then drain
+            if ((error_code = avcodec_send_packet(codec_ctx, pkt)) < 0 && error_code != AVERROR(EAGAIN)) {
+                fprintf(stderr, "Failed to send packet to decoder: %s\n", ErrorToString(error_code));
+                success = false;
+            }
+            while ((error_code = avcodec_receive_frame(codec_ctx, frame)) == 0) {
+                const auto sample_fmt = static_cast<AVSampleFormat>(frame->format);
+                const int channels = frame->ch_layout.nb_channels;
+                const std::size_t frame_bytes =
+                        static_cast<std::size_t>(frame->nb_samples) * av_get_bytes_per_sample(sample_fmt) * channels;
+                if (packed_buffer.size() < frame_bytes) {
+                    packed_buffer.resize(frame_bytes);
+                }
+                if (av_sample_fmt_is_planar(sample_fmt)) {
+                    GetInterleaveKernel(sample_fmt, channels)(packed_buffer.data(), frame->extended_data,
+                                                              frame->nb_samples, channels);
+                } else {
+                    std::memcpy(packed_buffer.data(), frame->data[0], frame_bytes);
+                }
+                run.samples += frame->nb_samples;
+                run.frames++;
+                run.output_bytes += static_cast<int64_t>(frame_bytes);
+                run.sample_fmt = sample_fmt;
+                av_frame_unref(frame);
+            }
+        }
+        avcodec_flush_buffers(codec_ctx);
+    }
+    run.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+#ifdef AUDIO_ALLOCATION_COUNTER
+    run.allocations = allocation_count - allocations;
+#endif
+
+    av_frame_free(&frame);
+    avcodec_free_context(&codec_ctx);
+    return success && run.frames > 0;
+}
+
+// one synthetic stream of the codec benchmark: encoders in order of preference and their options
+struct SyntheticCodec {
+    const char *encoders[2];
+    const char *options;
+};
+
+// Decode synthetic streams of AAC, MP3, Opus, FLAC and AC-3 (whichever encoders this FFmpeg build has) and the
+// audio of input_files to memory. AAC, Opus and FLAC are also swept over their frame sizes, one row per size:
+// the per-frame overhead of a decoder only shows when the same codec runs with short and long frames. Every
+// stream is decoded on one core and then on all cores at once, one decoder per core, which shows what a host
+// sustains when every core decodes its own stream
+bool BenchmarkCodecs(const std::vector<const char *> &input_files) {
+    const SyntheticCodec codecs[] = {
+            {{"aac", nullptr}, nullptr}, // 1024, the native encoder has no other frame size
+            {{"libfdk_aac", nullptr}, "frame_length=960"},
+            {{"libfdk_aac", nullptr}, "profile=aac_ld:frame_length=512"},
+            {{"libmp3lame", nullptr}, nullptr},
+            {{"libopus", nullptr}, "frame_duration=2.5"},
+            {{"libopus", nullptr}, "frame_duration=5"},
+            {{"libopus", nullptr}, "frame_duration=10"},
+            {{"libopus", "opus"}, nullptr}, // 20 ms
+            {{"libopus", nullptr}, "frame_duration=40"},
+            {{"libopus", nullptr}, "frame_duration=60"},
+            {{"flac", nullptr}, "frame_size=1152"},
+            {{"flac", nullptr}, "frame_size=4096"},
+            {{"flac", nullptr}, nullptr}, // 4608 at 48 kHz
+            {{"flac", nullptr}, "frame_size=8192"},
+            {{"ac3", nullptr}, nullptr},
+    };
+    std::vector<std::unique_ptr<PacketStream>> streams;
+    for (const SyntheticCodec &codec: codecs) {
+        std::unique_ptr<PacketStream> stream;
+        for (const char *name: codec.encoders) {
+            if (name && !stream) {
+                stream = std::make_unique<PacketStream>();
+                if (!EncodeSyntheticStream(name, codec.options, *stream)) {
+                    stream.reset();
+                }
+            }
+        }
+        if (stream) {
+            streams.push_back(std::move(stream));
+        } else {
+            printf("Skip %s%s%s: no usable encoder in this FFmpeg build\n", codec.encoders[0],
+                   codec.options ? " " : "", codec.options ? codec.options : "");
+        }
+    }
+    for (const char *input_file: input_files) {
+        auto stream = std::make_unique<PacketStream>();
+        if (!ReadStreamPackets(input_file, *stream)) {
+            return false;
+        }
+        streams.push_back(std::move(stream));
+    }
+
+    const int cores = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+    printf("%-6s %-32s %6s %3s %6s %6s %14s %14s %12s %12s %10s\n", "codec", "input", "format", "ch", "rate",
+           "frame", "1 core Ms/s", "Ms/s/core", "allocs/frame", "output MB/s", "realtime");
+    for (const auto &stream: streams) {
+        // calibrate, so every measurement decodes for at least kCodecBenchmarkSeconds
+        CodecRun calibration;
+        if (!DecodePacketStream(*stream, 1, calibration)) {
+            return false;
+        }
+        const int passes = std::max(1, static_cast<int>(std::ceil(kCodecBenchmarkSeconds / calibration.seconds)));
+
+        CodecRun single;
+        if (!DecodePacketStream(*stream, passes, single)) {
+            return false;
+        }
+
+        // all cores, one decoder and one copy of the work each
+        std::vector<CodecRun> runs(cores);
+        std::vector<std::thread> threads;
+        std::atomic<bool> parallel_success{true};
+        const auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < cores; ++i) {
+            threads.emplace_back([&, i]() -> void {
+                if (!DecodePacketStream(*stream, passes, runs[i])) {
+                    parallel_success = false;
+                }
+            });
+        }
+        for (std::thread &thread: threads) {
+            thread.join();
+        }
+        const double parallel_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (!parallel_success) {
+            return false;
+        }
+        int64_t parallel_samples = 0;
+        for (const CodecRun &run: runs) {
+            parallel_samples += run.samples;
+        }
+
+        const int sample_rate = stream->par->sample_rate > 0 ? stream->par->sample_rate : 1;
+        char allocations[32] = "n/a";
+        if (single.allocations >= 0) {
+            std::snprintf(allocations, sizeof(allocations), "%.2f",
+                          static_cast<double>(single.allocations) / static_cast<double>(single.frames));
+        }
+        char frame_size[16] = "-";
+        if (stream->frame_size > 0) {
+            std::snprintf(frame_size, sizeof(frame_size), "%d", stream->frame_size);
+        }
+        printf("%-6s %-32s %6s %3d %6d %6s %14.2f %14.2f %12s %12.1f %9.0fx\n",
+               avcodec_get_name(stream->par->codec_id), stream->name.c_str(), av_get_sample_fmt_name(single.sample_fmt),
+               stream->par->ch_layout.nb_channels, sample_rate, frame_size, single.samples / single.seconds / 1e6,
+               parallel_samples / parallel_seconds / cores / 1e6, allocations,
+               single.output_bytes / single.seconds / 1e6, single.samples / single.seconds / sample_rate);
+    }
+    printf("samples are per channel, frame is samples per packet, Ms/s/core is the aggregate rate of %d concurrent "
+           "decoders divided by %d\n", cores, cores);
+    return true;
 }
 
 int main(int argc, char *argv[]) {
     // ffmpeg -i yuv420p_640x360_25fps.mp4 -vn -c:a copy 48k_f32le_2ch.aac
-    DecodeAudio("../../../../48k_f32le_2ch.aac", "../../../../48k_f32le_2ch.pcm");
     // ffplay -ar 48000 -ac 2 -f f32le 48k_f32le_2ch.pcm
-    return 0;
+    const char *input_file = "../../../../48k_f32le_2ch.aac";
+    const char *output_file = "../../../../48k_f32le_2ch.pcm";
+
+    // usage: ffmpeg_decode_audio [--benchmark-interleave] [--benchmark-codecs [input_file...]]
+    //                            [--splitter <parser|adts>] [--start <seconds>]
+    //                            [--index <index_file>] [--wav <wav_file>] [--stats] [--loudness <report.json>]
+    //                            [--resample <wav_file> [--resample-rate <hz>] [--resample-channels <n>]]
+    //                            [input_file [output_file]]
+    DecodeOptions options;
+    bool benchmark_codecs = false;
+    std::vector<const char *> files;
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        if (arg == "--benchmark-interleave") {
+            return BenchmarkInterleave() ? 0 : 1;
+        } else if (arg == "--benchmark-codecs") {
+            benchmark_codecs = true;
+        } else if (arg == "--splitter" && i + 1 < argc) {
+            options.adts_splitter = std::string(argv[++i]) == "adts";
+        } else if (arg == "--start" && i + 1 < argc) {
+            options.start_seconds = std::max(std::atof(argv[++i]), 0.0);
+        } else if (arg == "--index" && i + 1 < argc) {
+            options.index_file = argv[++i];
+        } else if (arg == "--wav" && i + 1 < argc) {
+            options.wav_file = argv[++i];
+        } else if (arg == "--resample" && i + 1 < argc) {
+            options.resample_file = argv[++i];
+        } else if (arg == "--resample-rate" && i + 1 < argc) {
+            options.resample_rate = std::max(std::atoi(argv[++i]), 1000);
+        } else if (arg == "--resample-channels" && i + 1 < argc) {
+            options.resample_channels = std::clamp(std::atoi(argv[++i]), 1, 8);
+        } else if (arg == "--loudness" && i + 1 < argc) {
+            options.loudness_file = argv[++i];
+        } else if (arg == "--stats") {
+            options.stats = true;
+        } else {
+            files.push_back(argv[i]);
+        }
+    }
+    if (benchmark_codecs) {
+        return BenchmarkCodecs(files) ? 0 : 1;
+    }
+    if (!files.empty()) {
+        input_file = files[0];
+    }
+    if (files.size() > 1) {
+        output_file = files[1];
+    }
+
+    return DecodeAudio(input_file, output_file, options) ? 0 : 1;
 }
@@ -4,10 +4,13 @@ extern "C" {
 }
 
 #include <chrono>
+#include <cstring>
 #include <fstream>
 #include <sstream>
 #include <unordered_map>
 
+#include "audio_interleave.h"
+
 static constexpr int ADTS_HEADER_LEN = 7;
 static constexpr int kDefaultProfile = AV_PROFILE_AAC_LOW;
 thread_local static char error_buffer[AV_ERROR_MAX_STRING_SIZE] = {}; // store FFmpeg error string
@@ -202,7 +205,18 @@ static bool InnerEncodeAudioAAC(AVCodecContext *codec_ctx, AVFrame *frame, std::
     AVSampleFormat sample_fmt = codec_ctx->sample_fmt;
     int bytes_per_frame = bytes_per_sample * nb_channels * nb_samples;
     auto pcm_buffer_packed = std::make_unique<uint8_t[]>(bytes_per_frame);
-    auto pcm_buffer_planar = std::make_unique<uint8_t[]>(bytes_per_frame);
+
+    // planar encoders get the packed pcm split straight into the frame planes
+    const char *kernel_name = nullptr;
+    DeinterleaveFn deinterleave = GetDeinterleaveKernel(sample_fmt, nb_channels, &kernel_name);
+    if (av_sample_fmt_is_planar(sample_fmt)) {
+        if (deinterleave == nullptr) {
+            fprintf(stderr, "No deinterleave kernel for sample_fmt '%s'\n", av_get_sample_fmt_name(sample_fmt));
+            av_packet_free(&pkt);
+            return false;
+        }
+        printf("Deinterleave kernel: %s\n", kernel_name);
+    }
 
     while (true) {
         // read pcm samples
@@ -221,33 +235,18 @@ static bool InnerEncodeAudioAAC(AVCodecContext *codec_ctx, AVFrame *frame, std::
             break;
         }
 
-        // convert pcm sample format
-        uint8_t *data = nullptr;
-        if (av_sample_fmt_is_planar(sample_fmt)) {
-            data = pcm_buffer_planar.get();
-            std::memset(data, 0, bytes_per_frame);
-            for (int i = 0; i < nb_channels; ++i) {
-                for (int j = i; j < samples_read; j += nb_channels) {
-                    std::memcpy(data, pcm_buffer_packed.get() + j * bytes_per_sample, bytes_per_sample);
-                    data += bytes_per_sample;
-                }
-            }
-            data = pcm_buffer_planar.get();
-        } else {
-            data = pcm_buffer_packed.get();
-        }
-
-        // initialize AVFrame
+        // initialize AVFrame, a short last read is padded with the zeroed tail of the buffer
         if ((error_code = av_frame_make_writable(frame)) < 0) {
             fprintf(stderr, "Failed to make AVFrame writable: %s\n", ErrorToString(error_code));
             ret = false;
             break;
         }
-        if ((error_code = av_samples_fill_arrays(frame->data, frame->linesize, data, nb_channels, nb_samples_read,
-                                                 sample_fmt, 0)) < 0) {
-            fprintf(stderr, "Failed to fill AVFrame data: %s\n", ErrorToString(error_code));
-            ret = false;
-            break;
+
+        // convert pcm sample format
+        if (deinterleave) {
+            deinterleave(frame->extended_data, pcm_buffer_packed.get(), nb_samples, nb_channels);
+        } else {
+            std::memcpy(frame->data[0], pcm_buffer_packed.get(), bytes_per_frame);
         }
         pts += nb_samples;
         frame->pts = pts;
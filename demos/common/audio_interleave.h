@@ -0,0 +1,294 @@
+// Planar <-> packed audio sample kernels shared by the audio demos, header only so that every demo still builds
+// from its own directory without a library target
+#ifndef DEMOS_COMMON_AUDIO_INTERLEAVE_H
+#define DEMOS_COMMON_AUDIO_INTERLEAVE_H
+
+extern "C" {
+#include <libavutil/samplefmt.h>
+}
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define AUDIO_SSE2 1
+#include <emmintrin.h>
+#endif
+
+// the AVX2 kernels are picked at runtime, the binary still runs on CPUs without AVX2
+#if defined(__x86_64__) || defined(_M_X64)
+#define AUDIO_AVX2 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define AUDIO_TARGET_AVX2
+#else
+#define AUDIO_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+// Planar <-> packed sample kernels. They only depend on the sample size, so one kernel serves u8p (1 byte),
+// s16p (2 bytes), s32p/fltp (4 bytes) and dblp/s64p (8 bytes). Channel counts 1, 2, 6 and 8 are specialized at
+// compile time, stereo of 2 bytes and up also has SSE2 and AVX2 versions, picked once at runtime. Deinterleave
+// is the reverse direction an encoder needs to fill a planar AVFrame from packed pcm
+using InterleaveFn = void (*)(uint8_t *dst, const uint8_t *const *src, int nb_samples, int channels);
+using DeinterleaveFn = void (*)(uint8_t *const *dst, const uint8_t *src, int nb_samples, int channels);
+
+// kChannels == 0: any channel count, taken from channels
+template<typename T, int kChannels>
+void InterleaveScalar(uint8_t *dst, const uint8_t *const *src, int nb_samples, int channels) {
+    const int n = kChannels > 0 ? kChannels : channels;
+    auto *out = reinterpret_cast<T *>(dst);
+    for (int i = 0; i < nb_samples; ++i) {
+        for (int c = 0; c < n; ++c) {
+            out[i * n + c] = reinterpret_cast<const T *>(src[c])[i];
+        }
+    }
+}
+
+template<typename T, int kChannels>
+void DeinterleaveScalar(uint8_t *const *dst, const uint8_t *src, int nb_samples, int channels) {
+    const int n = kChannels > 0 ? kChannels : channels;
+    const auto *in = reinterpret_cast<const T *>(src);
+    for (int i = 0; i < nb_samples; ++i) {
+        for (int c = 0; c < n; ++c) {
+            reinterpret_cast<T *>(dst[c])[i] = in[i * n + c];
+        }
+    }
+}
+
+template<typename T>
+void InterleaveMono(uint8_t *dst, const uint8_t *const *src, int nb_samples, int) {
+    std::memcpy(dst, src[0], static_cast<std::size_t>(nb_samples) * sizeof(T));
+}
+
+template<typename T>
+void DeinterleaveMono(uint8_t *const *dst, const uint8_t *src, int nb_samples, int) {
+    std::memcpy(dst[0], src, static_cast<std::size_t>(nb_samples) * sizeof(T));
+}
+
+#ifdef AUDIO_SSE2
+// LLLL + RRRR -> LRLR LRLR, the unpack width is the sample size, so the bit pattern of any format is kept
+template<typename T>
+void InterleaveStereoSse2(uint8_t *dst, const uint8_t *const *src, int nb_samples, int channels) {
+    static_assert(sizeof(T) >= 2, "the unpacks start at 16-bit lanes, u8p stereo uses the scalar kernel");
+    constexpr int kStep = 16 / sizeof(T);
+    int i = 0;
+    for (; i + kStep <= nb_samples; i += kStep) {
+        const __m128i l = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src[0] + i * sizeof(T)));
+        const __m128i r = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src[1] + i * sizeof(T)));
+        __m128i lo;
+        __m128i hi;
+        if constexpr (sizeof(T) == 2) {
+            lo = _mm_unpacklo_epi16(l, r);
+            hi = _mm_unpackhi_epi16(l, r);
+        } else if constexpr (sizeof(T) == 4) {
+            lo = _mm_unpacklo_epi32(l, r);
+            hi = _mm_unpackhi_epi32(l, r);
+        } else {
+            lo = _mm_unpacklo_epi64(l, r);
+            hi = _mm_unpackhi_epi64(l, r);
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i * 2 * sizeof(T)), lo);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i * 2 * sizeof(T) + 16), hi);
+    }
+    const uint8_t *tail[2] = {src[0] + i * sizeof(T), src[1] + i * sizeof(T)};
+    InterleaveScalar<T, 2>(dst + i * 2 * sizeof(T), tail, nb_samples - i, channels);
+}
+
+// LRLR LRLR -> LLLL + RRRR
+template<typename T>
+void DeinterleaveStereoSse2(uint8_t *const *dst, const uint8_t *src, int nb_samples, int channels) {
+    static_assert(sizeof(T) >= 2);
+    constexpr int kStep = 16 / sizeof(T);
+    int i = 0;
+    for (; i + kStep <= nb_samples; i += kStep) {
+        const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i * 2 * sizeof(T)));
+        const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i * 2 * sizeof(T) + 16));
+        __m128i l;
+        __m128i r;
+        if constexpr (sizeof(T) == 2) {
+            // sign extend the even/odd 16-bit lanes to 32 bits, the saturating pack then restores them exactly
+            l = _mm_packs_epi32(_mm_srai_epi32(_mm_slli_epi32(a, 16), 16), _mm_srai_epi32(_mm_slli_epi32(b, 16), 16));
+            r = _mm_packs_epi32(_mm_srai_epi32(a, 16), _mm_srai_epi32(b, 16));
+        } else if constexpr (sizeof(T) == 4) {
+            const __m128 fa = _mm_castsi128_ps(a);
+            const __m128 fb = _mm_castsi128_ps(b);
+            l = _mm_castps_si128(_mm_shuffle_ps(fa, fb, _MM_SHUFFLE(2, 0, 2, 0)));
+            r = _mm_castps_si128(_mm_shuffle_ps(fa, fb, _MM_SHUFFLE(3, 1, 3, 1)));
+        } else {
+            l = _mm_unpacklo_epi64(a, b);
+            r = _mm_unpackhi_epi64(a, b);
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst[0] + i * sizeof(T)), l);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst[1] + i * sizeof(T)), r);
+    }
+    uint8_t *tail[2] = {dst[0] + i * sizeof(T), dst[1] + i * sizeof(T)};
+    DeinterleaveScalar<T, 2>(tail, src + i * 2 * sizeof(T), nb_samples - i, channels);
+}
+#endif
+
+#ifdef AUDIO_AVX2
+// the 256-bit unpacks work per 128-bit lane, permute2x128 puts the two halves back in sample order
+template<typename T>
+AUDIO_TARGET_AVX2 void InterleaveStereoAvx2(uint8_t *dst, const uint8_t *const *src, int nb_samples, int channels) {
+    static_assert(sizeof(T) >= 2);
+    constexpr int kStep = 32 / sizeof(T);
+    int i = 0;
+    for (; i + kStep <= nb_samples; i += kStep) {
+        const __m256i l = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src[0] + i * sizeof(T)));
+        const __m256i r = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src[1] + i * sizeof(T)));
+        __m256i lo;
+        __m256i hi;
+        if constexpr (sizeof(T) == 2) {
+            lo = _mm256_unpacklo_epi16(l, r);
+            hi = _mm256_unpackhi_epi16(l, r);
+        } else if constexpr (sizeof(T) == 4) {
+            lo = _mm256_unpacklo_epi32(l, r);
+            hi = _mm256_unpackhi_epi32(l, r);
+        } else {
+            lo = _mm256_unpacklo_epi64(l, r);
+            hi = _mm256_unpackhi_epi64(l, r);
+        }
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i * 2 * sizeof(T)),
+                            _mm256_permute2x128_si256(lo, hi, 0x20));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i * 2 * sizeof(T) + 32),
+                            _mm256_permute2x128_si256(lo, hi, 0x31));
+    }
+    const uint8_t *tail[2] = {src[0] + i * sizeof(T), src[1] + i * sizeof(T)};
+    InterleaveScalar<T, 2>(dst + i * 2 * sizeof(T), tail, nb_samples - i, channels);
+}
+
+inline bool HasAvx2() {
+#ifdef _MSC_VER
+    int info[4] = {};
+    __cpuid(info, 1);
+    const bool os_avx = (info[2] & (1 << 27)) && (info[2] & (1 << 28)) && (_xgetbv(0) & 6) == 6;
+    __cpuidex(info, 7, 0);
+    return os_avx && (info[1] & (1 << 5));
+#else
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+
+template<typename T>
+InterleaveFn SelectInterleave(int channels, const char **name) {
+    switch (channels) {
+        case 1:
+            *name = "mono";
+            return InterleaveMono<T>;
+        case 2:
+            if constexpr (sizeof(T) >= 2) {
+#ifdef AUDIO_AVX2
+                static const bool avx2 = HasAvx2();
+                if (avx2) {
+                    *name = "stereo avx2";
+                    return InterleaveStereoAvx2<T>;
+                }
+#endif
+#ifdef AUDIO_SSE2
+                *name = "stereo sse2";
+                return InterleaveStereoSse2<T>;
+#endif
+            }
+            *name = "stereo";
+            return InterleaveScalar<T, 2>;
+        case 6:
+            *name = "5.1";
+            return InterleaveScalar<T, 6>;
+        case 8:
+            *name = "7.1";
+            return InterleaveScalar<T, 8>;
+        default:
+            *name = "generic";
+            return InterleaveScalar<T, 0>;
+    }
+}
+
+template<typename T>
+DeinterleaveFn SelectDeinterleave(int channels, const char **name) {
+    switch (channels) {
+        case 1:
+            *name = "mono";
+            return DeinterleaveMono<T>;
+        case 2:
+#ifdef AUDIO_SSE2
+            if constexpr (sizeof(T) >= 2) {
+                *name = "stereo sse2";
+                return DeinterleaveStereoSse2<T>;
+            }
+#endif
+            *name = "stereo";
+            return DeinterleaveScalar<T, 2>;
+        case 6:
+            *name = "5.1";
+            return DeinterleaveScalar<T, 6>;
+        case 8:
+            *name = "7.1";
+            return DeinterleaveScalar<T, 8>;
+        default:
+            *name = "generic";
+            return DeinterleaveScalar<T, 0>;
+    }
+}
+
+// planar sample_fmt (u8p/s16p/s32p/fltp/dblp/s64p), returns nullptr for packed formats
+inline InterleaveFn GetInterleaveKernel(AVSampleFormat sample_fmt, int channels, const char **name = nullptr) {
+    const char *kernel_name = nullptr;
+    if (!av_sample_fmt_is_planar(sample_fmt)) {
+        return nullptr;
+    }
+    InterleaveFn fn = nullptr;
+    switch (av_get_bytes_per_sample(sample_fmt)) {
+        case 1:
+            fn = SelectInterleave<uint8_t>(channels, &kernel_name);
+            break;
+        case 2:
+            fn = SelectInterleave<int16_t>(channels, &kernel_name);
+            break;
+        case 4:
+            fn = SelectInterleave<int32_t>(channels, &kernel_name);
+            break;
+        case 8:
+            fn = SelectInterleave<int64_t>(channels, &kernel_name);
+            break;
+        default:
+            break;
+    }
+    if (name) {
+        *name = kernel_name;
+    }
+    return fn;
+}
+
+inline DeinterleaveFn GetDeinterleaveKernel(AVSampleFormat sample_fmt, int channels, const char **name = nullptr) {
+    const char *kernel_name = nullptr;
+    if (!av_sample_fmt_is_planar(sample_fmt)) {
+        return nullptr;
+    }
+    DeinterleaveFn fn = nullptr;
+    switch (av_get_bytes_per_sample(sample_fmt)) {
+        case 1:
+            fn = SelectDeinterleave<uint8_t>(channels, &kernel_name);
+            break;
+        case 2:
+            fn = SelectDeinterleave<int16_t>(channels, &kernel_name);
+            break;
+        case 4:
+            fn = SelectDeinterleave<int32_t>(channels, &kernel_name);
+            break;
+        case 8:
+            fn = SelectDeinterleave<int64_t>(channels, &kernel_name);
+            break;
+        default:
+            break;
+    }
+    if (name) {
+        *name = kernel_name;
+    }
+    return fn;
+}
+
+#endif // DEMOS_COMMON_AUDIO_INTERLEAVE_H
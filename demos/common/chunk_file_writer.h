@@ -0,0 +1,256 @@
+// Threaded chunked file output shared by the remuxer (03), the yuv writer and the elementary stream extractor (04)
+#ifndef DEMOS_COMMON_CHUNK_FILE_WRITER_H
+#define DEMOS_COMMON_CHUNK_FILE_WRITER_H
+
+extern "C" {
+#include <libavutil/error.h>
+#include <libavformat/avio.h>
+}
+
+#include <chrono>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <condition_variable>
+
+// Collects output in large chunks, a writer thread writes every chunk with one unbuffered fwrite, so the producer
+// (decoder, muxer or demuxer) never waits for a small write. A fixed number of chunk buffers bounds the memory, the
+// producer blocks while all of them wait for the disk. Every chunk remembers its file offset, a seek (mp4
+// moov/mdat size, mkv cues) just starts a new chunk at the target offset
+class ChunkFileWriter {
+public:
+    ChunkFileWriter() = default;
+
+    ChunkFileWriter(const ChunkFileWriter &) = delete;
+
+    ChunkFileWriter &operator=(const ChunkFileWriter &) = delete;
+
+    ~ChunkFileWriter() { Close(); }
+
+    bool Open(const char *file_name, std::size_t chunk_size, std::size_t buffers) {
+        if ((fp_ = std::fopen(file_name, "wb")) == nullptr) {
+            return false;
+        }
+        std::setvbuf(fp_, nullptr, _IONBF, 0); // chunks are already large
+        chunk_size_ = std::max<std::size_t>(chunk_size, 1);
+        free_.resize(std::max<std::size_t>(buffers, 1)); // storage is allocated on first use
+        thread_ = std::thread(&ChunkFileWriter::WriterThread, this);
+        return true;
+    }
+
+    // size contiguous bytes at the current position, to be filled in place (e.g. by av_image_copy_to_buffer) and
+    // then passed to Commit. nullptr after a write error
+    uint8_t *Reserve(std::size_t size) {
+        if (has_current_ && current_.size > 0 && current_.size + size > current_.capacity) {
+            Submit();
+        }
+        if (!has_current_ && !Acquire()) {
+            return nullptr;
+        }
+        if (current_.capacity < current_.size + size) {
+            // the chunk is empty here: first use of the buffer, or a single request larger than chunk_size
+            current_.capacity = std::max(chunk_size_, size);
+            current_.data = std::make_unique<uint8_t[]>(current_.capacity);
+        }
+        if (current_.size == 0) {
+            current_.offset = pos_;
+        }
+        return current_.data.get() + current_.size;
+    }
+
+    // the first size bytes of the last Reserve are filled, returns false if any write failed so far
+    bool Commit(std::size_t size) {
+        current_.size += size;
+        pos_ += static_cast<int64_t>(size);
+        size_ = std::max(size_, pos_);
+        if (current_.size == current_.capacity) {
+            Submit();
+        }
+        std::lock_guard lock(mutex_);
+        return !io_error_;
+    }
+
+    bool Write(const uint8_t *data, std::size_t size) {
+        while (size > 0) {
+            const std::size_t room = has_current_ ? current_.capacity - current_.size : 0;
+            const std::size_t n = std::min(room > 0 ? room : chunk_size_, size);
+            uint8_t *dst = Reserve(n);
+            if (dst == nullptr) {
+                return false;
+            }
+            std::memcpy(dst, data, n);
+            if (!Commit(n)) {
+                return false;
+            }
+            data += n;
+            size -= n;
+        }
+        std::lock_guard lock(mutex_);
+        return !io_error_;
+    }
+
+    // the next write goes to pos
+    void Seek(int64_t pos) {
+        if (pos != pos_ && has_current_ && current_.size > 0) {
+            Submit();
+        }
+        pos_ = pos;
+    }
+
+    // write the last partial chunk and wait for the writer thread, returns false if any write failed
+    bool Close() {
+        if (fp_ == nullptr) {
+            return !io_error_;
+        }
+        if (has_current_ && current_.size > 0) {
+            Submit();
+        }
+        {
+            std::lock_guard lock(mutex_);
+            closing_ = true;
+        }
+        cv_.notify_all();
+        thread_.join();
+        io_error_ = std::fclose(fp_) != 0 || io_error_;
+        fp_ = nullptr;
+        return !io_error_;
+    }
+
+    int64_t BytesWritten() const {
+        std::lock_guard lock(mutex_);
+        return bytes_written_;
+    }
+
+    int64_t Writes() const {
+        std::lock_guard lock(mutex_);
+        return writes_;
+    }
+
+    // time the producer spent waiting for a free chunk buffer, i.e. the disk was the bottleneck
+    double WaitSeconds() const { return wait_seconds_; }
+
+    // write_packet and seek callbacks of a muxer's AVIOContext, opaque is the writer
+    static int WritePacket(void *opaque, const uint8_t *buf, int buf_size) {
+        auto *writer = static_cast<ChunkFileWriter *>(opaque);
+        return writer->Write(buf, static_cast<std::size_t>(buf_size)) ? buf_size : AVERROR(EIO);
+    }
+
+    static int64_t SeekPacket(void *opaque, int64_t offset, int whence) {
+        auto *writer = static_cast<ChunkFileWriter *>(opaque);
+        int64_t pos;
+        switch (whence & ~AVSEEK_FORCE) {
+            case AVSEEK_SIZE:
+                return writer->size_;
+            case SEEK_SET:
+                pos = offset;
+                break;
+            case SEEK_CUR:
+                pos = writer->pos_ + offset;
+                break;
+            case SEEK_END:
+                pos = writer->size_ + offset;
+                break;
+            default:
+                return AVERROR(EINVAL);
+        }
+        if (pos < 0) {
+            return AVERROR(EINVAL);
+        }
+        writer->Seek(pos);
+        return pos;
+    }
+
+private:
+    struct Chunk {
+        int64_t offset = 0;
+        std::unique_ptr<uint8_t[]> data;
+        std::size_t capacity = 0;
+        std::size_t size = 0;
+    };
+
+    static bool SeekFile(FILE *fp, int64_t offset) {
+#ifdef _WIN32
+        return _fseeki64(fp, offset, SEEK_SET) == 0;
+#else
+        return fseeko(fp, static_cast<off_t>(offset), SEEK_SET) == 0;
+#endif
+    }
+
+    bool Acquire() {
+        const auto start = std::chrono::steady_clock::now();
+        std::unique_lock lock(mutex_);
+        cv_.wait(lock, [this]() -> bool { return !free_.empty() || io_error_; });
+        wait_seconds_ += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (free_.empty()) {
+            return false;
+        }
+        current_ = std::move(free_.back());
+        free_.pop_back();
+        has_current_ = true;
+        return true;
+    }
+
+    void Submit() {
+        {
+            std::lock_guard lock(mutex_);
+            queue_.push_back(std::move(current_));
+        }
+        current_ = Chunk{};
+        has_current_ = false;
+        cv_.notify_all();
+    }
+
+    void WriterThread() {
+        int64_t file_pos = 0;
+        while (true) {
+            Chunk chunk;
+            {
+                std::unique_lock lock(mutex_);
+                cv_.wait(lock, [this]() -> bool { return !queue_.empty() || closing_; });
+                if (queue_.empty()) {
+                    break;
+                }
+                chunk = std::move(queue_.front());
+                queue_.pop_front();
+            }
+            bool ok = file_pos == chunk.offset || SeekFile(fp_, chunk.offset);
+            ok = ok && std::fwrite(chunk.data.get(), 1, chunk.size, fp_) == chunk.size;
+            file_pos = chunk.offset + static_cast<int64_t>(chunk.size);
+            {
+                std::lock_guard lock(mutex_);
+                io_error_ = io_error_ || !ok;
+                bytes_written_ += static_cast<int64_t>(chunk.size);
+                writes_++;
+                chunk.size = 0; // keeps the storage for the next chunk
+                free_.push_back(std::move(chunk));
+            }
+            cv_.notify_all();
+        }
+    }
+
+    FILE *fp_ = nullptr;
+    std::thread thread_;
+    mutable std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<Chunk> queue_;
+    std::vector<Chunk> free_;
+    bool closing_ = false;
+    bool io_error_ = false;
+    int64_t bytes_written_ = 0;
+    int64_t writes_ = 0;
+    // touched by the producing thread only
+    std::size_t chunk_size_ = 0;
+    Chunk current_;
+    bool has_current_ = false;
+    int64_t pos_ = 0;
+    int64_t size_ = 0;
+    double wait_seconds_ = 0.0;
+};
+
+#endif // DEMOS_COMMON_CHUNK_FILE_WRITER_H
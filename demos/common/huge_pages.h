@@ -0,0 +1,101 @@
+// Frame buffers on 2 MB huge pages, shared by the frame pool demo (03) and the huge page decoder (04)
+#ifndef DEMOS_COMMON_HUGE_PAGES_H
+#define DEMOS_COMMON_HUGE_PAGES_H
+
+extern "C" {
+#include <libavutil/buffer.h>
+}
+
+#include <cstddef>
+#include <cstdint>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+inline constexpr std::size_t kHugePageSize = 2 * 1024 * 1024;
+
+inline std::size_t AlignUp(std::size_t value, std::size_t align) {
+    return (value + align - 1) / align * align;
+}
+
+// opaque is the mapping size
+inline void FreeHugePageBuffer(void *opaque, uint8_t *data) {
+#ifdef _WIN32
+    (void) opaque;
+    VirtualFree(data, 0, MEM_RELEASE);
+#else
+    munmap(data, reinterpret_cast<std::size_t>(opaque));
+#endif
+}
+
+// Try explicit huge pages first (MAP_HUGETLB / MEM_LARGE_PAGES, both need a reserved pool or privilege), then
+// fall back to a normal mapping, advised for transparent huge pages on Linux. THP only backs 2 MB aligned
+// ranges, so the fallback maps one huge page more, trims the unaligned head and tail and keeps a 2 MB aligned
+// mapping of whole huge pages. huge_tlb, if given, tells whether explicit huge pages were used
+inline AVBufferRef *AllocHugePageBuffer(std::size_t size, bool *huge_tlb = nullptr) {
+    void *data = nullptr;
+    std::size_t mapping_size = size; // freed by FreeHugePageBuffer
+    bool explicit_pages = false;
+#ifdef _WIN32
+    const std::size_t large_page = GetLargePageMinimum();
+    if (large_page > 0) {
+        data = VirtualAlloc(nullptr, AlignUp(size, large_page), MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES,
+                            PAGE_READWRITE);
+        explicit_pages = data != nullptr;
+    }
+    if (data == nullptr) {
+        data = VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    }
+#else
+    mapping_size = AlignUp(size, kHugePageSize);
+    data = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    data = mmap(nullptr, mapping_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    explicit_pages = data != MAP_FAILED;
+#endif
+    if (data == MAP_FAILED) {
+        void *base = mmap(nullptr, mapping_size + kHugePageSize, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED) {
+            return nullptr;
+        }
+        const auto address = reinterpret_cast<uintptr_t>(base);
+        const uintptr_t aligned = AlignUp(address, kHugePageSize);
+        if (aligned > address) {
+            munmap(base, aligned - address);
+        }
+        const uintptr_t tail = address + mapping_size + kHugePageSize - (aligned + mapping_size);
+        if (tail > 0) {
+            munmap(reinterpret_cast<void *>(aligned + mapping_size), tail);
+        }
+        data = reinterpret_cast<void *>(aligned);
+#ifdef MADV_HUGEPAGE
+        madvise(data, mapping_size, MADV_HUGEPAGE);
+#endif
+    }
+#endif
+    if (data == nullptr) {
+        return nullptr;
+    }
+    AVBufferRef *buf = av_buffer_create(static_cast<uint8_t *>(data), size, FreeHugePageBuffer,
+                                        reinterpret_cast<void *>(mapping_size), 0);
+    if (buf == nullptr) {
+        FreeHugePageBuffer(reinterpret_cast<void *>(mapping_size), static_cast<uint8_t *>(data));
+        return nullptr;
+    }
+    if (huge_tlb) {
+        *huge_tlb = explicit_pages;
+    }
+    return buf;
+}
+
+#endif // DEMOS_COMMON_HUGE_PAGES_H
@@ -0,0 +1,123 @@
+// Read-only memory mapping of a whole file, shared by the demos that parse or demux straight from the mapping
+#ifndef DEMOS_COMMON_MAPPED_FILE_H
+#define DEMOS_COMMON_MAPPED_FILE_H
+
+#include <cstddef>
+#include <cstdint>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+class MappedFile {
+public:
+    MappedFile() = default;
+
+    MappedFile(const MappedFile &) = delete;
+
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    ~MappedFile() { Close(); }
+
+    // sequential: read ahead for a front to back pass, otherwise hint random access (e.g. binary search)
+    bool Open(const char *file_name, bool sequential = true) {
+        Close();
+#ifdef _WIN32
+        file_ = CreateFileA(file_name, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                            sequential ? FILE_FLAG_SEQUENTIAL_SCAN : FILE_FLAG_RANDOM_ACCESS, nullptr);
+        if (file_ == INVALID_HANDLE_VALUE) {
+            return false;
+        }
+        LARGE_INTEGER file_size;
+        FILETIME write_time;
+        if (!GetFileSizeEx(file_, &file_size) || file_size.QuadPart == 0 ||
+            !GetFileTime(file_, nullptr, nullptr, &write_time)) {
+            Close();
+            return false;
+        }
+        modified_time_ = static_cast<int64_t>((static_cast<uint64_t>(write_time.dwHighDateTime) << 32) |
+                                              write_time.dwLowDateTime);
+        mapping_ = CreateFileMappingA(file_, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (mapping_ == nullptr) {
+            Close();
+            return false;
+        }
+        data_ = static_cast<const uint8_t *>(MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0));
+        size_ = static_cast<std::size_t>(file_size.QuadPart);
+#else
+        fd_ = open(file_name, O_RDONLY);
+        if (fd_ < 0) {
+            return false;
+        }
+        struct stat st{};
+        if (fstat(fd_, &st) < 0 || st.st_size == 0) {
+            Close();
+            return false;
+        }
+#ifdef __APPLE__
+        modified_time_ = static_cast<int64_t>(st.st_mtimespec.tv_sec) * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+        modified_time_ = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+        void *addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd_, 0);
+        data_ = addr == MAP_FAILED ? nullptr : static_cast<const uint8_t *>(addr);
+        size_ = static_cast<std::size_t>(st.st_size);
+        if (data_) {
+            madvise(addr, size_, sequential ? MADV_SEQUENTIAL : MADV_RANDOM);
+        }
+#endif
+        if (data_ == nullptr) {
+            Close();
+            return false;
+        }
+        return true;
+    }
+
+    void Close() {
+#ifdef _WIN32
+        if (data_) UnmapViewOfFile(data_);
+        if (mapping_) CloseHandle(mapping_);
+        if (file_ != INVALID_HANDLE_VALUE) CloseHandle(file_);
+        mapping_ = nullptr;
+        file_ = INVALID_HANDLE_VALUE;
+#else
+        if (data_) munmap(const_cast<uint8_t *>(data_), size_);
+        if (fd_ >= 0) close(fd_);
+        fd_ = -1;
+#endif
+        data_ = nullptr;
+        size_ = 0;
+        modified_time_ = 0;
+    }
+
+    const uint8_t *Data() const { return data_; }
+
+    std::size_t Size() const { return size_; }
+
+    // last write time in the platform's own unit, only compared for equality
+    int64_t ModifiedTime() const { return modified_time_; }
+
+private:
+    const uint8_t *data_ = nullptr;
+    std::size_t size_ = 0;
+    int64_t modified_time_ = 0;
+#ifdef _WIN32
+    HANDLE file_ = INVALID_HANDLE_VALUE;
+    HANDLE mapping_ = nullptr;
+#else
+    int fd_ = -1;
+#endif
+};
+
+#endif // DEMOS_COMMON_MAPPED_FILE_H